@@ -0,0 +1,214 @@
+#include "allocator.h"
+
+#include <string.h>
+
+/* Arena allocations are aligned for any field a caller may keep in them. */
+#define BSON_ARENA_ALIGN 8
+#define BSON_ARENA_ROUND( size ) ( ( ( size ) + BSON_ARENA_ALIGN - 1 ) & ~( size_t )( BSON_ARENA_ALIGN - 1 ) )
+
+/* The header is padded to a multiple of BSON_ARENA_ALIGN. */
+#define BSON_ARENA_DATA( block ) ( ( char * )( block ) + BSON_ARENA_ROUND( sizeof( bson_arena_block ) ) )
+
+static void *bson_arena_malloc_func( void *context, size_t size ) {
+    return bson_arena_alloc( ( bson_arena * )context, size );
+}
+
+static void *bson_arena_realloc_func( void *context, void *ptr, size_t old_size, size_t size ) {
+    bson_arena *arena = ( bson_arena * )context;
+    bson_arena_block *block = arena->blocks;
+    char *data;
+
+    /* The newest allocation grows in place while its block has room. */
+    if ( ptr && ptr == arena->last ) {
+        data = BSON_ARENA_DATA( block );
+        if ( ( size_t )( arena->last - data ) + BSON_ARENA_ROUND( size ) <= block->size ) {
+            block->used = ( arena->last - data ) + BSON_ARENA_ROUND( size );
+            return ptr;
+        }
+    }
+
+    data = ( char * )bson_arena_alloc( arena, size );
+    if ( ptr )
+        memcpy( data, ptr, old_size < size ? old_size : size );
+    return data;
+}
+
+static void bson_arena_free_func( void *context, void *ptr, size_t size ) {
+    bson_arena *arena = ( bson_arena * )context;
+
+    if ( ptr && ptr == arena->last ) {
+        arena->blocks->used = arena->last - BSON_ARENA_DATA( arena->blocks );
+        arena->last = NULL;
+    }
+}
+
+MONGO_EXPORT void bson_arena_init( bson_arena *arena, size_t block_size ) {
+    arena->allocator.malloc_func = bson_arena_malloc_func;
+    arena->allocator.realloc_func = bson_arena_realloc_func;
+    arena->allocator.free_func = bson_arena_free_func;
+    arena->allocator.context = arena;
+    arena->blocks = NULL;
+    arena->block_size = BSON_ARENA_ROUND( block_size ? block_size : BSON_ARENA_BLOCK_SIZE );
+    arena->last = NULL;
+}
+
+MONGO_EXPORT void *bson_arena_alloc( bson_arena *arena, size_t size ) {
+    bson_arena_block *block = arena->blocks;
+    size_t block_size;
+
+    size = BSON_ARENA_ROUND( size ? size : 1 );
+    if ( !block || block->size - block->used < size ) {
+        block_size = size > arena->block_size ? size : arena->block_size;
+        block = ( bson_arena_block * )bson_malloc( BSON_ARENA_ROUND( sizeof( bson_arena_block ) ) + block_size );
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+    }
+
+    arena->last = BSON_ARENA_DATA( block ) + block->used;
+    block->used += size;
+    return arena->last;
+}
+
+MONGO_EXPORT void bson_arena_reset( bson_arena *arena ) {
+    bson_arena_block *block = arena->blocks, *next;
+
+    if ( !block )
+        return;
+
+    for ( next = block->next; next; next = block->next ) {
+        block->next = next->next;
+        bson_free( next );
+    }
+    block->used = 0;
+    arena->last = NULL;
+}
+
+MONGO_EXPORT void bson_arena_destroy( bson_arena *arena ) {
+    bson_arena_block *block, *next;
+
+    for ( block = arena->blocks; block; block = next ) {
+        next = block->next;
+        bson_free( block );
+    }
+    arena->blocks = NULL;
+    arena->last = NULL;
+}
+
+/* Size class of an allocation, or BSON_SLAB_CLASSES if it is too big for one. */
+static int bson_slab_class_of( size_t size ) {
+    int class_index = 0;
+
+    while ( class_index < BSON_SLAB_CLASSES && ( ( size_t )BSON_SLAB_MIN_SIZE << class_index ) < size )
+        class_index++;
+    return class_index;
+}
+
+/* Chunks are carved after a header that links the slab into its class. */
+#define BSON_SLAB_HEADER 16
+
+static void *bson_slab_malloc_func( void *context, size_t size ) {
+    return bson_slab_alloc( ( bson_slab * )context, size );
+}
+
+static void *bson_slab_realloc_func( void *context, void *ptr, size_t old_size, size_t size ) {
+    bson_slab *slab = ( bson_slab * )context;
+    int class_index = bson_slab_class_of( size );
+    void *moved;
+
+    if ( !ptr )
+        return bson_slab_alloc( slab, size );
+    if ( class_index == BSON_SLAB_CLASSES && bson_slab_class_of( old_size ) == BSON_SLAB_CLASSES )
+        return bson_realloc( ptr, size );
+    if ( class_index < BSON_SLAB_CLASSES && class_index == bson_slab_class_of( old_size ) )
+        return ptr;
+
+    moved = bson_slab_alloc( slab, size );
+    memcpy( moved, ptr, old_size < size ? old_size : size );
+    bson_slab_free( slab, ptr, old_size );
+    return moved;
+}
+
+static void bson_slab_free_func( void *context, void *ptr, size_t size ) {
+    bson_slab_free( ( bson_slab * )context, ptr, size );
+}
+
+MONGO_EXPORT void bson_slab_init( bson_slab *slab ) {
+    int i;
+
+    slab->allocator.malloc_func = bson_slab_malloc_func;
+    slab->allocator.realloc_func = bson_slab_realloc_func;
+    slab->allocator.free_func = bson_slab_free_func;
+    slab->allocator.context = slab;
+    for ( i = 0; i < BSON_SLAB_CLASSES; i++ ) {
+        spinLock_init( &slab->classes[i].lock );
+        slab->classes[i].free = NULL;
+        slab->classes[i].slabs = NULL;
+    }
+}
+
+MONGO_EXPORT void *bson_slab_alloc( bson_slab *slab, size_t size ) {
+    int class_index = bson_slab_class_of( size );
+    bson_slab_class *size_class;
+    size_t chunk_size;
+    char *carved, *chunk;
+    void *ptr;
+
+    if ( class_index == BSON_SLAB_CLASSES )
+        return bson_malloc( size );
+
+    size_class = &slab->classes[class_index];
+    spinLock_lock( &size_class->lock );
+    if ( !size_class->free ) {
+        /* Carve a new slab into the free list. Allocating under the lock
+         * keeps the lists simple, and it happens once per slab. */
+        chunk_size = ( size_t )BSON_SLAB_MIN_SIZE << class_index;
+        carved = ( char * )bson_malloc( BSON_SLAB_HEADER + BSON_SLAB_SIZE );
+        *( void ** )carved = size_class->slabs;
+        size_class->slabs = carved;
+        for ( chunk = carved + BSON_SLAB_HEADER; chunk + chunk_size <= carved + BSON_SLAB_HEADER + BSON_SLAB_SIZE;
+                chunk += chunk_size ) {
+            *( void ** )chunk = size_class->free;
+            size_class->free = chunk;
+        }
+    }
+    ptr = size_class->free;
+    size_class->free = *( void ** )ptr;
+    spinLock_unlock( &size_class->lock );
+
+    return ptr;
+}
+
+MONGO_EXPORT void bson_slab_free( bson_slab *slab, void *ptr, size_t size ) {
+    int class_index = bson_slab_class_of( size );
+    bson_slab_class *size_class;
+
+    if ( !ptr )
+        return;
+    if ( class_index == BSON_SLAB_CLASSES ) {
+        bson_free( ptr );
+        return;
+    }
+
+    size_class = &slab->classes[class_index];
+    spinLock_lock( &size_class->lock );
+    *( void ** )ptr = size_class->free;
+    size_class->free = ptr;
+    spinLock_unlock( &size_class->lock );
+}
+
+MONGO_EXPORT void bson_slab_destroy( bson_slab *slab ) {
+    void *carved, *next;
+    int i;
+
+    for ( i = 0; i < BSON_SLAB_CLASSES; i++ ) {
+        for ( carved = slab->classes[i].slabs; carved; carved = next ) {
+            next = *( void ** )carved;
+            bson_free( carved );
+        }
+        slab->classes[i].slabs = NULL;
+        slab->classes[i].free = NULL;
+        spinLock_destroy( &slab->classes[i].lock );
+    }
+}
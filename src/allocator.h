@@ -0,0 +1,74 @@
+#ifndef BSON_ALLOCATOR_H_
+#define BSON_ALLOCATOR_H_
+
+#include "bson.h"
+#include "spin_lock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Allocators to hand to bson_init_with_allocator( ). Both get their
+ * memory in large pieces from bson_malloc( ). */
+
+typedef struct bson_arena_block {
+    struct bson_arena_block *next;    /**< The block filled before this one. */
+    size_t size;                      /**< Bytes that follow the header. */
+    size_t used;                      /**< Bytes handed out so far. */
+} bson_arena_block;
+
+/**
+ * A bump allocator: every allocation takes the next bytes of the current
+ * block, and nothing is given back until bson_arena_reset( ) releases
+ * everything at once. Only the most recent allocation can grow or be
+ * freed in place, which is the one a bson being built keeps growing.
+ * An arena is not thread safe; give each thread or request its own.
+ */
+typedef struct bson_arena {
+    bson_allocator allocator;         /**< Pass &arena->allocator to bson_init_with_allocator( ). */
+    bson_arena_block *blocks;         /**< The current block, then older ones. */
+    size_t block_size;                /**< Size of each new block. */
+    char *last;                       /**< The most recent allocation, or NULL. */
+} bson_arena;
+
+#define BSON_ARENA_BLOCK_SIZE ( 64 * 1024 )
+
+/* block_size 0 means BSON_ARENA_BLOCK_SIZE. */
+MONGO_EXPORT void bson_arena_init( bson_arena *arena, size_t block_size );
+MONGO_EXPORT void *bson_arena_alloc( bson_arena *arena, size_t size );
+/* Release every allocation, keeping the current block for reuse. */
+MONGO_EXPORT void bson_arena_reset( bson_arena *arena );
+MONGO_EXPORT void bson_arena_destroy( bson_arena *arena );
+
+#define BSON_SLAB_MIN_SIZE 64
+#define BSON_SLAB_CLASSES 7           /* 64, 128, ... 4096 bytes */
+#define BSON_SLAB_SIZE ( 64 * 1024 )
+
+typedef struct {
+    spin_lock lock;                   /**< Protects both lists. */
+    void *free;                       /**< Free chunks, linked through their first word. */
+    void *slabs;                      /**< Slabs carved up so far, linked the same way. */
+} bson_slab_class;
+
+/**
+ * A thread-safe allocator of power-of-two chunks from 64 bytes to 4KB,
+ * carved from BSON_SLAB_SIZE slabs and recycled through a free list per
+ * size. Larger requests go to bson_malloc( ). Memory returns to the
+ * system only when the slab allocator is destroyed.
+ */
+typedef struct bson_slab {
+    bson_allocator allocator;         /**< Pass &slab->allocator to bson_init_with_allocator( ). */
+    bson_slab_class classes[BSON_SLAB_CLASSES];
+} bson_slab;
+
+MONGO_EXPORT void bson_slab_init( bson_slab *slab );
+MONGO_EXPORT void *bson_slab_alloc( bson_slab *slab, size_t size );
+/* size must be the size the memory was allocated with. */
+MONGO_EXPORT void bson_slab_free( bson_slab *slab, void *ptr, size_t size );
+MONGO_EXPORT void bson_slab_destroy( bson_slab *slab );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
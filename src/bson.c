@@ -324,7 +324,88 @@ MONGO_EXPORT void bson_iterator_from_buffer( bson_iterator *i, const char *buffe
     i->first = 1;
 }
 
+/* Open-addressed hash of a finished object's keys, at most half full. */
+typedef struct bson_index {
+    int mask;       /* number of slots - 1 */
+    int offsets[1]; /* offset of each element from data; 0 marks an empty slot */
+} bson_index;
+
+static unsigned int bson_key_hash( const char *key, size_t len ) {
+    unsigned int hash = 2166136261u;
+
+    while ( len-- ) {
+        hash ^= ( unsigned char )*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void bson_index_build( bson *b ) {
+    bson_iterator it;
+    bson_index *index;
+    const char *key;
+    int count = 0, slots = 8, slot, offset;
+
+    bson_iterator_init( &it, b );
+    while ( bson_iterator_next( &it ) )
+        count++;
+    while ( slots < count * 2 )
+        slots <<= 1;
+
+    index = ( bson_index * )bson_malloc( sizeof( bson_index ) + ( slots - 1 ) * sizeof( int ) );
+    index->mask = slots - 1;
+    memset( index->offsets, 0, slots * sizeof( int ) );
+
+    bson_iterator_init( &it, b );
+    while ( bson_iterator_next( &it ) ) {
+        key = bson_iterator_key( &it );
+        slot = bson_key_hash( key, strlen( key ) ) & index->mask;
+        /* A repeated key keeps its first element, the one a walk would find. */
+        while ( ( offset = index->offsets[slot] ) != 0 && strcmp( b->data + offset + 1, key ) != 0 )
+            slot = ( slot + 1 ) & index->mask;
+        if ( offset == 0 )
+            index->offsets[slot] = ( int )( it.cur - b->data );
+    }
+
+    b->index = index;
+}
+
+/* Look up the field named by the len bytes at name. */
+static bson_type bson_index_find( bson_iterator *it, const bson *obj, const char *name, size_t len ) {
+    const bson_index *index = obj->index;
+    int slot = bson_key_hash( name, len ) & index->mask;
+    int offset;
+    const char *key;
+
+    it->first = 0;
+    while ( ( offset = index->offsets[slot] ) != 0 ) {
+        key = obj->data + offset + 1;
+        if ( strncmp( key, name, len ) == 0 && key[len] == '\0' ) {
+            it->cur = obj->data + offset;
+            return bson_iterator_type( it );
+        }
+        slot = ( slot + 1 ) & index->mask;
+    }
+
+    /* Leave the iterator where a walk would: on the terminating EOO. */
+    it->cur = obj->data + bson_size( obj ) - 1;
+    return BSON_EOO;
+}
+
+MONGO_EXPORT int bson_enable_index( bson *obj ) {
+    if ( !obj->finished || !obj->data )
+        return BSON_ERROR;
+    if ( obj->index )
+        bson_free( obj->index );
+    bson_index_build( obj );
+    obj->indexed = 1;
+    return BSON_OK;
+}
+
 MONGO_EXPORT bson_type bson_find( bson_iterator *it, const bson *obj, const char *name ) {
+    if ( obj->indexed && obj->index )
+        return bson_index_find( it, obj, name, strlen( name ) );
+
     bson_iterator_init( it, (bson *)obj );
     while( bson_iterator_next( it ) ) {
         if ( strcmp( name, bson_iterator_key( it ) ) == 0 )
@@ -333,6 +414,179 @@ MONGO_EXPORT bson_type bson_find( bson_iterator *it, const bson *obj, const char
     return bson_iterator_type( it );
 }
 
+/* Walk the object in buffer to the field named by the len bytes at name. */
+static bson_type bson_find_name( bson_iterator *it, const char *buffer, const char *name, size_t len ) {
+    const char *key;
+
+    bson_iterator_from_buffer( it, buffer );
+    while ( bson_iterator_next( it ) ) {
+        key = bson_iterator_key( it );
+        if ( strncmp( key, name, len ) == 0 && key[len] == '\0' )
+            break;
+    }
+    return bson_iterator_type( it );
+}
+
+/* Find the next name of a path: in obj itself, through its index if it
+ * has one, or in the subobject it is on. */
+static bson_type bson_find_step( bson_iterator *it, const bson *obj, const char *name, size_t len,
+                                 bson_bool_t top ) {
+    if ( !top )
+        return bson_find_name( it, bson_iterator_value( it ), name, len );
+    if ( obj->indexed && obj->index )
+        return bson_index_find( it, obj, name, len );
+    return bson_find_name( it, obj->data, name, len );
+}
+
+/* A path that runs into a field which is not an object or array ends at the end of obj. */
+static bson_type bson_find_dead_end( bson_iterator *it, const bson *obj ) {
+    it->cur = obj->data + bson_size( obj ) - 1;
+    it->first = 0;
+    return BSON_EOO;
+}
+
+MONGO_EXPORT bson_type bson_find_path( bson_iterator *it, const bson *obj, const char *path ) {
+    bson_type type;
+    size_t len;
+    bson_bool_t top = 1;
+
+    for ( ;; ) {
+        len = strcspn( path, "." );
+        type = bson_find_step( it, obj, path, len, top );
+        if ( path[len] == '\0' || type == BSON_EOO )
+            return type;
+        if ( type != BSON_OBJECT && type != BSON_ARRAY )
+            return bson_find_dead_end( it, obj );
+        path += len + 1;
+        top = 0;
+    }
+}
+
+MONGO_EXPORT int bson_path_compile( bson_path *path, const char *dotted ) {
+    size_t size = strlen( dotted ) + 1;
+    int depth = 1, i;
+    char *names;
+    const char *p;
+
+    for ( p = dotted; *p; p++ )
+        if ( *p == '.' )
+            depth++;
+
+    /* One block: the name pointers, their lengths, then the names. */
+    path->depth = depth;
+    path->names = ( const char ** )bson_malloc( depth * ( sizeof( char * ) + sizeof( size_t ) ) + size );
+    path->lengths = ( size_t * )( path->names + depth );
+    names = ( char * )( path->lengths + depth );
+    memcpy( names, dotted, size );
+
+    for ( i = 0; i < depth; i++ ) {
+        path->names[i] = names;
+        path->lengths[i] = strcspn( names, "." );
+        names[path->lengths[i]] = '\0';
+        names += path->lengths[i] + 1;
+        if ( path->lengths[i] == 0 ) {
+            bson_path_destroy( path );
+            return BSON_ERROR;
+        }
+    }
+
+    return BSON_OK;
+}
+
+MONGO_EXPORT void bson_path_destroy( bson_path *path ) {
+    bson_free( ( void * )path->names );
+    path->names = NULL;
+    path->lengths = NULL;
+    path->depth = 0;
+}
+
+MONGO_EXPORT bson_type bson_find_compiled_path( bson_iterator *it, const bson *obj, const bson_path *path ) {
+    bson_type type;
+    int i;
+
+    for ( i = 0; ; i++ ) {
+        type = bson_find_step( it, obj, path->names[i], path->lengths[i], i == 0 );
+        if ( i == path->depth - 1 || type == BSON_EOO )
+            return type;
+        if ( type != BSON_OBJECT && type != BSON_ARRAY )
+            return bson_find_dead_end( it, obj );
+    }
+}
+
+/* Walk the object in buffer once for the paths listed in pending, each
+ * of which has matched up to starts[p] so far. Paths are struck from
+ * pending as the first field with their next name decides them. */
+static int bson_find_many_in( const char *buffer, bson_iterator *its, const char **paths,
+                              size_t *starts, int *pending, int count ) {
+    bson_iterator it;
+    int local[16];
+    int *nested = count <= 16 ? local : ( int * )bson_malloc( count * sizeof( int ) );
+    int found = 0, left = count, i, n, p;
+    const char *key, *segment;
+    size_t len;
+    bson_type type;
+
+    bson_iterator_from_buffer( &it, buffer );
+    while ( left > 0 && ( type = bson_iterator_next( &it ) ) ) {
+        key = bson_iterator_key( &it );
+        n = 0;
+        for ( i = 0; i < count; i++ ) {
+            if ( ( p = pending[i] ) < 0 )
+                continue;
+            segment = paths[p] + starts[p];
+            len = strcspn( segment, "." );
+            if ( strncmp( key, segment, len ) != 0 || key[len] != '\0' )
+                continue;
+
+            pending[i] = -1;
+            left--;
+            if ( segment[len] == '\0' ) {
+                its[p] = it;
+                found++;
+            }
+            else if ( type == BSON_OBJECT || type == BSON_ARRAY ) {
+                starts[p] += len + 1;
+                nested[n++] = p;
+            }
+        }
+
+        if ( n > 0 )
+            found += bson_find_many_in( bson_iterator_value( &it ), its, paths, starts, nested, n );
+    }
+
+    if ( nested != local )
+        bson_free( nested );
+    return found;
+}
+
+MONGO_EXPORT int bson_find_many( bson_iterator *its, const bson *obj, const char **paths, int count ) {
+    size_t local_starts[16];
+    int local_pending[16];
+    size_t *starts = local_starts;
+    int *pending = local_pending;
+    int found, i;
+
+    if ( count > 16 ) {
+        starts = ( size_t * )bson_malloc( count * sizeof( size_t ) );
+        pending = ( int * )bson_malloc( count * sizeof( int ) );
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        its[i].cur = obj->data + bson_size( obj ) - 1;
+        its[i].first = 0;
+        starts[i] = 0;
+        pending[i] = i;
+    }
+
+    found = bson_find_many_in( obj->data, its, paths, starts, pending, count );
+
+    if ( starts != local_starts ) {
+        bson_free( starts );
+        bson_free( pending );
+    }
+    return found;
+}
+
 MONGO_EXPORT bson_bool_t bson_iterator_more( const bson_iterator *i ) {
     return *( i->cur );
 }
@@ -627,11 +881,53 @@ MONGO_EXPORT int bson_init( bson *b ) {
     return bson_init_size( b, initialBufferSize );
 }
 
-int bson_init_size( bson *b, int size ) {
+/* A bson's data and stack come from its allocator, if it has one. */
+static void *_bson_alloc_block( bson *b, size_t size ) {
+    if ( b->allocator )
+        return b->allocator->malloc_func( b->allocator->context, size );
+    return bson_malloc( size );
+}
+
+static void *_bson_realloc_block( bson *b, void *ptr, size_t old_size, size_t size ) {
+    if ( b->allocator )
+        return b->allocator->realloc_func( b->allocator->context, ptr, old_size, size );
+    return bson_realloc( ptr, size );
+}
+
+static void _bson_free_block( bson *b, void *ptr, size_t size ) {
+    if ( b->allocator )
+        b->allocator->free_func( b->allocator->context, ptr, size );
+    else
+        bson_free( ptr );
+}
+
+MONGO_EXPORT int bson_init_size( bson *b, int size ) {
+    return bson_init_with_allocator( b, size, NULL );
+}
+
+MONGO_EXPORT int bson_init_with_hint( bson *b, bson_size_hint *hint ) {
+    int result = bson_init_size( b, hint->count ? hint->size : initialBufferSize );
+    b->hint = hint;
+    return result;
+}
+
+/* Jump up to a larger document at once, but only drift down by an eighth
+ * of the difference, so one small document does not undersize the rest. */
+static void _bson_size_hint_record( bson_size_hint *hint, int size ) {
+    if ( !hint->count || size > hint->size )
+        hint->size = size;
+    else
+        hint->size -= ( hint->size - size ) / 8;
+    if ( hint->count < INT_MAX )
+        hint->count++;
+}
+
+MONGO_EXPORT int bson_init_with_allocator( bson *b, int size, bson_allocator *allocator ) {
     _bson_zero( b );
+    b->allocator = allocator;
     if( size != 0 )
     {
-        char * data = (char *) bson_malloc( size );
+        char * data = (char *) _bson_alloc_block( b, size );
         if (data == NULL) return BSON_ERROR;
         b->data = data;
         b->dataSize = size;
@@ -657,7 +953,7 @@ static int _bson_append_grow_stack( bson * b ) {
     }
     else if ( b->stackPtr == b->stack ) {
         // Once we require additional capacity, set up a dynamically resized stack
-        size_t *new_stack = ( size_t * ) bson_malloc( 2 * sizeof( b->stack ) );
+        size_t *new_stack = ( size_t * ) _bson_alloc_block( b, 2 * sizeof( b->stack ) );
         if ( new_stack ) {
             b->stackPtr = new_stack;
             b->stackSize = 2 * sizeof( b->stack ) / sizeof( size_t );
@@ -669,7 +965,8 @@ static int _bson_append_grow_stack( bson * b ) {
     }
     else {
         // Double the capacity of the dynamically-resized stack
-        size_t *new_stack = ( size_t * ) bson_realloc( b->stackPtr, ( b->stackSize * 2 ) * sizeof( size_t ) );
+        size_t *new_stack = ( size_t * ) _bson_realloc_block( b, b->stackPtr, b->stackSize * sizeof( size_t ),
+                                                              ( b->stackSize * 2 ) * sizeof( size_t ) );
         if ( new_stack ) {
             b->stackPtr = new_stack;
             b->stackSize *= 2;
@@ -714,23 +1011,23 @@ MONGO_EXPORT int bson_ensure_space( bson *b, const size_t bytesNeeded ) {
     if ( pos + bytesNeeded <= (size_t) b->dataSize )
         return BSON_OK;
 
-    new_size = (int) ( 1.5 * ( b->dataSize + bytesNeeded ) );
-
-    if( new_size < b->dataSize ) {
-        if( ( b->dataSize + bytesNeeded ) < INT_MAX )
-            new_size = INT_MAX;
-        else {
-            b->err = BSON_SIZE_OVERFLOW;
-            return BSON_ERROR;
-        }
+    if ( pos + bytesNeeded > INT_MAX ) {
+        b->err = BSON_SIZE_OVERFLOW;
+        return BSON_ERROR;
     }
 
+    /* Doubling reaches a large document in half the copies that growing
+     * by half did; a bson_size_hint avoids most of them altogether. */
+    new_size = b->dataSize < initialBufferSize ? initialBufferSize : b->dataSize;
+    while ( ( size_t ) new_size < pos + bytesNeeded )
+        new_size = new_size > INT_MAX / 2 ? INT_MAX : new_size * 2;
+
     if ( ! b->ownsData ) {
         b->err = BSON_DOES_NOT_OWN_DATA;
         return BSON_ERROR;
     }
 
-    b->data = bson_realloc( b->data, new_size );
+    b->data = _bson_realloc_block( b, b->data, b->dataSize, new_size );
     if ( !b->data )
         bson_fatal_msg( !!b->data, "realloc() failed" );
 
@@ -757,6 +1054,8 @@ MONGO_EXPORT int bson_finish( bson *b ) {
         i = ( int ) _bson_position(b);
         bson_little_endian32( b->data, &i );
         b->finished = 1;
+        if ( b->hint )
+            _bson_size_hint_record( b->hint, i );
     }
 
     return BSON_OK;
@@ -765,15 +1064,22 @@ MONGO_EXPORT int bson_finish( bson *b ) {
 MONGO_EXPORT void bson_destroy( bson *b ) {
     if ( b ) {
         if ( b->ownsData && b->data != NULL ) {
-            bson_free( b->data );
+            _bson_free_block( b, b->data, b->dataSize );
         }
         b->data = NULL;
         b->dataSize = 0;
         b->ownsData = 0;        
         if ( b->stackPtr && b->stackPtr != b->stack ) {
-            bson_free( b->stackPtr );
+            _bson_free_block( b, b->stackPtr, b->stackSize * sizeof( size_t ) );
             b->stackPtr = NULL;
         }
+        if ( b->index ) {
+            bson_free( b->index );
+            b->index = NULL;
+        }
+        b->indexed = 0;
+        b->allocator = NULL;
+        b->hint = NULL;
         b->stackSize = 0;
         b->stackPos = 0;
         b->err = 0;
@@ -135,6 +135,41 @@ typedef struct {
     bson_bool_t first;
 } bson_iterator;
 
+struct bson_index;
+
+/**
+ * Where a bson object gets its buffer from, in place of the global
+ * bson_malloc( ) family; see bson_init_with_allocator( ) and the arena
+ * and slab allocators in allocator.h. The size of each block is passed
+ * back on realloc and free, so allocators need not record it.
+ */
+typedef struct bson_allocator {
+    void *( *malloc_func )( void *context, size_t size );
+    void *( *realloc_func )( void *context, void *ptr, size_t old_size, size_t size );
+    void ( *free_func )( void *context, void *ptr, size_t size );
+    void *context;                    /**< Passed to each function. */
+} bson_allocator;
+
+/**
+ * Size statistics for one shape of document, such as the documents built
+ * at one call site. Zero-initialize it, usually as a static, and pass it
+ * to bson_init_with_hint( ) so each new buffer starts at the size the
+ * previous ones finished at.
+ *
+ * @note A hint is not thread safe; give each thread its own.
+ */
+typedef struct {
+    int size;                 /**< Expected finished size of the next document. */
+    int count;                /**< Documents finished so far; 0 until the first. */
+} bson_size_hint;
+
+/** A dotted path parsed by bson_path_compile( ). */
+typedef struct {
+    int depth;            /**< Number of names in the path. */
+    const char **names;   /**< Each name, NUL-terminated. */
+    size_t *lengths;      /**< Length of each name. */
+} bson_path;
+
 typedef struct {
     char *data;           /**< Pointer to a block of data in this BSON object. */
     char *cur;            /**< Pointer to the current position. */
@@ -142,6 +177,10 @@ typedef struct {
     bson_bool_t finished; /**< When finished, the BSON object can no longer be modified. */
     bson_bool_t ownsData; /**< Whether destroying this object will deallocate its data block */
     int err;              /**< Bitfield representing errors or warnings on this buffer */
+    bson_bool_t indexed;  /**< Whether bson_find( ) looks keys up in index; see bson_enable_index( ) */
+    struct bson_index *index; /**< Hash of key to element offset, built by bson_enable_index( ) */
+    bson_allocator *allocator; /**< Allocates data and the stack; the bson_malloc( ) family if NULL */
+    bson_size_hint *hint; /**< Told the finished size by bson_finish( ), or NULL */
     int stackSize;        /**< Number of elements in the current stack */
     int stackPos;         /**< Index of current stack position. */
     size_t* stackPtr;     /**< Pointer to the current stack */
@@ -292,6 +331,66 @@ MONGO_EXPORT void bson_print_raw( const char *bson , int depth );
  */
 MONGO_EXPORT bson_type bson_find( bson_iterator *it, const bson *obj, const char *name );
 
+/**
+ * Have bson_find( ) look fields up in a hash of obj's keys instead of
+ * walking the object, for objects that are searched many times. The
+ * hash is built here, before any lookup, and freed by bson_destroy( );
+ * lookups only read it, so obj can then be searched from several threads.
+ *
+ * @note A copy of the bson struct made by assignment must have index set
+ *     to NULL and indexed to 0, or it would free the hash a second time.
+ *
+ * @param obj a finished BSON object.
+ *
+ * @return BSON_OK, or BSON_ERROR if obj is not finished.
+ */
+MONGO_EXPORT int bson_enable_index( bson *obj );
+
+/**
+ * Advance a bson_iterator to the field a dotted path names, such as
+ * "a.b.c" or "items.3.price", where numbers index into arrays. The path
+ * is followed through the raw data without copying subobjects or
+ * allocating.
+ *
+ * @param it the bson_iterator to use.
+ * @param obj the BSON object to search.
+ * @param path the field name or dotted path.
+ *
+ * @return the type of the found field or BSON_EOO if there is none.
+ */
+MONGO_EXPORT bson_type bson_find_path( bson_iterator *it, const bson *obj, const char *path );
+
+/**
+ * Parse a dotted path once, for bson_find_compiled_path( ) to follow
+ * through any number of objects. Destroy it with bson_path_destroy( ).
+ *
+ * @param path the bson_path to initialize.
+ * @param dotted the dotted path, as for bson_find_path( ).
+ *
+ * @return BSON_OK, or BSON_ERROR if a name in the path is empty.
+ */
+MONGO_EXPORT int bson_path_compile( bson_path *path, const char *dotted );
+MONGO_EXPORT void bson_path_destroy( bson_path *path );
+
+/**
+ * bson_find_path( ) with a path from bson_path_compile( ).
+ */
+MONGO_EXPORT bson_type bson_find_compiled_path( bson_iterator *it, const bson *obj, const bson_path *path );
+
+/**
+ * Find several fields with one walk over the object. Each path is a
+ * field name or a dotted path into subobjects and arrays ("a.b.0.c").
+ *
+ * @param its count iterators; its[i] is left on the field paths[i]
+ *     names, or at the end of obj (type BSON_EOO) if there is none.
+ * @param obj the BSON object to search.
+ * @param paths the names or dotted paths to find.
+ * @param count the number of paths.
+ *
+ * @return the number of paths found.
+ */
+MONGO_EXPORT int bson_find_many( bson_iterator *its, const bson *obj, const char **paths, int count );
+
 
 MONGO_EXPORT bson_iterator* bson_iterator_alloc( void );
 MONGO_EXPORT void bson_iterator_dealloc(bson_iterator*);
@@ -674,17 +773,49 @@ MONGO_EXPORT int bson_init( bson *b );
 
 /**
  * Initialize a BSON object for building and allocate a data buffer
- * of a given size.
+ * of a given size. When the finished size is known up front, the
+ * buffer never has to grow; otherwise it doubles as needed.
  *
  * @note When done using the bson object, you must pass it
  *  to bson_destroy( ).
  *
  * @param b the BSON object to initialize.
+ * @param size the initial size of the buffer, or 0 to allocate
+ *  nothing until the first append.
+ *
+ * @return BSON_OK or BSON_ERROR.
+ */
+MONGO_EXPORT int bson_init_size( bson *b, int size );
+
+/**
+ * Initialize a BSON object for building with a buffer sized from
+ * hint, and record its finished size there when bson_finish( ) is
+ * called. The first document of a shape starts at the default size.
+ *
+ * @note The hint must outlive the object.
+ *
+ * @param b the BSON object to initialize.
+ * @param hint the size statistics for this shape of document.
+ *
+ * @return BSON_OK or BSON_ERROR.
+ */
+MONGO_EXPORT int bson_init_with_hint( bson *b, bson_size_hint *hint );
+
+/**
+ * Initialize a BSON object for building whose buffer comes from
+ * allocator instead of bson_malloc( ), such as a bson_arena or
+ * bson_slab from allocator.h.
+ *
+ * @note The allocator must outlive the object, which must still be
+ *  passed to bson_destroy( ).
+ *
+ * @param b the BSON object to initialize.
  * @param size the initial size of the buffer.
+ * @param allocator the allocator, or NULL for bson_malloc( ).
  *
  * @return BSON_OK or BSON_ERROR.
  */
-int bson_init_size( bson *b, int size );
+MONGO_EXPORT int bson_init_with_allocator( bson *b, int size, bson_allocator *allocator );
 
 /**
  * Initialize a BSON object for building, using the provided char*
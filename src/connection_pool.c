@@ -1,19 +1,240 @@
 #include "connection_pool.h"
+#include "env.h"
 
-static int connectToReplicaSet( mongo *conn, const char *replicaName, char *hosts ) {
-  char *hostPortPair = strtok( hosts, "," ), host[MAXHOSTNAMELEN];
-  int port = MONGO_DEFAULT_PORT;
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 
-  mongo_replica_set_init( conn, replicaName );
-  while( hostPortPair != NULL ) {
-    sscanf( hostPortPair, "%[^:]:%d", host, &port );
+/* connection string parsing */
+
+static int optionIs( const char *name, size_t len, const char *expected ) {
+  size_t i;
+  if( strlen( expected ) != len ) return 0;
+  for( i = 0; i < len; i++ )
+    if( tolower( ( unsigned char )name[i] ) != tolower( ( unsigned char )expected[i] ) ) return 0;
+  return 1;
+}
+
+static int parseInt( const char *value, size_t len, int *out ) {
+  char buf[16], *end;
+  long res;
+  if( len == 0 || len >= sizeof( buf ) ) return MONGO_ERROR;
+  memcpy( buf, value, len );
+  buf[len] = '\0';
+  res = strtol( buf, &end, 10 );
+  if( *end != '\0' || res < 0 || res > 0x7fffffff ) return MONGO_ERROR;
+  *out = ( int )res;
+  return MONGO_OK;
+}
+
+static int parseBool( const char *value, size_t len, int *out ) {
+  if( optionIs( value, len, "true" ) ) *out = 1;
+  else if( optionIs( value, len, "false" ) ) *out = 0;
+  else return MONGO_ERROR;
+  return MONGO_OK;
+}
+
+static int copyPart( char *dst, size_t size, const char *src, size_t len ) {
+  if( len >= size ) return MONGO_ERROR;
+  memcpy( dst, src, len );
+  dst[len] = '\0';
+  return MONGO_OK;
+}
+
+static int parseOption( mongo_connection_options *options, const char *name, size_t nameLen, const char *value, size_t valueLen ) {
+  int n;
+
+  if( optionIs( name, nameLen, "replicaSet" ) )
+    return copyPart( options->replica_name, sizeof( options->replica_name ), value, valueLen );
+  if( optionIs( name, nameLen, "connectTimeoutMS" ) )
+    return parseInt( value, valueLen, &options->connect_timeout );
+  if( optionIs( name, nameLen, "socketTimeoutMS" ) ) {
+    if( parseInt( value, valueLen, &n ) != MONGO_OK ) return MONGO_ERROR;
+    options->socket_timeout = ( unsigned int )n;
+    return MONGO_OK;
+  }
+  if( optionIs( name, nameLen, "maxPoolSize" ) )
+    return parseInt( value, valueLen, &options->max_pool_size );
+  if( optionIs( name, nameLen, "minPoolSize" ) )
+    return parseInt( value, valueLen, &options->min_pool_size );
+  if( optionIs( name, nameLen, "waitQueueTimeoutMS" ) )
+    return parseInt( value, valueLen, &options->wait_queue_timeout );
+  if( optionIs( name, nameLen, "maxIdleTimeMS" ) )
+    return parseInt( value, valueLen, &options->max_idle_time );
+  if( optionIs( name, nameLen, "w" ) ) {
+    options->has_write_concern = 1;
+    if( parseInt( value, valueLen, &options->w ) == MONGO_OK ) return MONGO_OK;
+    options->w = 1;
+    return copyPart( options->w_mode, sizeof( options->w_mode ), value, valueLen );
+  }
+  if( optionIs( name, nameLen, "wtimeoutMS" ) ) {
+    options->has_write_concern = 1;
+    return parseInt( value, valueLen, &options->wtimeout );
+  }
+  if( optionIs( name, nameLen, "journal" ) ) {
+    options->has_write_concern = 1;
+    return parseBool( value, valueLen, &options->journal );
+  }
+  if( optionIs( name, nameLen, "fsync" ) ) {
+    options->has_write_concern = 1;
+    return parseBool( value, valueLen, &options->fsync );
+  }
+  if( optionIs( name, nameLen, "readPreference" ) ) {
+    if( optionIs( value, valueLen, "primary" ) ) options->read_preference = MONGO_READ_PRIMARY;
+    else if( optionIs( value, valueLen, "primaryPreferred" ) ) options->read_preference = MONGO_READ_PRIMARY_PREFERRED;
+    else if( optionIs( value, valueLen, "secondary" ) ) options->read_preference = MONGO_READ_SECONDARY;
+    else if( optionIs( value, valueLen, "secondaryPreferred" ) ) options->read_preference = MONGO_READ_SECONDARY_PREFERRED;
+    else if( optionIs( value, valueLen, "nearest" ) ) options->read_preference = MONGO_READ_NEAREST;
+    else return MONGO_ERROR;
+    return MONGO_OK;
+  }
+  if( optionIs( name, nameLen, "localThresholdMS" ) )
+    return parseInt( value, valueLen, &options->local_threshold );
+  return MONGO_OK; /* unknown options are ignored */
+}
+
+MONGO_EXPORT int mongo_connection_options_parse( mongo_connection_options *options, const char *cs ) {
+  const char *p, *at, *colon;
+  size_t len;
+
+  memset( options, 0, sizeof( mongo_connection_options ) );
+  options->socket_timeout = DEFAULT_SOCKET_TIMEOUT;
+  options->w = 1;
+  options->local_threshold = MONGO_DEFAULT_LATENCY_WINDOW_MS;
+
+  if( strncmp( cs, "mongodb://", 10 ) != 0 ) return MONGO_ERROR;
+  p = cs + 10;
+
+  /* [user:pass@]host1[:port1][,host2[:port2]...] */
+  len = strcspn( p, "/?" );
+  at = NULL;
+  for( colon = p; colon < p + len; colon++ )
+    if( *colon == '@' ) at = colon;
+  if( at != NULL ) {
+    colon = ( const char* )memchr( p, ':', at - p );
+    if( colon == NULL ||
+        copyPart( options->user, sizeof( options->user ), p, colon - p ) != MONGO_OK ||
+        copyPart( options->pass, sizeof( options->pass ), colon + 1, at - colon - 1 ) != MONGO_OK )
+      return MONGO_ERROR;
+    len -= at + 1 - p;
+    p = at + 1;
+  }
+  options->hosts = ( char* )bson_malloc( len + 1 );
+  copyPart( options->hosts, len + 1, p, len );
+  p += len;
+
+  /* /database */
+  if( *p == '/' ) {
+    p++;
+    len = strcspn( p, "?" );
+    if( copyPart( options->db, sizeof( options->db ), p, len ) != MONGO_OK ) return MONGO_ERROR;
+    p += len;
+  }
+
+  /* ?name=value&name=value, ';' is accepted as a separator too */
+  if( *p == '?' ) {
+    p++;
+    while( *p ) {
+      const char *eq;
+      len = strcspn( p, "&;" );
+      eq = ( const char* )memchr( p, '=', len );
+      if( eq != NULL && parseOption( options, p, eq - p, eq + 1, len - ( eq + 1 - p ) ) != MONGO_OK )
+        return MONGO_ERROR;
+      p += len;
+      if( *p ) p++;
+    }
+  }
+
+  options->valid = 1;
+  return MONGO_OK;
+}
+
+MONGO_EXPORT void mongo_connection_options_destroy( mongo_connection_options *options ) {
+  bson_free( options->hosts );
+  options->hosts = NULL;
+}
+
+/* parse host[:port] from the list at *hosts and advance past it */
+static int nextHost( const char **hosts, char *host, int *port ) {
+  size_t len = strcspn( *hosts, "," );
+  const char *colon = ( const char* )memchr( *hosts, ':', len );
+  size_t hostLen = colon ? ( size_t )( colon - *hosts ) : len;
+
+  *port = MONGO_DEFAULT_PORT;
+  if( colon && parseInt( colon + 1, len - hostLen - 1, port ) != MONGO_OK ) return MONGO_ERROR;
+  if( hostLen == 0 || copyPart( host, MAXHOSTNAMELEN, *hosts, hostLen ) != MONGO_OK ) return MONGO_ERROR;
+
+  *hosts += len;
+  if( **hosts == ',' ) ( *hosts )++;
+  return MONGO_OK;
+}
+
+static int connectToReplicaSet( mongo *conn, const mongo_connection_options *options ) {
+  const char *hosts = options->hosts;
+  char host[MAXHOSTNAMELEN];
+  int port;
+
+  mongo_replica_set_init( conn, options->replica_name );
+  mongo_set_connect_timeout( conn, options->connect_timeout );
+  mongo_replica_set_set_read_preference( conn, options->read_preference, options->local_threshold );
+  while( *hosts ) {
+    if( nextHost( &hosts, host, &port ) != MONGO_OK ) return MONGO_ERROR;
     mongo_replica_set_add_seed( conn, host, port );
-    hostPortPair = strtok( NULL, "," );
-    port = MONGO_DEFAULT_PORT; /* reset port to default */
   }
   return mongo_replica_set_client( conn );
 }
 
+/* metrics */
+
+static int mongo_latency_bucket( int64_t micros ) {
+  int shift = 0, bucket;
+  if( micros < MONGO_LATENCY_SUB_BUCKETS ) return micros > 0 ? ( int )micros : 0;
+  while( ( micros >> shift ) >= 2 * MONGO_LATENCY_SUB_BUCKETS )
+    shift++;
+  /* micros >> shift keeps the leading bit and the sub-bucket bits below it */
+  bucket = ( shift + 1 ) * MONGO_LATENCY_SUB_BUCKETS + ( int )( ( micros >> shift ) - MONGO_LATENCY_SUB_BUCKETS );
+  return bucket < MONGO_LATENCY_BUCKETS ? bucket : MONGO_LATENCY_BUCKETS - 1;
+}
+
+/* first value past the bucket */
+static int64_t mongo_latency_bucket_limit( int bucket ) {
+  int shift = bucket / MONGO_LATENCY_SUB_BUCKETS - 1;
+  if( shift <= 0 ) return bucket + 1;
+  return ( int64_t )( MONGO_LATENCY_SUB_BUCKETS + bucket % MONGO_LATENCY_SUB_BUCKETS + 1 ) << shift;
+}
+
+static void mongo_latency_histogram_record( mongo_latency_histogram *histogram, int64_t micros ) {
+  crossAdd64( &histogram->buckets[mongo_latency_bucket( micros )], 1 );
+  crossAdd64( &histogram->total, micros > 0 ? micros : 0 );
+  crossAdd64( &histogram->count, 1 );
+}
+
+/* add src to dst, read field by field while src may be recorded into */
+static void mongo_latency_histogram_sum( mongo_latency_histogram *dst, mongo_latency_histogram *src ) {
+  int i;
+  dst->count += crossAdd64( &src->count, 0 );
+  dst->total += crossAdd64( &src->total, 0 );
+  for( i = 0; i < MONGO_LATENCY_BUCKETS; i++ )
+    dst->buckets[i] += crossAdd64( &src->buckets[i], 0 );
+}
+
+MONGO_EXPORT int64_t mongo_latency_histogram_percentile( const mongo_latency_histogram *histogram, double percentile ) {
+  int64_t count = 0, rank;
+  int i;
+
+  for( i = 0; i < MONGO_LATENCY_BUCKETS; i++ )
+    count += histogram->buckets[i];
+  if( count == 0 ) return 0;
+
+  rank = ( int64_t )( count * percentile / 100.0 + 0.5 );
+  if( rank < 1 ) rank = 1;
+  for( i = 0; i < MONGO_LATENCY_BUCKETS - 1; i++ ) {
+    rank -= histogram->buckets[i];
+    if( rank <= 0 ) break;
+  }
+  return mongo_latency_bucket_limit( i );
+}
+
 /* mongo_connection methods */
 
 void mongo_connection_set_socket_timeout( mongo_connection *conn, unsigned int timeout )
@@ -39,84 +260,102 @@ static void mongo_connection_delete( mongo_connection* _this ) {
   bson_free( _this );
 }
 
-static int mongo_connection_authenticate( mongo_connection *_this, const char *connectionString ) {
-  char user[MAX_USER_LEN] = {'\0'}, pass[MAX_PASS_LEN] = {'\0'}, db[MAX_DB_LEN] = {'\0'};
-  int credentialsScanned = sscanf( connectionString, "mongodb://%[^:]:%[^@]@%*[^/]/%[^?]?", user, pass, db );
+static int mongo_connection_authenticate( mongo_connection *_this ) {
+  const mongo_connection_options *options = &_this->pool->options;
+  int64_t start;
+  int res;
 
-  if( credentialsScanned != 3 ) {
+  if( options->user[0] == '\0' || options->pass[0] == '\0' || options->db[0] == '\0' ) {
     /* not all of required credentials exists */
     _this->err = MONGO_CONNECTION_INVALID_CONNECTION_STRING;
     return MONGO_ERROR;
   }
-  if( mongo_cmd_authenticate( _this->conn, db, user, pass ) == MONGO_ERROR ) {
+  start = mongo_env_clock_usec();
+  res = mongo_cmd_authenticate( _this->conn, options->db, options->user, options->pass );
+  mongo_latency_histogram_record( &_this->pool->auth_latency, mongo_env_clock_usec() - start );
+  if( res == MONGO_ERROR ) {
+    crossAdd64( &_this->pool->auth_failures, 1 );
     _this->err = MONGO_CONNECTION_AUTH_FAIL;
     return MONGO_ERROR;
   }
   return MONGO_OK;
 }
 
-static int isNeedToAuth( const char *connectionString ) {
-  return strchr( connectionString, '@' ) != NULL;
+/* count a connect or reconnect attempt that started at start */
+static void mongo_connection_connected( mongo_connection *_this, int64_t start, int res ) {
+  mongo_latency_histogram_record( &_this->pool->connect_latency, mongo_env_clock_usec() - start );
+  crossAdd64( &_this->pool->connects, 1 );
+  if( res != MONGO_OK )
+    crossAdd64( &_this->pool->connect_failures, 1 );
+}
+
+static int isNeedToAuth( const mongo_connection_options *options ) {
+  return options->user[0] != '\0';
 }
 
 MONGO_EXPORT int mongo_connection_connect( mongo_connection *_this ) {
-  int multipleHostsProvided, needToAuth, res;
-  char *hosts, replicaName[MAX_REPLICA_NAME_LEN] = {'\0'};
+  const mongo_connection_options *options = &_this->pool->options;
+  int64_t start;
+  int res;
 
   if( _this->conn->connected == 1 ) return MONGO_OK;
 
-  hosts = ( char* )bson_malloc( sizeof(char) * strlen( _this->pool->cs ) );
-  hosts[0] = '\0';
-  sscanf( _this->pool->cs, "mongodb://%[^/]/%*[^?]?replicaSet=%s", hosts, replicaName );
-  needToAuth = isNeedToAuth( hosts ); /* Moved out of conditional to avoid MSVC warnings... bummer */
-  if( needToAuth )
+  if( !options->valid || options->hosts[0] == '\0' || /* required */
+      ( strchr( options->hosts, ',' ) != NULL && options->replica_name[0] == '\0' ) ) /* replica set name required if multiple hosts specified */
   {
-    /* remove user and pass */
-    strcpy( hosts, strchr( hosts, '@' ) + 1 );
+    mongo_init( _this->conn ); /* reserve resources to allow free without errors while pool will be destroyed */
+    _this->err = MONGO_CONNECTION_INVALID_CONNECTION_STRING;
+    return MONGO_ERROR;
   }
-  multipleHostsProvided = strchr( hosts, ',' ) != NULL;
-
-  do {
-    if( hosts[0] == '\0' || /* required */
-      ( multipleHostsProvided && replicaName[0] == '\0' )) /* replica set name required if multiple hosts specified */
-    {
-      mongo_init( _this->conn ); /* reserve resources to allow free without errors while pool will be destroyed */
-      _this->err = MONGO_CONNECTION_INVALID_CONNECTION_STRING;
-      res = MONGO_ERROR;
-      break;
-    }
 
-    if( !multipleHostsProvided )
-    {
-      /* single server */
-      char host[MAXHOSTNAMELEN];
-      int port = MONGO_DEFAULT_PORT;
+  if( options->replica_name[0] == '\0' )
+  {
+    /* single server */
+    const char *hosts = options->hosts;
+    char host[MAXHOSTNAMELEN];
+    int port;
 
-      sscanf( hosts, "%[^:]:%d", host, &port );
-      res = mongo_client( _this->conn, host, port );
-    }
-    else
-    {
-      res = connectToReplicaSet( _this->conn, replicaName, hosts );
-    }
-    if( res == MONGO_ERROR )
-      _this->err = MONGO_CONNECTION_MONGO_ERROR;
-    else 
-    {
-      mongo_set_op_timeout( _this->conn, _this->timeout );
-      if( needToAuth )
-        res = mongo_connection_authenticate( _this, _this->pool->cs );
+    mongo_init( _this->conn );
+    if( nextHost( &hosts, host, &port ) != MONGO_OK ) {
+      _this->err = MONGO_CONNECTION_INVALID_CONNECTION_STRING;
+      return MONGO_ERROR;
     }
-  } while( 0 );
+    mongo_set_connect_timeout( _this->conn, options->connect_timeout );
+    start = mongo_env_clock_usec();
+    res = mongo_client_connect( _this->conn, host, port );
+  }
+  else
+  {
+    start = mongo_env_clock_usec();
+    res = connectToReplicaSet( _this->conn, options );
+  }
+  mongo_connection_connected( _this, start, res );
+  if( res == MONGO_ERROR )
+    _this->err = MONGO_CONNECTION_MONGO_ERROR;
+  else
+  {
+    mongo_set_op_timeout( _this->conn, _this->timeout );
+    if( _this->pool->options.has_write_concern )
+      mongo_set_write_concern( _this->conn, &_this->pool->write_concern );
+    if( isNeedToAuth( options ) )
+      res = mongo_connection_authenticate( _this );
+  }
 
-  bson_free( hosts );
   return res;
 }
 
+MONGO_EXPORT int mongo_connection_read_options( mongo_connection *_this ) {
+  return _this->pool->options.read_preference == MONGO_READ_PRIMARY ? 0 : MONGO_SLAVE_OK;
+}
+
 MONGO_EXPORT int mongo_connection_reconnect( mongo_connection *_this ) {
-  if( mongo_reconnect( _this->conn ) == MONGO_OK ) {
+  int64_t start = mongo_env_clock_usec();
+  int res = mongo_reconnect( _this->conn );
+
+  mongo_connection_connected( _this, start, res );
+  if( res == MONGO_OK ) {
     mongo_set_op_timeout( _this->conn, _this->timeout );
-    if( isNeedToAuth( _this->pool->cs ) && mongo_connection_authenticate( _this, _this->pool->cs ) != MONGO_OK )
+    if( isNeedToAuth( &_this->pool->options ) && mongo_connection_authenticate( _this ) != MONGO_OK )
       return MONGO_ERROR;
     return MONGO_OK;
   }
@@ -132,115 +371,586 @@ MONGO_EXPORT void mongo_connection_disconnect( mongo_connection *_this ) {
 
 static mongo_connection_pool* mongo_connection_pool_new( const char *cs ) {
   mongo_connection_pool *pool = ( mongo_connection_pool* )bson_malloc( sizeof( mongo_connection_pool ) );
+  memset( pool, 0, sizeof( mongo_connection_pool ) );
   pool->cs = ( char* )bson_malloc( sizeof( char ) * strlen( cs ) + 1 );
-  spinLock_init( &pool->lock );
+  mongo_mutex_init( &pool->lock );
+  mongo_cond_init( &pool->available );
   strcpy( pool->cs, cs );
+
+  /* a bad string still makes a pool, its connections report MONGO_CONNECTION_INVALID_CONNECTION_STRING */
+  mongo_connection_options_parse( &pool->options, cs );
+  pool->max_size = pool->options.max_pool_size;
+  pool->min_idle = pool->options.min_pool_size;
+  pool->wait_timeout = pool->options.wait_queue_timeout;
+  pool->max_idle_time = pool->options.max_idle_time;
+
+  mongo_write_concern_init( &pool->write_concern );
+  if( pool->options.has_write_concern ) {
+    pool->write_concern.w = pool->options.w;
+    pool->write_concern.wtimeout = pool->options.wtimeout;
+    pool->write_concern.j = pool->options.journal;
+    pool->write_concern.fsync = pool->options.fsync;
+    if( pool->options.w_mode[0] != '\0' )
+      pool->write_concern.mode = pool->options.w_mode;
+    mongo_write_concern_finish( &pool->write_concern );
+  }
   return pool;
 }
 
 static void mongo_connection_pool_delete( mongo_connection_pool *_this ) {
-  mongo_connection *conn = _this->head;
+  mongo_connection *conn;
+
+  /* no thread exit hook may touch the pool after this. Under Windows the
+     hooks run now and return cached connections to the list below. */
+  if( _this->has_cache_key )
+    mongo_tls_key_delete( _this->cache_key );
+  conn = _this->pinned;
+  while( conn != NULL ) {
+    mongo_connection *next = conn->next_pinned;
+    mongo_connection_delete( conn );
+    conn = next;
+  }
+
+  conn = _this->head;
   while( conn != NULL) {
     mongo_connection *next = conn->next;
     mongo_connection_delete( conn );
     conn = next;
   }
   bson_free( _this->cs );
-  spinLock_destroy( &_this->lock );
+  mongo_connection_options_destroy( &_this->options );
+  mongo_write_concern_destroy( &_this->write_concern );
+  mongo_cond_destroy( &_this->available );
+  mongo_mutex_destroy( &_this->lock );
   bson_free( _this );
 }
 
-static mongo_connection* mongo_connection_pool_removeFirst( mongo_connection_pool *_this ) {
-  mongo_connection *res;
+static void mongo_connection_pool_put( mongo_connection_pool *_this, mongo_connection *conn );
 
-  spinLock_lock( &_this->lock );
-  
-  res = _this->head;
-  if( res != NULL ) {
-    _this->head = res->next;
+/* open a connection for a slot already counted in size */
+static mongo_connection* mongo_connection_pool_open( mongo_connection_pool *_this ) {
+  mongo_connection *res = mongo_connection_new();
+  res->pool = _this;
+  res->err = MONGO_CONNECTION_SUCCESS;
+  res->conn->connected = 0; /* This flag will force following code to initialize connection object */
+  res->timeout = _this->options.socket_timeout;
+  mongo_connection_connect( res );
+  res->next = NULL;
+  res->pinned = res->cache_busy = 0;
+  res->next_pinned = NULL;
+  res->created = res->last_used = mongo_env_clock_usec();
+  return res;
+}
+
+static int mongo_connection_pool_full( mongo_connection_pool *_this ) {
+  return _this->max_size > 0 && _this->size >= _this->max_size;
+}
+
+static int mongo_connection_pool_past( int64_t since, int millis, int64_t now ) {
+  return millis > 0 && now - since > ( int64_t )millis * 1000;
+}
+
+static int mongo_connection_pool_too_old( mongo_connection_pool *_this, mongo_connection *conn, int64_t now ) {
+  return mongo_connection_pool_past( conn->created, _this->max_lifetime, now );
+}
+
+/* open connections until min_idle are in the pool, one at a time so the
+   lock is not held while connecting. Called with the lock held. */
+static void mongo_connection_pool_warm( mongo_connection_pool *_this ) {
+  while( _this->idle < _this->min_idle && !mongo_connection_pool_full( _this ) ) {
+    _this->size++;
+    mongo_mutex_unlock( &_this->lock );
+    mongo_connection_pool_put( _this, mongo_connection_pool_open( _this ) );
+    mongo_mutex_lock( &_this->lock );
+  }
+}
+
+/* swap a connection that went bad while idle for a new one in the same slot */
+static mongo_connection* mongo_connection_pool_replace( mongo_connection_pool *_this, mongo_connection *conn ) {
+  crossAdd64( &_this->evictions, 1 );
+
+  mongo_connection_delete( conn );
+  return mongo_connection_pool_open( _this );
+}
+
+/* make sure an idle connection is still worth handing out. Called without the lock. */
+static mongo_connection* mongo_connection_pool_check( mongo_connection_pool *_this, mongo_connection *conn, int pingAfter ) {
+  int64_t now = mongo_env_clock_usec();
+
+  if( mongo_connection_pool_too_old( _this, conn, now ) )
+    return mongo_connection_pool_replace( _this, conn );
+  if( mongo_connection_pool_past( conn->last_used, pingAfter, now ) && mongo_check_connection( conn->conn ) != MONGO_OK )
+    return mongo_connection_pool_replace( _this, conn );
+  return conn;
+}
+
+/* thread cache. A pinned connection stays counted in size and out of the
+   idle list for as long as its thread keeps it. */
+
+/* keep conn as this thread's connection, it must have none yet */
+static int mongo_connection_pool_pin( mongo_connection_pool *_this, mongo_connection *conn, int64_t now ) {
+  int pinned = 0;
+
+  mongo_mutex_lock( &_this->lock );
+  if( !( _this->max_size > 0 && _this->size > _this->max_size ) && !mongo_connection_pool_too_old( _this, conn, now ) ) {
+    conn->next_pinned = _this->pinned;
+    _this->pinned = conn;
+    _this->cached++;
+    conn->pinned = 1;
+    conn->cache_busy = 0;
+    conn->last_used = now;
+    pinned = 1;
   }
+  mongo_mutex_unlock( &_this->lock );
+
+  if( pinned )
+    mongo_tls_set( _this->cache_key, conn );
+  return pinned;
+}
+
+/* take conn out of its thread's cache. clearSlot is zero from the thread
+   exit hook, where the slot is already cleared. Returns non-zero if conn
+   was handed out at the time, so its holder now releases it to the pool. */
+static int mongo_connection_pool_unpin( mongo_connection_pool *_this, mongo_connection *conn, int clearSlot ) {
+  mongo_connection **link;
+  int busy;
+
+  mongo_mutex_lock( &_this->lock );
+  for( link = &_this->pinned; *link != conn; link = &( *link )->next_pinned )
+    ;
+  *link = conn->next_pinned;
+  _this->cached--;
+  busy = conn->cache_busy != 0;
+  conn->cache_busy = 0;
+  conn->next_pinned = NULL;
+  crossStoreReleaseLong( &conn->pinned, 0 );
+  mongo_mutex_unlock( &_this->lock );
+
+  if( clearSlot )
+    mongo_tls_set( _this->cache_key, NULL );
+  return busy;
+}
+
+static void MONGO_TLS_CALLBACK mongo_connection_pool_thread_exit( void *value ) {
+  mongo_connection *conn = ( mongo_connection* )value;
+  mongo_connection_pool *pool = conn->pool;
 
-  spinLock_unlock( &_this->lock );  
+  /* a busy one was handed to another thread, it comes back through release */
+  if( !mongo_connection_pool_unpin( pool, conn, 0 ) )
+    mongo_connection_pool_put( pool, conn );
+}
+
+/* hand conn back to the thread that caches it, from another thread. The
+   pool lock orders this against that thread's exit hook; returns zero if
+   the hook already unpinned conn, which then belongs in the pool. */
+static int mongo_connection_pool_return_to_owner( mongo_connection_pool *_this, mongo_connection *conn ) {
+  int returned = 0;
+
+  mongo_mutex_lock( &_this->lock );
+  if( conn->pinned ) {
+    /* expiry is checked on the owner's next acquire */
+    conn->last_used = mongo_env_clock_usec();
+    crossStoreReleaseLong( &conn->cache_busy, 0 );
+    returned = 1;
+  }
+  mongo_mutex_unlock( &_this->lock );
+
+  return returned;
+}
+
+/* the calling thread's cached connection if it is free and still good to
+   use, else NULL. Everything but expiry is done without locks; the acquire
+   load pairs with another thread handing the connection back. */
+static mongo_connection* mongo_connection_pool_from_cache( mongo_connection_pool *_this ) {
+  mongo_connection *conn = ( mongo_connection* )mongo_tls_get( _this->cache_key );
+  int64_t now;
+
+  if( conn == NULL || crossLoadAcquireLong( &conn->cache_busy ) )
+    return NULL;
+
+  if( !_this->thread_cache ) {
+    /* cache was disabled, hand the connection back to everyone */
+    mongo_connection_pool_unpin( _this, conn, 1 );
+    mongo_connection_pool_put( _this, conn );
+    return NULL;
+  }
+
+  if( _this->ping_after > 0 || _this->max_lifetime > 0 ) {
+    now = mongo_env_clock_usec();
+    if( mongo_connection_pool_too_old( _this, conn, now ) || mongo_connection_pool_past( conn->last_used, _this->ping_after, now ) ) {
+      /* checked like any idle connection; it is pinned again on release */
+      mongo_connection_pool_unpin( _this, conn, 1 );
+      return mongo_connection_pool_check( _this, conn, _this->ping_after );
+    }
+  }
+
+  conn->cache_busy = 1;
+  return conn;
+}
+
+MONGO_EXPORT int mongo_connection_pool_set_thread_cache( mongo_connection_pool *_this, int enabled ) {
+  int res = MONGO_OK;
+
+  mongo_mutex_lock( &_this->lock );
+  if( enabled && !_this->has_cache_key ) {
+    if( mongo_tls_key_create( &_this->cache_key, mongo_connection_pool_thread_exit ) == 0 )
+      _this->has_cache_key = 1;
+    else
+      res = MONGO_ERROR;
+  }
+  if( res == MONGO_OK )
+    _this->thread_cache = enabled != 0;
+  mongo_mutex_unlock( &_this->lock );
 
   return res;
 }
 
-MONGO_EXPORT mongo_connection* mongo_connection_pool_acquire( mongo_connection_pool *_this ) {
-  mongo_connection *res = mongo_connection_pool_removeFirst( _this );
-  if( res != NULL ) return res;
-  /* create new connection */
-  res = mongo_connection_new();
-  res->pool = _this;
-  res->err = MONGO_CONNECTION_SUCCESS;
-  res->conn->connected = 0; /* This flag will force following code to initialize connection object */
-  res->timeout = DEFAULT_SOCKET_TIMEOUT;
-  mongo_connection_connect( res );
-  res->next = NULL;
+MONGO_EXPORT mongo_connection* mongo_connection_pool_acquire_timeout( mongo_connection_pool *_this, int timeout ) {
+  mongo_connection *res = NULL;
+  int64_t entered = mongo_env_clock_usec(), start = 0;
+  int timedOut = 0, openNew = 0, pingAfter;
+
+  if( _this->has_cache_key && ( res = mongo_connection_pool_from_cache( _this ) ) != NULL )
+    return res;
+
+  crossAdd64( &_this->acquires, 1 );
+  mongo_mutex_lock( &_this->lock );
+
+  /* wait for a release while every allowed connection is in use */
+  while( _this->head == NULL && mongo_connection_pool_full( _this ) && !timedOut ) {
+    if( start == 0 ) {
+      start = mongo_env_clock_usec();
+      _this->waits++;
+    }
+    _this->waiters++;
+    if( timeout > 0 ) {
+      int remaining = timeout - ( int )( ( mongo_env_clock_usec() - start ) / 1000 );
+      timedOut = remaining <= 0 || mongo_cond_timedwait( &_this->available, &_this->lock, remaining );
+    }
+    else
+      mongo_cond_wait( &_this->available, &_this->lock );
+    _this->waiters--;
+  }
 
+  if( start != 0 )
+    _this->wait_time += mongo_env_clock_usec() - start;
+
+  if( _this->head != NULL ) {
+    res = _this->head;
+    _this->head = res->next;
+    _this->idle--;
+  }
+  else if( !mongo_connection_pool_full( _this ) ) {
+    _this->size++; /* take the slot now, connect outside the lock */
+    openNew = 1;
+  }
+  else
+    crossAdd64( &_this->timeouts, 1 );
+  pingAfter = _this->ping_after;
+
+  mongo_mutex_unlock( &_this->lock );
+
+  if( openNew )
+    res = mongo_connection_pool_open( _this );
+  else if( res != NULL )
+    res = mongo_connection_pool_check( _this, res, pingAfter );
+
+  mongo_latency_histogram_record( &_this->acquire_latency, mongo_env_clock_usec() - entered );
   return res;
 }
 
+MONGO_EXPORT mongo_connection* mongo_connection_pool_acquire( mongo_connection_pool *_this ) {
+  return mongo_connection_pool_acquire_timeout( _this, _this->wait_timeout );
+}
+
 MONGO_EXPORT void mongo_connection_pool_release( mongo_connection_pool *_this, mongo_connection *conn ) {
-  spinLock_lock( &_this->lock );
+  if( crossLoadAcquireLong( &conn->pinned ) ) {
+    if( mongo_tls_get( _this->cache_key ) != conn ) {
+      if( mongo_connection_pool_return_to_owner( _this, conn ) )
+        return;
+    }
+    else if( _this->thread_cache ) {
+      /* back into this thread's cache, expiry is checked on its next acquire */
+      conn->last_used = mongo_env_clock_usec();
+      conn->cache_busy = 0;
+      return;
+    }
+    else
+      mongo_connection_pool_unpin( _this, conn, 1 );
+  }
+  else if( _this->thread_cache && mongo_tls_get( _this->cache_key ) == NULL &&
+           mongo_connection_pool_pin( _this, conn, mongo_env_clock_usec() ) )
+    return;
+
+  mongo_connection_pool_put( _this, conn );
+}
+
+static void mongo_connection_pool_put( mongo_connection_pool *_this, mongo_connection *conn ) {
+  int64_t now = mongo_env_clock_usec();
+  int over;
+
+  mongo_mutex_lock( &_this->lock );
+
+  over = _this->max_size > 0 && _this->size > _this->max_size;
+  if( over || mongo_connection_pool_too_old( _this, conn, now ) ) {
+    if( !over )
+      crossAdd64( &_this->evictions, 1 );
+    _this->size--;
+    over = 1;
+  }
+  else {
+    /* insert at the beginning of the pool */
+    conn->last_used = now;
+    conn->next = _this->head;
+    _this->head = conn;
+    _this->idle++;
+    if( _this->waiters > 0 )
+      mongo_cond_signal( &_this->available );
+  }
+
+  mongo_mutex_unlock( &_this->lock );
+
+  if( over )
+    mongo_connection_delete( conn );
+}
 
-  /* insert at the beginning of the pool */
-  conn->next = _this->head;
-  _this->head = conn;
+MONGO_EXPORT void mongo_connection_pool_set_limits( mongo_connection_pool *_this, int max_size, int min_idle, int wait_timeout ) {
+  mongo_mutex_lock( &_this->lock );
+  _this->max_size = max_size > 0 ? max_size : 0;
+  _this->min_idle = min_idle > 0 ? min_idle : 0;
+  _this->wait_timeout = wait_timeout > 0 ? wait_timeout : 0;
+  /* waiters re-check the new limit */
+  mongo_cond_broadcast( &_this->available );
+  mongo_connection_pool_warm( _this );
+  mongo_mutex_unlock( &_this->lock );
+}
+
+MONGO_EXPORT void mongo_connection_pool_set_maintenance( mongo_connection_pool *_this, int ping_after, int max_idle_time, int max_lifetime ) {
+  mongo_mutex_lock( &_this->lock );
+  _this->ping_after = ping_after > 0 ? ping_after : 0;
+  _this->max_idle_time = max_idle_time > 0 ? max_idle_time : 0;
+  _this->max_lifetime = max_lifetime > 0 ? max_lifetime : 0;
+  mongo_mutex_unlock( &_this->lock );
+}
+
+MONGO_EXPORT void mongo_connection_pool_maintain( mongo_connection_pool *_this ) {
+  mongo_connection *evicted = NULL, *toPing = NULL, **link;
+  int64_t now = mongo_env_clock_usec();
+  int position = 0;
+
+  mongo_mutex_lock( &_this->lock );
+
+  /* The list is most recently used first, so the first min_idle
+     connections are the freshest and are never closed for being idle.
+     Connections to ping leave the list so nobody acquires them
+     meanwhile, they keep their slot. */
+  for( link = &_this->head; *link != NULL; position++ ) {
+    mongo_connection *conn = *link;
+    int expired = mongo_connection_pool_too_old( _this, conn, now ) ||
+                  ( position >= _this->min_idle && mongo_connection_pool_past( conn->last_used, _this->max_idle_time, now ) );
+
+    if( expired || mongo_connection_pool_past( conn->last_used, _this->ping_after, now ) ) {
+      *link = conn->next;
+      _this->idle--;
+      if( expired ) {
+        _this->size--;
+        crossAdd64( &_this->evictions, 1 );
+        conn->next = evicted;
+        evicted = conn;
+      }
+      else {
+        conn->next = toPing;
+        toPing = conn;
+      }
+    }
+    else
+      link = &conn->next;
+  }
+
+  mongo_mutex_unlock( &_this->lock );
+
+  while( evicted != NULL ) {
+    mongo_connection *next = evicted->next;
+    mongo_connection_delete( evicted );
+    evicted = next;
+  }
+  while( toPing != NULL ) {
+    mongo_connection *next = toPing->next;
+    if( mongo_check_connection( toPing->conn ) != MONGO_OK )
+      toPing = mongo_connection_pool_replace( _this, toPing );
+    mongo_connection_pool_put( _this, toPing );
+    toPing = next;
+  }
+
+  mongo_mutex_lock( &_this->lock );
+  mongo_connection_pool_warm( _this );
+  mongo_mutex_unlock( &_this->lock );
+}
 
-  spinLock_unlock( &_this->lock );  
+MONGO_EXPORT void mongo_connection_pool_get_stats( mongo_connection_pool *_this, mongo_connection_pool_stats *stats ) {
+  mongo_mutex_lock( &_this->lock );
+  stats->size = _this->size;
+  stats->idle = _this->idle;
+  stats->waiters = _this->waiters;
+  stats->waits = _this->waits;
+  stats->wait_time = _this->wait_time;
+  stats->timeouts = _this->timeouts;
+  stats->evictions = _this->evictions;
+  mongo_mutex_unlock( &_this->lock );
+}
+
+/* the pool's own counters added to metrics, read without the lock */
+static void mongo_connection_pool_add_metrics( mongo_connection_pool *_this, mongo_connection_pool_metrics *metrics ) {
+  int size = *( volatile int* )&_this->size, idle = *( volatile int* )&_this->idle;
+
+  metrics->pools++;
+  metrics->size += size;
+  metrics->idle += idle;
+  metrics->in_use += size > idle ? size - idle : 0;
+  metrics->waiters += *( volatile int* )&_this->waiters;
+  metrics->cached += *( volatile int* )&_this->cached;
+  metrics->acquires += crossAdd64( &_this->acquires, 0 );
+  metrics->connects += crossAdd64( &_this->connects, 0 );
+  metrics->connect_failures += crossAdd64( &_this->connect_failures, 0 );
+  metrics->auth_failures += crossAdd64( &_this->auth_failures, 0 );
+  metrics->timeouts += crossAdd64( &_this->timeouts, 0 );
+  metrics->evictions += crossAdd64( &_this->evictions, 0 );
+  mongo_latency_histogram_sum( &metrics->acquire_latency, &_this->acquire_latency );
+  mongo_latency_histogram_sum( &metrics->connect_latency, &_this->connect_latency );
+  mongo_latency_histogram_sum( &metrics->auth_latency, &_this->auth_latency );
+}
+
+MONGO_EXPORT void mongo_connection_pool_get_metrics( mongo_connection_pool *_this, mongo_connection_pool_metrics *metrics ) {
+  memset( metrics, 0, sizeof( mongo_connection_pool_metrics ) );
+  mongo_connection_pool_add_metrics( _this, metrics );
 }
 
 /* mongo_connection_dictionary methods */
 
+#define POOL_TABLE_MIN_SLOTS 16
+
+/* FNV-1a */
+static unsigned int mongo_connection_dictionary_hash( const char *cs ) {
+  unsigned int hash = 2166136261u;
+  while( *cs ) {
+    hash ^= ( unsigned char )*cs++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static mongo_connection_pool_table* mongo_connection_pool_table_new( unsigned int slots ) {
+  mongo_connection_pool_table *table = ( mongo_connection_pool_table* )bson_malloc( sizeof( mongo_connection_pool_table ) );
+  table->mask = slots - 1;
+  table->slots = ( mongo_connection_pool* volatile * )bson_malloc( sizeof( mongo_connection_pool* ) * slots );
+  memset( ( void* )table->slots, 0, sizeof( mongo_connection_pool* ) * slots );
+  table->retired = NULL;
+  return table;
+}
+
+static mongo_connection_pool* mongo_connection_pool_table_find( mongo_connection_pool_table *table, const char *cs, unsigned int hash ) {
+  unsigned int i;
+  for( i = hash & table->mask; ; i = ( i + 1 ) & table->mask ) {
+    mongo_connection_pool *pool = ( mongo_connection_pool* )crossLoadAcquire( ( void* volatile* )&table->slots[i] );
+    if( pool == NULL ) return NULL; /* tables are never more than half full */
+    if( pool->hash == hash && strcmp( cs, pool->cs ) == 0 ) return pool;
+  }
+}
+
+/* Readers may be probing the table, so a slot is filled only once the pool is fully built. */
+static void mongo_connection_pool_table_insert( mongo_connection_pool_table *table, mongo_connection_pool *pool ) {
+  unsigned int i = pool->hash & table->mask;
+  while( table->slots[i] != NULL )
+    i = ( i + 1 ) & table->mask;
+  crossStoreRelease( ( void* volatile* )&table->slots[i], pool );
+}
+
 MONGO_EXPORT void mongo_connection_dictionary_init( mongo_connection_dictionary *_this ) {
   _this->head = NULL;
+  _this->count = 0;
+  _this->table = mongo_connection_pool_table_new( POOL_TABLE_MIN_SLOTS );
   spinLock_init( &_this->lock );  
 }
 
 MONGO_EXPORT void mongo_connection_dictionary_destroy( mongo_connection_dictionary *_this ) {
   mongo_connection_pool *pool = _this->head;
+  mongo_connection_pool_table *table = _this->table;
   while( pool != NULL ) {
     mongo_connection_pool *next = pool->next;
     mongo_connection_pool_delete( pool );
     pool = next;
   }
+  while( table != NULL ) {
+    mongo_connection_pool_table *retired = table->retired;
+    bson_free( ( void* )table->slots );
+    bson_free( table );
+    table = retired;
+  }
+  _this->table = NULL;
   spinLock_destroy( &_this->lock );
 }
 
-static void mongo_connection_dictionary_addToDictionary( mongo_connection_dictionary *_this, mongo_connection_pool *pool, mongo_connection_pool *lastPoolInDict ) 
-{
-  /* insert at the end of dictionary */
-  if( _this->head == NULL )
-    _this->head = pool;
+/* Called with the lock held. Lookups running against the current table
+   keep working: it stays allocated, and complete, until the dictionary
+   is destroyed. */
+static void mongo_connection_dictionary_addToDictionary( mongo_connection_dictionary *_this, mongo_connection_pool *pool ) {
+  mongo_connection_pool_table *table = _this->table;
+
+  pool->next = _this->head;
+  crossStoreRelease( ( void* volatile* )&_this->head, pool ); /* walked without the lock by get_metrics */
+
+  if( ( unsigned int )( _this->count + 1 ) * 2 > table->mask + 1 ) {
+    mongo_connection_pool_table *grown = mongo_connection_pool_table_new( ( table->mask + 1 ) * 2 );
+    mongo_connection_pool *p;
+    for( p = _this->head; p != NULL; p = p->next )
+      mongo_connection_pool_table_insert( grown, p );
+    grown->retired = table;
+    crossStoreRelease( ( void* volatile* )&_this->table, grown );
+  }
   else
-    lastPoolInDict->next = pool;  
+    mongo_connection_pool_table_insert( table, pool );
+
+  _this->count++;
 }
 
 MONGO_EXPORT mongo_connection_pool* mongo_connection_dictionary_get_pool( mongo_connection_dictionary *_this, const char *cs ) {
-  mongo_connection_pool *pool, *lastPoolInDict = NULL;
+  unsigned int hash = mongo_connection_dictionary_hash( cs );
+  mongo_connection_pool_table *table = ( mongo_connection_pool_table* )crossLoadAcquire( ( void* volatile* )&_this->table );
+  mongo_connection_pool *pool = mongo_connection_pool_table_find( table, cs, hash );
+  int created = 0;
 
-  /* Let's lock for the whole process of obtaining a pool and adding a new pool to the dictionary. The assumption is that this method
-     is not going to be called very often, therefore we can assume low contention. 
-     If we use a finer lock only when adding to dictionary we risk adding same pool twice. If this proves troublesome due to high 
-     contention we can change logic to finer lock inside adding to dictionary only or coarse critical section based locking */
-  spinLock_lock( &_this->lock );    
+  if( pool != NULL ) return pool;
 
-  /* find in dictionary by connection string */
-  for( pool = _this->head; pool != NULL; pool = pool->next ) {
-    lastPoolInDict = pool;
-    if( strcmp( cs, pool->cs ) == 0 ) break; /* found */    
-  }
+  /* Not there: take the lock and look again, another thread may be adding the same pool */
+  spinLock_lock( &_this->lock );
 
+  pool = mongo_connection_pool_table_find( _this->table, cs, hash );
   if( pool == NULL ) {
     /* create new pool object */
     pool = mongo_connection_pool_new( cs );
+    pool->hash = hash;
     pool->head = NULL;
-    pool->next = NULL;    
+    created = 1;
 
-    mongo_connection_dictionary_addToDictionary( _this, pool, lastPoolInDict );
+    mongo_connection_dictionary_addToDictionary( _this, pool );
   }
 
   spinLock_unlock( &_this->lock );
 
+  /* minPoolSize: connect outside the dictionary lock */
+  if( created && pool->min_idle > 0 ) {
+    mongo_mutex_lock( &pool->lock );
+    mongo_connection_pool_warm( pool );
+    mongo_mutex_unlock( &pool->lock );
+  }
+
   return pool;
+}
+
+MONGO_EXPORT void mongo_connection_dictionary_get_metrics( mongo_connection_dictionary *_this, mongo_connection_pool_metrics *metrics ) {
+  mongo_connection_pool *pool = ( mongo_connection_pool* )crossLoadAcquire( ( void* volatile* )&_this->head );
+
+  memset( metrics, 0, sizeof( mongo_connection_pool_metrics ) );
+  for( ; pool != NULL; pool = pool->next )
+    mongo_connection_pool_add_metrics( pool, metrics );
 }
\ No newline at end of file
@@ -7,6 +7,7 @@ extern "C" {
 
 #include "mongo.h"
 #include "spin_lock.h"
+#include "mutex.h"
 
 #define MAX_USER_LEN 256
 #define MAX_PASS_LEN 256
@@ -21,26 +22,174 @@ typedef enum mongo_connection_error_t {
     MONGO_CONNECTION_MONGO_ERROR                    /**< Mongo driver error */
 } mongo_connection_error_t;
 
+#define MAX_W_MODE_LEN 64
+
+/* Settings read from a connection string, see
+   http://docs.mongodb.org/manual/reference/connection-string/ */
+typedef struct mongo_connection_options {
+    char user[MAX_USER_LEN];              /**< user to authenticate, empty for none */
+    char pass[MAX_PASS_LEN];              /**< password of user */
+    char db[MAX_DB_LEN];                  /**< database to authenticate against */
+    char replica_name[MAX_REPLICA_NAME_LEN]; /**< replicaSet, empty when connecting to a single server */
+    char *hosts;                          /**< host[:port] list, comma separated */
+    int valid;                            /**< non-zero if the whole string parsed */
+    int connect_timeout;                  /**< connectTimeoutMS, 0 for the system default */
+    unsigned int socket_timeout;          /**< socketTimeoutMS, DEFAULT_SOCKET_TIMEOUT if not given */
+    int max_pool_size;                    /**< maxPoolSize, 0 for no limit */
+    int min_pool_size;                    /**< minPoolSize */
+    int wait_queue_timeout;               /**< waitQueueTimeoutMS, 0 for no limit */
+    int max_idle_time;                    /**< maxIdleTimeMS, 0 for no limit */
+    int has_write_concern;                /**< non-zero if any of w, wtimeoutMS, journal or fsync was given */
+    int w;                                /**< w as a number */
+    char w_mode[MAX_W_MODE_LEN];          /**< w when not a number, e.g. "majority" */
+    int wtimeout;                         /**< wtimeoutMS */
+    int journal;                          /**< journal=true */
+    int fsync;                            /**< fsync=true */
+    mongo_read_preference read_preference; /**< readPreference */
+    int local_threshold;                  /**< localThresholdMS, MONGO_DEFAULT_LATENCY_WINDOW_MS if not given */
+} mongo_connection_options;
+
+#define MONGO_LATENCY_SUB_BITS 4
+#define MONGO_LATENCY_SUB_BUCKETS ( 1 << MONGO_LATENCY_SUB_BITS )
+#define MONGO_LATENCY_BUCKETS ( MONGO_LATENCY_SUB_BUCKETS * ( 33 - MONGO_LATENCY_SUB_BITS ) )
+
+/* Latency distribution in the manner of HdrHistogram: the first 32 buckets
+   count 0 to 31 microseconds one by one, then each power of two from 2^5 up
+   to 2^31 is split into MONGO_LATENCY_SUB_BUCKETS linear buckets, so a
+   bucket is never wider than 1/16 of its lower bound. The last bucket also
+   takes everything longer. Updated with atomic adds, so it can be read
+   while other threads record into it. */
+typedef struct mongo_latency_histogram {
+    volatile int64_t count;                           /**< samples recorded */
+    volatile int64_t total;                           /**< microseconds, summed over all samples */
+    volatile int64_t buckets[MONGO_LATENCY_BUCKETS];  /**< samples per bucket */
+} mongo_latency_histogram;
+
 typedef struct mongo_connection {
     mongo conn[1];                        /**< mongo object */
     mongo_connection_error_t err;         /**< error field */
     unsigned int timeout;                 /**< timeout to use for all socket operations */
     struct mongo_connection *next;        /**< pointer to next connection in the pool */
     struct mongo_connection_pool *pool;   /**< pointer to connection pool(used to return connection in the pool after it is released and to get connection string) */
+    int64_t created;                      /**< when the pool opened it, microseconds on mongo_env_clock_usec() */
+    int64_t last_used;                    /**< when it was last returned to the pool, same clock */
+    volatile long pinned;                 /**< non-zero while a thread cache holds it; changed under the pool lock */
+    volatile long cache_busy;             /**< pinned and handed out to its thread; cleared by another thread under the pool lock */
+    struct mongo_connection *next_pinned; /**< next connection held by a thread cache */
 } mongo_connection;
 
 typedef struct mongo_connection_pool {
-    char *cs;                             /**< connection string, see http://docs.mongodb.org/manual/reference/connection-string/ note: only replicaSet option is supported */
-    spin_lock lock;                       /**< spin lock object */
+    char *cs;                             /**< connection string, see http://docs.mongodb.org/manual/reference/connection-string/ */
+    mongo_connection_options options;     /**< cs, parsed once when the pool is created */
+    mongo_write_concern write_concern;    /**< default write concern from options, if it has one */
+    mongo_mutex lock;                     /**< protects the fields below */
+    mongo_cond available;                 /**< signalled when a connection is released */
     mongo_connection *head;               /**< first connection in the pool */
     struct mongo_connection_pool *next;   /**< next pool in dictionary */
+    unsigned int hash;                    /**< hash of cs, for dictionary lookups */
+    int max_size;                         /**< most connections open at once, 0 for no limit */
+    int min_idle;                         /**< idle connections opened ahead of demand */
+    int wait_timeout;                     /**< milliseconds acquire waits for a connection, 0 for no limit */
+    int ping_after;                       /**< milliseconds idle before a connection is pinged ahead of use, 0 never */
+    int max_idle_time;                    /**< milliseconds idle before a connection above min_idle is closed, 0 never */
+    int max_lifetime;                     /**< milliseconds after which a connection is replaced, 0 never */
+    int size;                             /**< connections open, idle or in use */
+    int idle;                             /**< connections in the pool */
+    int waiters;                          /**< threads waiting in acquire */
+    int64_t waits;                        /**< acquires that had to wait */
+    int64_t wait_time;                    /**< microseconds spent waiting, in total */
+    volatile int64_t timeouts;            /**< acquires that gave up waiting, updated atomically */
+    volatile int64_t evictions;           /**< connections closed as expired or failing a ping, updated atomically */
+    volatile int64_t acquires;            /**< calls to acquire, updated atomically */
+    volatile int64_t connects;            /**< connect and reconnect attempts, updated atomically */
+    volatile int64_t connect_failures;    /**< attempts that failed to connect, updated atomically */
+    volatile int64_t auth_failures;       /**< attempts that failed to authenticate, updated atomically */
+    mongo_latency_histogram acquire_latency; /**< time spent in acquire, waiting and connecting included */
+    mongo_latency_histogram connect_latency; /**< time to connect, without authentication */
+    mongo_latency_histogram auth_latency; /**< time to authenticate */
+    int thread_cache;                     /**< non-zero if released connections are kept for their thread */
+    int has_cache_key;                    /**< non-zero once cache_key is created */
+    mongo_tls_key cache_key;              /**< each thread's cached connection */
+    mongo_connection *pinned;             /**< connections held by thread caches, counted in size */
+    int cached;                           /**< connections held by thread caches */
 } mongo_connection_pool;
 
+typedef struct mongo_connection_pool_stats {
+    int size;                             /**< connections open, idle or in use */
+    int idle;                             /**< connections in the pool */
+    int waiters;                          /**< threads waiting in acquire */
+    int64_t waits;                        /**< acquires that had to wait */
+    int64_t wait_time;                    /**< microseconds spent waiting, in total */
+    int64_t timeouts;                     /**< acquires that gave up waiting */
+    int64_t evictions;                    /**< connections closed as expired or failing a ping */
+} mongo_connection_pool_stats;
+
+/* Snapshot taken without the pool lock. Counters only grow, so rates such
+   as connections opened per second come from the difference between two
+   snapshots. */
+typedef struct mongo_connection_pool_metrics {
+    int pools;                            /**< pools summed up, 1 for a single pool */
+    int size;                             /**< connections open, idle or in use */
+    int in_use;                           /**< connections handed out */
+    int idle;                             /**< connections in the pool */
+    int waiters;                          /**< threads waiting in acquire */
+    int cached;                           /**< connections held by thread caches, counted in size */
+    int64_t acquires;                     /**< calls to acquire */
+    int64_t connects;                     /**< connect and reconnect attempts */
+    int64_t connect_failures;             /**< attempts that failed to connect */
+    int64_t auth_failures;                /**< attempts that failed to authenticate */
+    int64_t timeouts;                     /**< acquires that gave up waiting */
+    int64_t evictions;                    /**< connections closed as expired or failing a ping */
+    mongo_latency_histogram acquire_latency; /**< time spent in acquire */
+    mongo_latency_histogram connect_latency; /**< time to connect */
+    mongo_latency_histogram auth_latency; /**< time to authenticate */
+} mongo_connection_pool_metrics;
+
+typedef struct mongo_connection_pool_table {
+    unsigned int mask;                            /**< number of slots - 1, a power of two minus one */
+    mongo_connection_pool * volatile *slots;      /**< open addressing, NULL marks the end of a probe */
+    struct mongo_connection_pool_table *retired;  /**< smaller table this one replaced, freed with the dictionary */
+} mongo_connection_pool_table;
+
 typedef struct mongo_connection_dictionary {
     mongo_connection_pool *head;        /**< first pool in dictionary */
-    spin_lock lock;                        /**< spin lock object*/
+    spin_lock lock;                        /**< spin lock object, taken only to add a pool */
+    int count;                             /**< pools in dictionary */
+    mongo_connection_pool_table * volatile table; /**< index of pools by connection string, read without the lock */
 } mongo_connection_dictionary;
 
+/**
+ * parse a connection string. Unknown options are ignored. Supported ones
+ * are replicaSet, connectTimeoutMS, socketTimeoutMS, maxPoolSize,
+ * minPoolSize, waitQueueTimeoutMS, maxIdleTimeMS, w, wtimeoutMS, journal,
+ * fsync, readPreference and localThresholdMS.
+ *
+ * @param options receives the settings, release with mongo_connection_options_destroy()
+ *
+ * @param cs connection string
+ *
+ * @return MONGO_OK if success, MONGO_ERROR if the string is malformed or an option has a bad value
+ */
+MONGO_EXPORT int mongo_connection_options_parse( mongo_connection_options *options, const char *cs );
+
+/**
+ * free memory held by parsed options
+ *
+ * @param options parsed options
+ */
+MONGO_EXPORT void mongo_connection_options_destroy( mongo_connection_options *options );
+
+/**
+ * cursor options matching the pool's read preference, to be or'ed into
+ * the options of queries run on this connection. Replica set connections
+ * also route queries to members by read preference.
+ *
+ * @param conn connection object
+ *
+ * @return MONGO_SLAVE_OK unless the read preference is primary, else 0
+ */
+MONGO_EXPORT int mongo_connection_read_options( mongo_connection *conn );
+
 /**
  * connect and authenticate
  *
@@ -88,18 +237,145 @@ MONGO_EXPORT unsigned int mongo_connection_get_socket_timeout( mongo_connection
 /**
  * get first connection from pool or open new one(if no connection in the pool)
  *
+ * When the pool already has max_size connections open, waits until one is
+ * released or the pool's wait timeout passes.
+ *
  * @param pool connection pool to get connection from
  *
  * @return connection already connected. Not need to call mongo_connection_connect()
  * note: connection could be not connected(check errors)
+ * NULL if the wait timed out
  *
  * Thread-Safe
  */
 MONGO_EXPORT mongo_connection* mongo_connection_pool_acquire( mongo_connection_pool *pool );
 
+/**
+ * same as mongo_connection_pool_acquire(), with its own wait timeout
+ *
+ * @param pool connection pool to get connection from
+ *
+ * @param timeout milliseconds to wait when the pool is exhausted, 0 for no limit
+ *
+ * @return connection, or NULL if the wait timed out
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT mongo_connection* mongo_connection_pool_acquire_timeout( mongo_connection_pool *pool, int timeout );
+
+/**
+ * bound the pool. Connections already open above max_size are closed as
+ * they are released. Opens connections until min_idle are in the pool.
+ *
+ * @param pool connection pool
+ *
+ * @param max_size most connections open at once, 0 for no limit(the default)
+ *
+ * @param min_idle idle connections to keep ready
+ *
+ * @param wait_timeout milliseconds acquire waits for a connection, 0 for no limit
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT void mongo_connection_pool_set_limits( mongo_connection_pool *pool, int max_size, int min_idle, int wait_timeout );
+
+/**
+ * set how idle connections are kept healthy. acquire applies these to the
+ * connection it hands out; mongo_connection_pool_maintain() applies them to
+ * the whole pool.
+ *
+ * @param pool connection pool
+ *
+ * @param ping_after milliseconds idle after which a connection is pinged
+ * before use and replaced if the ping fails, 0 to never ping
+ *
+ * @param max_idle_time milliseconds idle after which a connection is closed,
+ * except those needed to keep min_idle, 0 to keep them
+ *
+ * @param max_lifetime milliseconds after which a connection is closed and
+ * replaced, however busy, 0 for no limit
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT void mongo_connection_pool_set_maintenance( mongo_connection_pool *pool, int ping_after, int max_idle_time, int max_lifetime );
+
+/**
+ * keep one connection per thread out of the shared pool. A thread that
+ * releases a connection while it has none cached keeps it: its next acquire
+ * gets the same connection back without locks or atomic operations, and only
+ * its next release goes to the shared pool. A cached connection is returned
+ * to the pool when its thread exits.
+ *
+ * Cache hits are not counted in the pool's metrics. maintain() does not see
+ * cached connections; acquire replaces them when they expire. Disabling the
+ * cache returns each connection when its thread next acquires. Connections
+ * still cached when the dictionary is destroyed are closed with it.
+ *
+ * @param pool connection pool
+ *
+ * @param enabled non-zero to cache connections per thread
+ *
+ * @return MONGO_OK, or MONGO_ERROR if no thread-local slot is left
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT int mongo_connection_pool_set_thread_cache( mongo_connection_pool *pool, int enabled );
+
+/**
+ * maintenance pass over the idle connections: closes expired ones, pings
+ * those idle longer than ping_after and opens connections up to min_idle.
+ * Meant to be called periodically from a background thread so requests
+ * don't pay for reconnecting.
+ *
+ * @param pool connection pool
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT void mongo_connection_pool_maintain( mongo_connection_pool *pool );
+
+/**
+ * copy the pool's counters
+ *
+ * @param pool connection pool
+ *
+ * @param stats receives the counters
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT void mongo_connection_pool_get_stats( mongo_connection_pool *pool, mongo_connection_pool_stats *stats );
+
+/**
+ * copy the pool's gauges, counters and latency histograms without taking
+ * the pool lock. Gauges are read one by one, so they may not add up exactly
+ * while the pool is busy.
+ *
+ * @param pool connection pool
+ *
+ * @param metrics receives the snapshot
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT void mongo_connection_pool_get_metrics( mongo_connection_pool *pool, mongo_connection_pool_metrics *metrics );
+
+/**
+ * upper bound of the bucket holding the given percentile of the samples,
+ * at most 1/16 above the true value for latencies of 32 microseconds and
+ * more, exact below that
+ *
+ * @param histogram latency histogram
+ *
+ * @param percentile between 0 and 100
+ *
+ * @return microseconds, 0 if nothing was recorded
+ */
+MONGO_EXPORT int64_t mongo_latency_histogram_percentile( const mongo_latency_histogram *histogram, double percentile );
+
 /**
  * put connection back in the pool
  *
+ * A connection cached by another thread may be released here; it goes back
+ * to that thread, or to the pool if the thread has exited meanwhile.
+ *
  * @param pool connection pool to return connection
  *
  * @param conn unused connection
@@ -126,6 +402,8 @@ MONGO_EXPORT void mongo_connection_dictionary_destroy( mongo_connection_dictiona
 /**
  * get pool by connection string or create new one(will be added to dictionary)
  *
+ * Finding an existing pool takes no lock.
+ *
  * @param dict dictionary of connection pools(one for each connection string)
  *
  * @param cs connection string
@@ -134,6 +412,17 @@ MONGO_EXPORT void mongo_connection_dictionary_destroy( mongo_connection_dictiona
  */
 MONGO_EXPORT mongo_connection_pool* mongo_connection_dictionary_get_pool( mongo_connection_dictionary *dict, const char *cs );
 
+/**
+ * sum the metrics of every pool in the dictionary, without locking
+ *
+ * @param dict dictionary of connection pools
+ *
+ * @param metrics receives the totals
+ *
+ * Thread-Safe
+ */
+MONGO_EXPORT void mongo_connection_dictionary_get_metrics( mongo_connection_dictionary *dict, mongo_connection_pool_metrics *metrics );
+
 #ifdef __cplusplus
 } // extern "c"
 #endif
@@ -39,6 +39,21 @@
 
 #include "bson.h"
 #include "encoding.h"
+#include "spin_lock.h"
+
+/* SSE2 is part of every x86-64 target; SSSE3 and AVX2 are compiled per
+ * function and only used when the CPU reports them. */
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#define BSON_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(BSON_HAVE_SSE2) && ( defined(__x86_64__) || defined(__i386__) ) && \
+    ( defined(__clang__) || ( defined(__GNUC__) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) ) ) )
+#define BSON_HAVE_SSSE3
+#define BSON_HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 /*
  * Index into the table below with the first byte of a UTF-8 sequence to
@@ -119,19 +134,350 @@ static int bson_string_is_db_ref( const unsigned char *string, const size_t leng
     return result;
 }
 
+/*
+ * Most field names and strings are plain ASCII, which needs no sequence
+ * checks at all. These return the length of the ASCII run that string
+ * starts with, at most length, and set *dot if the run has a '.', so
+ * that run is validated and scanned for dots in one pass.
+ */
+static size_t bson_ascii_span_scalar( const unsigned char *string, size_t length, int *dot ) {
+    size_t position = 0;
+
+    while ( position < length && string[position] < 0x80 ) {
+        if ( string[position] == '.' )
+            *dot = 1;
+        position++;
+    }
+
+    return position;
+}
+
+#ifdef BSON_HAVE_SSE2
+static size_t bson_ascii_span_sse2( const unsigned char *string, size_t length, int *dot ) {
+    const __m128i dots = _mm_set1_epi8( '.' );
+    size_t position = 0;
+
+    for ( ; position + 16 <= length; position += 16 ) {
+        __m128i chunk = _mm_loadu_si128( ( const __m128i * )( string + position ) );
+
+        /* The high bit of any byte starts a multi-byte sequence; finish byte by byte. */
+        if ( _mm_movemask_epi8( chunk ) )
+            break;
+        if ( _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, dots ) ) )
+            *dot = 1;
+    }
+
+    return position + bson_ascii_span_scalar( string + position, length - position, dot );
+}
+#endif
+
+#if defined(BSON_HAVE_SSSE3) || defined(BSON_HAVE_AVX2)
+/*
+ * Whole-string validation with SSSE3 or AVX2, after Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte". Each byte is
+ * classified together with the one before it through three 16-entry
+ * tables, indexed by the high and low nibble of the previous byte and
+ * the high nibble of the current one; a bit left set in all three is an
+ * error. Third and fourth bytes of a sequence are checked separately
+ * against the lead two or three bytes back. Surrogates are accepted, as
+ * isLegalUTF8 accepts them.
+ */
+#define BSON_UTF8_TOO_SHORT   0x01 /* lead byte not followed by a continuation */
+#define BSON_UTF8_TOO_LONG    0x02 /* ASCII followed by a continuation */
+#define BSON_UTF8_OVERLONG_3  0x04 /* 11100000 100_____ */
+#define BSON_UTF8_TOO_LARGE   0x08 /* above U+10FFFF */
+#define BSON_UTF8_OVERLONG_2  0x20 /* 1100000_ 10______ */
+#define BSON_UTF8_OVERLONG_4  0x40 /* 11110000 1000____ */
+#define BSON_UTF8_TOO_LARGE_1000 0x40 /* 11110101 1000____ and above */
+#define BSON_UTF8_TWO_CONTS   0x80 /* two continuations in a row, valid only inside a sequence */
+#define BSON_UTF8_CARRY       ( BSON_UTF8_TOO_SHORT | BSON_UTF8_TOO_LONG | BSON_UTF8_TWO_CONTS )
+
+static const unsigned char bson_utf8_byte_1_high[16] = {
+    /* 0_______ ASCII */
+    BSON_UTF8_TOO_LONG, BSON_UTF8_TOO_LONG, BSON_UTF8_TOO_LONG, BSON_UTF8_TOO_LONG,
+    BSON_UTF8_TOO_LONG, BSON_UTF8_TOO_LONG, BSON_UTF8_TOO_LONG, BSON_UTF8_TOO_LONG,
+    /* 10______ continuation */
+    BSON_UTF8_TWO_CONTS, BSON_UTF8_TWO_CONTS, BSON_UTF8_TWO_CONTS, BSON_UTF8_TWO_CONTS,
+    /* 1100____ and 1101____ two byte leads */
+    BSON_UTF8_TOO_SHORT | BSON_UTF8_OVERLONG_2,
+    BSON_UTF8_TOO_SHORT,
+    /* 1110____ three byte lead */
+    BSON_UTF8_TOO_SHORT | BSON_UTF8_OVERLONG_3,
+    /* 1111____ four byte lead */
+    BSON_UTF8_TOO_SHORT | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000 | BSON_UTF8_OVERLONG_4
+};
+
+static const unsigned char bson_utf8_byte_1_low[16] = {
+    /* ____0000 */
+    BSON_UTF8_CARRY | BSON_UTF8_OVERLONG_3 | BSON_UTF8_OVERLONG_2 | BSON_UTF8_OVERLONG_4,
+    /* ____0001 */
+    BSON_UTF8_CARRY | BSON_UTF8_OVERLONG_2,
+    /* ____001_ */
+    BSON_UTF8_CARRY,
+    BSON_UTF8_CARRY,
+    /* ____0100 */
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE,
+    /* ____0101 and up */
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000,
+    BSON_UTF8_CARRY | BSON_UTF8_TOO_LARGE | BSON_UTF8_TOO_LARGE_1000
+};
+
+static const unsigned char bson_utf8_byte_2_high[16] = {
+    /* ________ 0_______ ASCII */
+    BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT,
+    BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT,
+    /* ________ 1000____ */
+    BSON_UTF8_TOO_LONG | BSON_UTF8_OVERLONG_2 | BSON_UTF8_TWO_CONTS | BSON_UTF8_OVERLONG_3 |
+    BSON_UTF8_TOO_LARGE_1000 | BSON_UTF8_OVERLONG_4,
+    /* ________ 1001____ */
+    BSON_UTF8_TOO_LONG | BSON_UTF8_OVERLONG_2 | BSON_UTF8_TWO_CONTS | BSON_UTF8_OVERLONG_3 |
+    BSON_UTF8_TOO_LARGE,
+    /* ________ 101_____ */
+    BSON_UTF8_TOO_LONG | BSON_UTF8_OVERLONG_2 | BSON_UTF8_TWO_CONTS | BSON_UTF8_TOO_LARGE,
+    BSON_UTF8_TOO_LONG | BSON_UTF8_OVERLONG_2 | BSON_UTF8_TWO_CONTS | BSON_UTF8_TOO_LARGE,
+    /* ________ 11______ */
+    BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT, BSON_UTF8_TOO_SHORT
+};
+
+/* The largest byte that can end a block without leaving a sequence open. */
+static const unsigned char bson_utf8_block_end[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF
+};
+#endif
+
+#ifdef BSON_HAVE_SSSE3
+__attribute__(( target( "ssse3" ) ))
+static __m128i bson_utf8_errors_ssse3( __m128i input, __m128i previous ) {
+    const __m128i nibble = _mm_set1_epi8( 0x0F );
+    __m128i prev1 = _mm_alignr_epi8( input, previous, 15 );
+    __m128i prev2 = _mm_alignr_epi8( input, previous, 14 );
+    __m128i prev3 = _mm_alignr_epi8( input, previous, 13 );
+    __m128i special, must_continue;
+
+    special = _mm_and_si128(
+                  _mm_and_si128(
+                      _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * )bson_utf8_byte_1_high ),
+                                        _mm_and_si128( _mm_srli_epi16( prev1, 4 ), nibble ) ),
+                      _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * )bson_utf8_byte_1_low ),
+                                        _mm_and_si128( prev1, nibble ) ) ),
+                  _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * )bson_utf8_byte_2_high ),
+                                    _mm_and_si128( _mm_srli_epi16( input, 4 ), nibble ) ) );
+
+    /* The high bit is set where a three or four byte lead demands a continuation. */
+    must_continue = _mm_or_si128( _mm_subs_epu8( prev2, _mm_set1_epi8( ( char )( 0xE0 - 0x80 ) ) ),
+                                  _mm_subs_epu8( prev3, _mm_set1_epi8( ( char )( 0xF0 - 0x80 ) ) ) );
+    return _mm_xor_si128( _mm_and_si128( must_continue, _mm_set1_epi8( ( char )0x80 ) ), special );
+}
+
+/* Return 1 if the whole string is valid UTF-8, setting *dot if it has a '.'.
+ * The tail is checked zero-padded, which also catches a sequence left open. */
+__attribute__(( target( "ssse3" ) ))
+static int bson_utf8_valid_ssse3( const unsigned char *string, size_t length, int *dot ) {
+    const __m128i dots = _mm_set1_epi8( '.' );
+    const __m128i block_end = _mm_loadu_si128( ( const __m128i * )( bson_utf8_block_end + 16 ) );
+    __m128i previous = _mm_setzero_si128(), errors = _mm_setzero_si128(), found = _mm_setzero_si128();
+    __m128i input;
+    unsigned char tail[16];
+    size_t position = 0;
+    int last = 0;
+
+    while ( !last ) {
+        if ( position + 16 <= length )
+            input = _mm_loadu_si128( ( const __m128i * )( string + position ) );
+        else {
+            memset( tail, 0, sizeof( tail ) );
+            memcpy( tail, string + position, length - position );
+            input = _mm_loadu_si128( ( const __m128i * )tail );
+            last = 1;
+        }
+
+        found = _mm_or_si128( found, _mm_cmpeq_epi8( input, dots ) );
+        if ( _mm_movemask_epi8( input ) )
+            errors = _mm_or_si128( errors, bson_utf8_errors_ssse3( input, previous ) );
+        else
+            errors = _mm_or_si128( errors, _mm_subs_epu8( previous, block_end ) );
+        previous = input;
+        position += 16;
+    }
+
+    if ( _mm_movemask_epi8( found ) )
+        *dot = 1;
+    return _mm_movemask_epi8( _mm_cmpeq_epi8( errors, _mm_setzero_si128() ) ) == 0xFFFF;
+}
+#endif
+
+#ifdef BSON_HAVE_AVX2
+__attribute__(( target( "avx2" ) ))
+static __m256i bson_utf8_errors_avx2( __m256i input, __m256i previous ) {
+    const __m256i nibble = _mm256_set1_epi8( 0x0F );
+    __m256i carried = _mm256_permute2x128_si256( previous, input, 0x21 );
+    __m256i prev1 = _mm256_alignr_epi8( input, carried, 15 );
+    __m256i prev2 = _mm256_alignr_epi8( input, carried, 14 );
+    __m256i prev3 = _mm256_alignr_epi8( input, carried, 13 );
+    __m256i special, must_continue;
+
+    special = _mm256_and_si256(
+                  _mm256_and_si256(
+                      _mm256_shuffle_epi8( _mm256_broadcastsi128_si256(
+                                               _mm_loadu_si128( ( const __m128i * )bson_utf8_byte_1_high ) ),
+                                           _mm256_and_si256( _mm256_srli_epi16( prev1, 4 ), nibble ) ),
+                      _mm256_shuffle_epi8( _mm256_broadcastsi128_si256(
+                                               _mm_loadu_si128( ( const __m128i * )bson_utf8_byte_1_low ) ),
+                                           _mm256_and_si256( prev1, nibble ) ) ),
+                  _mm256_shuffle_epi8( _mm256_broadcastsi128_si256(
+                                           _mm_loadu_si128( ( const __m128i * )bson_utf8_byte_2_high ) ),
+                                       _mm256_and_si256( _mm256_srli_epi16( input, 4 ), nibble ) ) );
+
+    must_continue = _mm256_or_si256( _mm256_subs_epu8( prev2, _mm256_set1_epi8( ( char )( 0xE0 - 0x80 ) ) ),
+                                     _mm256_subs_epu8( prev3, _mm256_set1_epi8( ( char )( 0xF0 - 0x80 ) ) ) );
+    return _mm256_xor_si256( _mm256_and_si256( must_continue, _mm256_set1_epi8( ( char )0x80 ) ), special );
+}
+
+__attribute__(( target( "avx2" ) ))
+static int bson_utf8_valid_avx2( const unsigned char *string, size_t length, int *dot ) {
+    const __m256i dots = _mm256_set1_epi8( '.' );
+    const __m256i block_end = _mm256_loadu_si256( ( const __m256i * )bson_utf8_block_end );
+    __m256i previous = _mm256_setzero_si256(), errors = _mm256_setzero_si256(), found = _mm256_setzero_si256();
+    __m256i input;
+    unsigned char tail[32];
+    size_t position = 0;
+    int last = 0;
+
+    while ( !last ) {
+        if ( position + 32 <= length )
+            input = _mm256_loadu_si256( ( const __m256i * )( string + position ) );
+        else {
+            memset( tail, 0, sizeof( tail ) );
+            memcpy( tail, string + position, length - position );
+            input = _mm256_loadu_si256( ( const __m256i * )tail );
+            last = 1;
+        }
+
+        found = _mm256_or_si256( found, _mm256_cmpeq_epi8( input, dots ) );
+        if ( _mm256_movemask_epi8( input ) )
+            errors = _mm256_or_si256( errors, bson_utf8_errors_avx2( input, previous ) );
+        else
+            errors = _mm256_or_si256( errors, _mm256_subs_epu8( previous, block_end ) );
+        previous = input;
+        position += 32;
+    }
+
+    if ( _mm256_movemask_epi8( found ) )
+        *dot = 1;
+    return _mm256_movemask_epi8( _mm256_cmpeq_epi8( errors, _mm256_setzero_si256() ) ) == -1;
+}
+#endif
+
+/* The implementation in use, a bson_utf8_check_impl; BSON_UTF8_CHECK_BEST until resolved. */
+static volatile long bson_utf8_check_used = BSON_UTF8_CHECK_BEST;
+
+/* The widest implementation this build and CPU support. */
+static long bson_utf8_check_best( void ) {
+    long impl = BSON_UTF8_CHECK_SCALAR;
+
+#ifdef BSON_HAVE_SSE2
+    impl = BSON_UTF8_CHECK_SSE2;
+#endif
+#ifdef BSON_HAVE_SSSE3
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "ssse3" ) )
+        impl = BSON_UTF8_CHECK_SSSE3;
+#endif
+#ifdef BSON_HAVE_AVX2
+    if ( __builtin_cpu_supports( "avx2" ) )
+        impl = BSON_UTF8_CHECK_AVX2;
+#endif
+
+    return impl;
+}
+
+MONGO_EXPORT int bson_utf8_check_force( bson_utf8_check_impl impl ) {
+    long best = bson_utf8_check_best();
+
+    /* Each implementation is built whenever a wider one is. */
+    if ( impl == BSON_UTF8_CHECK_BEST )
+        impl = ( bson_utf8_check_impl )best;
+    else if ( impl > best )
+        return BSON_ERROR;
+
+    crossStoreReleaseLong( &bson_utf8_check_used, impl );
+    return BSON_OK;
+}
+
+/* Resolved on first use; threads racing through it all store the same value. */
+static long bson_utf8_check( void ) {
+    long impl = crossLoadAcquireLong( &bson_utf8_check_used );
+
+    if ( impl == BSON_UTF8_CHECK_BEST ) {
+        impl = bson_utf8_check_best();
+        crossStoreReleaseLong( &bson_utf8_check_used, impl );
+    }
+    return impl;
+}
+
 static int bson_validate_string( bson *b, const unsigned char *string,
                                  const size_t length, const char check_utf8, const char check_dot,
                                  const char check_dollar ) {
 
     size_t position = 0;
     int sequence_length = 1;
+    int dot = 0;
+    long impl = check_utf8 ? bson_utf8_check() : BSON_UTF8_CHECK_SCALAR;
+    int valid = 0;
 
     if( check_dollar && string[0] == '$' ) {
         if( !bson_string_is_db_ref( string, length ) )
             b->err |= BSON_FIELD_INIT_DOLLAR;
     }
 
+    /* A valid string is checked whole. An invalid one goes through the
+     * loop below, which stops at the first bad sequence, so the flags
+     * come out as they always have. */
+    switch ( impl ) {
+#ifdef BSON_HAVE_AVX2
+    case BSON_UTF8_CHECK_AVX2:
+        valid = bson_utf8_valid_avx2( string, length, &dot );
+        break;
+#endif
+#ifdef BSON_HAVE_SSSE3
+    case BSON_UTF8_CHECK_SSSE3:
+        valid = bson_utf8_valid_ssse3( string, length, &dot );
+        break;
+#endif
+    default:
+        break;
+    }
+    if ( valid ) {
+        if ( check_dot && dot )
+            b->err |= BSON_FIELD_HAS_DOT;
+        return BSON_OK;
+    }
+    dot = 0;
+
     while ( position < length ) {
+        if ( check_utf8 && string[position] < 0x80 ) {
+#ifdef BSON_HAVE_SSE2
+            if ( impl != BSON_UTF8_CHECK_SCALAR )
+                position += bson_ascii_span_sse2( string + position, length - position, &dot );
+            else
+#endif
+                position += bson_ascii_span_scalar( string + position, length - position, &dot );
+            if ( check_dot && dot )
+                b->err |= BSON_FIELD_HAS_DOT;
+            if ( position == length )
+                break;
+        }
+
         if ( check_dot && *( string + position ) == '.' ) {
             b->err |= BSON_FIELD_HAS_DOT;
         }
@@ -50,5 +50,26 @@ int bson_check_field_name( bson *b, const char *string,
 bson_bool_t bson_check_string( bson *b, const char *string,
                                const size_t length );
 
+/**
+ * Implementations of the UTF-8 check behind both functions above.
+ */
+typedef enum {
+    BSON_UTF8_CHECK_BEST,   /**< The widest one the CPU supports, chosen on first use. */
+    BSON_UTF8_CHECK_SCALAR, /**< One byte or sequence at a time. */
+    BSON_UTF8_CHECK_SSE2,   /**< ASCII runs 16 bytes at a time, other sequences one at a time. */
+    BSON_UTF8_CHECK_SSSE3,  /**< Every sequence, 16 bytes at a time. */
+    BSON_UTF8_CHECK_AVX2    /**< Every sequence, 32 bytes at a time. */
+} bson_utf8_check_impl;
+
+/**
+ * Make all later string checks use one implementation, so tests can
+ * cover each of them.
+ *
+ * @param impl The implementation, or BSON_UTF8_CHECK_BEST to go back to the default.
+ *
+ * @return BSON_OK, or BSON_ERROR if this build or CPU lacks it.
+ */
+MONGO_EXPORT int bson_utf8_check_force( bson_utf8_check_impl impl );
+
 MONGO_EXTERN_C_END
 #endif
@@ -34,6 +34,9 @@
 # define NI_MAXSERV 32
 #endif
 
+/* Maximum number of buffers handed to a single WSASend call. */
+#define MONGO_ENV_IOV_BATCH 64
+
 int mongo_env_close_socket( SOCKET socket ) {
     return closesocket( socket );
 }
@@ -56,6 +59,37 @@ int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+int mongo_env_writev_socket( mongo *conn, const mongo_iovec *iov, int iovcnt ) {
+    WSABUF bufs[MONGO_ENV_IOV_BATCH];
+    size_t offset = 0; /* bytes of iov[0] already written */
+
+    while ( iovcnt > 0 ) {
+        DWORD sent;
+        int n;
+
+        for ( n = 0; n < iovcnt && n < MONGO_ENV_IOV_BATCH; n++ ) {
+            bufs[n].buf = ( char * )iov[n].base + ( n ? 0 : offset );
+            bufs[n].len = ( ULONG )( iov[n].len - ( n ? 0 : offset ) );
+        }
+
+        if ( WSASend( conn->sock, bufs, ( DWORD )n, &sent, 0, NULL, NULL ) != 0 ) {
+            __mongo_set_error( conn, MONGO_IO_ERROR, NULL, WSAGetLastError() );
+            conn->connected = 0;
+            return MONGO_ERROR;
+        }
+
+        while ( iovcnt > 0 && ( size_t )sent >= iov->len - offset ) {
+            sent -= ( DWORD )( iov->len - offset );
+            offset = 0;
+            iov++;
+            iovcnt--;
+        }
+        offset += sent;
+    }
+
+    return MONGO_OK;
+}
+
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     char *cbuf = (char*)buf;
 
@@ -72,6 +106,66 @@ int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+int mongo_env_read_socket_some( mongo *conn, void *buf, size_t len ) {
+    int got = recv( conn->sock, (char*)buf, (int)len, 0 );
+    if ( got == 0 || got == SOCKET_ERROR ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, NULL, WSAGetLastError() );
+        return -1;
+    }
+
+    return got;
+}
+
+int64_t mongo_env_clock_usec( void ) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+
+    if ( !frequency.QuadPart )
+        QueryPerformanceFrequency( &frequency );
+    QueryPerformanceCounter( &now );
+    return ( int64_t )( now.QuadPart / frequency.QuadPart ) * 1000000 +
+           ( int64_t )( now.QuadPart % frequency.QuadPart ) * 1000000 / frequency.QuadPart;
+}
+
+int mongo_env_set_socket_nonblocking( mongo *conn, int nonblocking ) {
+    u_long mode = nonblocking ? 1 : 0;
+
+    if ( ioctlsocket( conn->sock, FIONBIO, &mode ) != 0 ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, NULL, WSAGetLastError() );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+int mongo_env_try_read_socket( mongo *conn, void *buf, size_t len ) {
+    int got = recv( conn->sock, (char*)buf, (int)len, 0 );
+
+    if ( got == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK )
+        return 0;
+    if ( got == 0 || got == SOCKET_ERROR ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, NULL, WSAGetLastError() );
+        conn->connected = 0;
+        return -1;
+    }
+
+    return got;
+}
+
+int mongo_env_try_write_socket( mongo *conn, const void *buf, size_t len ) {
+    int sent = send( conn->sock, (const char*)buf, (int)len, 0 );
+
+    if ( sent == SOCKET_ERROR ) {
+        if ( WSAGetLastError() == WSAEWOULDBLOCK )
+            return 0;
+        __mongo_set_error( conn, MONGO_IO_ERROR, NULL, WSAGetLastError() );
+        conn->connected = 0;
+        return -1;
+    }
+
+    return sent;
+}
+
 int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
     if ( setsockopt( conn->sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&millis,
                      sizeof( millis ) ) == -1 ) {
@@ -90,6 +184,37 @@ int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
     return MONGO_OK;
 }
 
+/* connect(), giving up after conn->conn_timeout_ms if one is set. */
+static int mongo_env_connect_addr( mongo *conn, const struct sockaddr *addr, int addrlen ) {
+    u_long on = 1, off = 0;
+    int status, err = 0, len = sizeof( err );
+    fd_set writable, failed;
+    struct timeval timeout;
+
+    if( conn->conn_timeout_ms <= 0 )
+        return connect( conn->sock, addr, addrlen );
+
+    ioctlsocket( conn->sock, FIONBIO, &on );
+
+    status = connect( conn->sock, addr, addrlen );
+    if( status != 0 && WSAGetLastError() == WSAEWOULDBLOCK ) {
+        FD_ZERO( &writable );
+        FD_SET( conn->sock, &writable );
+        FD_ZERO( &failed );
+        FD_SET( conn->sock, &failed );
+        timeout.tv_sec = conn->conn_timeout_ms / 1000;
+        timeout.tv_usec = ( conn->conn_timeout_ms % 1000 ) * 1000;
+        if( select( 0, NULL, &writable, &failed, &timeout ) == 1 && FD_ISSET( conn->sock, &writable ) &&
+                getsockopt( conn->sock, SOL_SOCKET, SO_ERROR, ( char * )&err, &len ) == 0 && err == 0 )
+            status = 0;
+        else if( status != 0 )
+            WSASetLastError( err ? err : WSAETIMEDOUT );
+    }
+
+    ioctlsocket( conn->sock, FIONBIO, &off );
+    return status;
+}
+
 int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
     char port_str[NI_MAXSERV];
     char errstr[MONGO_ERR_LEN];
@@ -127,7 +252,7 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
             continue;
         }
 
-        status = connect( conn->sock, ai_ptr->ai_addr, (int)ai_ptr->ai_addrlen );
+        status = mongo_env_connect_addr( conn, ai_ptr->ai_addr, (int)ai_ptr->ai_addrlen );
         if ( status != 0 ) {
             __mongo_set_error( conn, MONGO_SOCKET_ERROR, "connect() failed",
                                WSAGetLastError() );
@@ -162,6 +287,141 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
     }
 }
 
+int mongo_env_resolve( mongo *conn, const char *host, int port, struct addrinfo **addrs ) {
+    char port_str[NI_MAXSERV];
+    char errstr[MONGO_ERR_LEN];
+    int status;
+
+    struct addrinfo ai_hints;
+
+    *addrs = NULL;
+    bson_sprintf( port_str, "%d", port );
+
+    memset( &ai_hints, 0, sizeof( ai_hints ) );
+    ai_hints.ai_family = AF_UNSPEC;
+    ai_hints.ai_socktype = SOCK_STREAM;
+    ai_hints.ai_protocol = IPPROTO_TCP;
+
+    status = getaddrinfo( host, port_str, &ai_hints, addrs );
+    if ( status != 0 ) {
+        *addrs = NULL;
+        bson_sprintf( errstr, "getaddrinfo failed with error %d", status );
+        __mongo_set_error( conn, MONGO_CONN_ADDR_FAIL, errstr, WSAGetLastError() );
+        return MONGO_ERROR;
+    }
+    return MONGO_OK;
+}
+
+void mongo_env_free_addrs( struct addrinfo *addrs ) {
+    if ( addrs )
+        freeaddrinfo( addrs );
+}
+
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port,
+                                    const struct addrinfo *addrs, int attempt ) {
+    int status, err;
+    u_long on = 1;
+
+    const struct addrinfo *ai_ptr = NULL;
+
+    conn->sock = 0;
+    conn->connected = 0;
+
+    for ( ai_ptr = addrs; ai_ptr != NULL && attempt > 0; ai_ptr = ai_ptr->ai_next )
+        attempt--;
+
+    /* MONGO_CONN_ADDR_FAIL once the addresses run out. */
+    err = ai_ptr != NULL ? MONGO_CONN_FAIL : MONGO_CONN_ADDR_FAIL;
+    status = MONGO_ERROR;
+    if ( ai_ptr != NULL ) {
+        conn->sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
+        if ( conn->sock == INVALID_SOCKET ) {
+            __mongo_set_error( conn, MONGO_SOCKET_ERROR, "socket() failed", WSAGetLastError() );
+            conn->sock = 0;
+        }
+        else {
+            ioctlsocket( conn->sock, FIONBIO, &on );
+            if ( connect( conn->sock, ai_ptr->ai_addr, (int)ai_ptr->ai_addrlen ) == 0 ||
+                    WSAGetLastError() == WSAEWOULDBLOCK )
+                status = MONGO_OK;
+            else {
+                __mongo_set_error( conn, MONGO_SOCKET_ERROR, "connect() failed", WSAGetLastError() );
+                mongo_env_close_socket( conn->sock );
+                conn->sock = 0;
+            }
+        }
+    }
+
+    if ( status != MONGO_OK )
+        conn->err = err;
+    return status;
+}
+
+int mongo_env_socket_connect_finish( mongo *conn ) {
+    u_long off = 0;
+    int err = 0, len = sizeof( err ), flag = 1;
+
+    if ( conn->connected )
+        return MONGO_OK;
+
+    if ( getsockopt( conn->sock, SOL_SOCKET, SO_ERROR, ( char * )&err, &len ) != 0 || err != 0 ) {
+        __mongo_set_error( conn, MONGO_SOCKET_ERROR, "connect() failed", err );
+        mongo_env_close_socket( conn->sock );
+        conn->sock = 0;
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
+
+    ioctlsocket( conn->sock, FIONBIO, &off );
+    setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY, ( const char * ) &flag, sizeof( flag ) );
+    if ( conn->op_timeout_ms > 0 )
+        mongo_env_set_socket_op_timeout( conn, conn->op_timeout_ms );
+
+    conn->connected = 1;
+    mongo_clear_errors( conn );
+    return MONGO_OK;
+}
+
+int mongo_env_poll_sockets( mongo **conns, int *events, int count, int timeout_ms ) {
+    fd_set readable, writable, failed;
+    struct timeval timeout;
+    int i, ready;
+
+    /* select() watches at most FD_SETSIZE sockets; replica sets are far smaller. */
+    FD_ZERO( &readable );
+    FD_ZERO( &writable );
+    FD_ZERO( &failed );
+    for ( i = 0; i < count; i++ ) {
+        if ( events[i] & MONGO_WANT_READ )
+            FD_SET( conns[i]->sock, &readable );
+        if ( events[i] & MONGO_WANT_WRITE )
+            FD_SET( conns[i]->sock, &writable );
+        FD_SET( conns[i]->sock, &failed );
+    }
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = ( timeout_ms % 1000 ) * 1000;
+    ready = select( 0, &readable, &writable, &failed, &timeout );
+    if ( ready == SOCKET_ERROR )
+        ready = -1;
+
+    for ( i = 0; i < count; i++ ) {
+        int want = events[i];
+        int broken = ready > 0 && FD_ISSET( conns[i]->sock, &failed );
+
+        /* A failed connect lands in the exception set; wake the caller to see it. */
+        events[i] = 0;
+        if ( ready <= 0 )
+            continue;
+        if ( want & MONGO_WANT_READ && ( broken || FD_ISSET( conns[i]->sock, &readable ) ) )
+            events[i] |= MONGO_WANT_READ;
+        if ( want & MONGO_WANT_WRITE && ( broken || FD_ISSET( conns[i]->sock, &writable ) ) )
+            events[i] |= MONGO_WANT_WRITE;
+    }
+
+    return ready;
+}
+
 MONGO_EXPORT int mongo_env_sock_init( void ) {
 
     WSADATA wsaData;
@@ -203,20 +463,27 @@ MONGO_EXPORT int mongo_env_sock_init( void ) {
 #include <string.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #ifndef NI_MAXSERV
 # define NI_MAXSERV 32
 #endif
 
+/* Maximum number of buffers handed to a single sendmsg call.
+ * Comfortably below IOV_MAX everywhere we build. */
+#define MONGO_ENV_IOV_BATCH 64
+
 int mongo_env_close_socket( SOCKET socket ) {
     return close( socket );
 }
@@ -248,6 +515,52 @@ int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+int mongo_env_writev_socket( mongo *conn, const mongo_iovec *iov, int iovcnt ) {
+    struct iovec vec[MONGO_ENV_IOV_BATCH];
+    struct msghdr msg;
+    size_t offset = 0; /* bytes of iov[0] already written */
+#ifdef __APPLE__
+    int flags = 0;
+#else
+    int flags = MSG_NOSIGNAL;
+#endif
+
+    while ( iovcnt > 0 ) {
+        ssize_t sent;
+        int n;
+
+        for ( n = 0; n < iovcnt && n < MONGO_ENV_IOV_BATCH; n++ ) {
+            vec[n].iov_base = ( char * )iov[n].base + ( n ? 0 : offset );
+            vec[n].iov_len = iov[n].len - ( n ? 0 : offset );
+        }
+
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = vec;
+        msg.msg_iovlen = n;
+
+        sent = sendmsg( conn->sock, &msg, flags );
+        if ( sent == -1 ) {
+            if ( errno == EINTR )
+                continue;
+            if ( errno == EPIPE )
+                conn->connected = 0;
+            __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+            return MONGO_ERROR;
+        }
+
+        /* Skip past whatever was written; a short write resumes mid-buffer. */
+        while ( iovcnt > 0 && ( size_t )sent >= iov->len - offset ) {
+            sent -= iov->len - offset;
+            offset = 0;
+            iov++;
+            iovcnt--;
+        }
+        offset += sent;
+    }
+
+    return MONGO_OK;
+}
+
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     char *cbuf = buf;
     while ( len ) {
@@ -263,6 +576,92 @@ int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+int mongo_env_read_socket_some( mongo *conn, void *buf, size_t len ) {
+    ssize_t got;
+
+    do {
+        got = recv( conn->sock, buf, len, 0 );
+    } while ( got == -1 && errno == EINTR );
+
+    if ( got == 0 || got == -1 ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+        return -1;
+    }
+
+    return ( int )got;
+}
+
+int64_t mongo_env_clock_usec( void ) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if ( clock_gettime( CLOCK_MONOTONIC, &ts ) == 0 )
+        return ( int64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday( &tv, NULL );
+        return ( int64_t )tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+int mongo_env_set_socket_nonblocking( mongo *conn, int nonblocking ) {
+    int flags = fcntl( conn->sock, F_GETFL, 0 );
+
+    if ( flags == -1 ||
+         fcntl( conn->sock, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK ) == -1 ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+int mongo_env_try_read_socket( mongo *conn, void *buf, size_t len ) {
+    ssize_t got;
+
+    do {
+        got = recv( conn->sock, buf, len, 0 );
+    } while ( got == -1 && errno == EINTR );
+
+    if ( got == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        return 0;
+    if ( got == 0 ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, "Connection closed by peer.", 0 );
+        conn->connected = 0;
+        return -1;
+    }
+    if ( got == -1 ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+        conn->connected = 0;
+        return -1;
+    }
+
+    return ( int )got;
+}
+
+int mongo_env_try_write_socket( mongo *conn, const void *buf, size_t len ) {
+    ssize_t sent;
+#ifdef __APPLE__
+    int flags = 0;
+#else
+    int flags = MSG_NOSIGNAL;
+#endif
+
+    do {
+        sent = send( conn->sock, buf, len, flags );
+    } while ( sent == -1 && errno == EINTR );
+
+    if ( sent == -1 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            return 0;
+        __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+        conn->connected = 0;
+        return -1;
+    }
+
+    return ( int )sent;
+}
+
 int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
     struct timeval tv;
     tv.tv_sec = millis / 1000;
@@ -311,6 +710,31 @@ static int mongo_env_unix_socket_connect( mongo *conn, const char *sock_path ) {
     return MONGO_OK;
 }
 
+/* connect(), giving up after conn->conn_timeout_ms if one is set. */
+static int mongo_env_connect_addr( mongo *conn, const struct sockaddr *addr, socklen_t addrlen ) {
+    int flags, status, err = 0;
+    socklen_t len = sizeof( err );
+    struct pollfd pfd;
+
+    if( conn->conn_timeout_ms <= 0 )
+        return connect( conn->sock, addr, addrlen );
+
+    flags = fcntl( conn->sock, F_GETFL, 0 );
+    fcntl( conn->sock, F_SETFL, flags | O_NONBLOCK );
+
+    status = connect( conn->sock, addr, addrlen );
+    if( status != 0 && errno == EINPROGRESS ) {
+        pfd.fd = conn->sock;
+        pfd.events = POLLOUT;
+        if( poll( &pfd, 1, conn->conn_timeout_ms ) == 1 &&
+                getsockopt( conn->sock, SOL_SOCKET, SO_ERROR, &err, &len ) == 0 && err == 0 )
+            status = 0;
+    }
+
+    fcntl( conn->sock, F_SETFL, flags );
+    return status;
+}
+
 int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
     char port_str[NI_MAXSERV];
     int status;
@@ -349,7 +773,7 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
             continue;
         }
         
-        status = connect( conn->sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen );
+        status = mongo_env_connect_addr( conn, ai_ptr->ai_addr, ai_ptr->ai_addrlen );
         if ( status != 0 ) {
             mongo_env_close_socket( conn->sock );
             conn->sock = 0;
@@ -386,6 +810,142 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
     return MONGO_OK;
 }
 
+int mongo_env_resolve( mongo *conn, const char *host, int port, struct addrinfo **addrs ) {
+    char port_str[NI_MAXSERV];
+    int status;
+
+    struct addrinfo ai_hints;
+
+    *addrs = NULL;
+    if ( port < 0 )
+        return MONGO_OK;
+
+    bson_sprintf( port_str, "%d", port );
+
+    memset( &ai_hints, 0, sizeof( ai_hints ) );
+#ifdef AI_ADDRCONFIG
+    ai_hints.ai_flags = AI_ADDRCONFIG;
+#endif
+    ai_hints.ai_family = AF_UNSPEC;
+    ai_hints.ai_socktype = SOCK_STREAM;
+
+    status = getaddrinfo( host, port_str, &ai_hints, addrs );
+    if ( status != 0 ) {
+        *addrs = NULL;
+        bson_errprintf( "getaddrinfo failed: %s", gai_strerror( status ) );
+        conn->err = MONGO_CONN_ADDR_FAIL;
+        return MONGO_ERROR;
+    }
+    return MONGO_OK;
+}
+
+void mongo_env_free_addrs( struct addrinfo *addrs ) {
+    if ( addrs )
+        freeaddrinfo( addrs );
+}
+
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port,
+                                    const struct addrinfo *addrs, int attempt ) {
+    int status, flags, err;
+
+    const struct addrinfo *ai_ptr = NULL;
+
+    if ( port < 0 ) {
+        if ( attempt > 0 ) {
+            conn->err = MONGO_CONN_ADDR_FAIL;
+            return MONGO_ERROR;
+        }
+        return mongo_env_unix_socket_connect( conn, host );
+    }
+
+    conn->sock = 0;
+    conn->connected = 0;
+
+    for ( ai_ptr = addrs; ai_ptr != NULL && attempt > 0; ai_ptr = ai_ptr->ai_next )
+        attempt--;
+
+    /* MONGO_CONN_ADDR_FAIL once the addresses run out. */
+    err = ai_ptr != NULL ? MONGO_CONN_FAIL : MONGO_CONN_ADDR_FAIL;
+    status = MONGO_ERROR;
+    if ( ai_ptr != NULL ) {
+        conn->sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
+        if ( conn->sock == INVALID_SOCKET )
+            conn->sock = 0;
+        else {
+            flags = fcntl( conn->sock, F_GETFL, 0 );
+            fcntl( conn->sock, F_SETFL, flags | O_NONBLOCK );
+            if ( connect( conn->sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen ) == 0 || errno == EINPROGRESS )
+                status = MONGO_OK;
+            else {
+                mongo_env_close_socket( conn->sock );
+                conn->sock = 0;
+            }
+        }
+    }
+
+    if ( status != MONGO_OK )
+        conn->err = err;
+    return status;
+}
+
+int mongo_env_socket_connect_finish( mongo *conn ) {
+    int flags, err = 0, flag = 1;
+    socklen_t len = sizeof( err );
+
+    if ( conn->connected )
+        return MONGO_OK;
+
+    if ( getsockopt( conn->sock, SOL_SOCKET, SO_ERROR, &err, &len ) != 0 || err != 0 ) {
+        mongo_env_close_socket( conn->sock );
+        conn->sock = 0;
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
+
+    flags = fcntl( conn->sock, F_GETFL, 0 );
+    fcntl( conn->sock, F_SETFL, flags & ~O_NONBLOCK );
+#if __APPLE__
+    setsockopt( conn->sock, SOL_SOCKET, SO_NOSIGPIPE, ( void * ) &flag, sizeof( flag ) );
+#endif
+    setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY, ( void * ) &flag, sizeof( flag ) );
+    if ( conn->op_timeout_ms > 0 )
+        mongo_env_set_socket_op_timeout( conn, conn->op_timeout_ms );
+
+    conn->connected = 1;
+    return MONGO_OK;
+}
+
+int mongo_env_poll_sockets( mongo **conns, int *events, int count, int timeout_ms ) {
+    struct pollfd *pfds;
+    int i, ready;
+
+    pfds = ( struct pollfd* )bson_malloc( sizeof( struct pollfd ) * ( count ? count : 1 ) );
+    for ( i = 0; i < count; i++ ) {
+        pfds[i].fd = conns[i]->sock;
+        pfds[i].events = ( ( events[i] & MONGO_WANT_READ ) ? POLLIN : 0 ) |
+                         ( ( events[i] & MONGO_WANT_WRITE ) ? POLLOUT : 0 );
+        pfds[i].revents = 0;
+    }
+
+    do {
+        ready = poll( pfds, count, timeout_ms );
+    } while ( ready == -1 && errno == EINTR );
+
+    for ( i = 0; i < count; i++ ) {
+        int revents = pfds[i].revents;
+        int want = events[i];
+
+        /* Errors and hangups wake both directions so the caller finds out. */
+        if ( revents & ( POLLERR | POLLHUP | POLLNVAL ) )
+            revents |= POLLIN | POLLOUT;
+        events[i] = ( ( want & MONGO_WANT_READ ) && ( revents & POLLIN ) ? MONGO_WANT_READ : 0 ) |
+                    ( ( want & MONGO_WANT_WRITE ) && ( revents & POLLOUT ) ? MONGO_WANT_WRITE : 0 );
+    }
+
+    bson_free( pfds );
+    return ready;
+}
+
 #else
 /* env_standard.c */
 
@@ -422,6 +982,7 @@ typedef int socklen_t;
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -468,6 +1029,18 @@ int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+/* No portable gather write here; send each buffer in turn. */
+int mongo_env_writev_socket( mongo *conn, const mongo_iovec *iov, int iovcnt ) {
+    int i;
+
+    for ( i = 0; i < iovcnt; i++ ) {
+        if ( mongo_env_write_socket( conn, iov[i].base, iov[i].len ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     char *cbuf = buf;
     while ( len ) {
@@ -483,6 +1056,45 @@ int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+int mongo_env_read_socket_some( mongo *conn, void *buf, size_t len ) {
+    int got = recv( conn->sock, buf, len, 0 );
+    if ( got == 0 || got == -1 ) {
+        conn->err = MONGO_IO_ERROR;
+        return -1;
+    }
+
+    return got;
+}
+
+int64_t mongo_env_clock_usec( void ) {
+#ifdef _WIN32
+    return ( int64_t )GetTickCount() * 1000;
+#else
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return ( int64_t )tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Non-blocking sockets are not available in the generic implementation. */
+int mongo_env_set_socket_nonblocking( mongo *conn, int nonblocking ) {
+    if ( !nonblocking )
+        return MONGO_OK;
+
+    __mongo_set_error( conn, MONGO_IO_ERROR, "Non-blocking sockets are not supported.", 0 );
+    return MONGO_ERROR;
+}
+
+int mongo_env_try_read_socket( mongo *conn, void *buf, size_t len ) {
+    return mongo_env_read_socket_some( conn, buf, len );
+}
+
+int mongo_env_try_write_socket( mongo *conn, const void *buf, size_t len ) {
+    if ( mongo_env_write_socket( conn, buf, len ) != MONGO_OK )
+        return -1;
+    return ( int )len;
+}
+
 /* This is a no-op in the generic implementation. */
 int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
     return MONGO_OK;
@@ -523,6 +1135,35 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
     return MONGO_OK;
 }
 
+/* The generic implementation connects by name at once; there is nothing
+ * to resolve beforehand or to finish. */
+int mongo_env_resolve( mongo *conn, const char *host, int port, struct addrinfo **addrs ) {
+    *addrs = NULL;
+    return MONGO_OK;
+}
+
+void mongo_env_free_addrs( struct addrinfo *addrs ) {
+}
+
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port,
+                                    const struct addrinfo *addrs, int attempt ) {
+    if ( attempt > 0 ) {
+        conn->err = MONGO_CONN_ADDR_FAIL;
+        return MONGO_ERROR;
+    }
+    return mongo_env_socket_connect( conn, host, port );
+}
+
+int mongo_env_socket_connect_finish( mongo *conn ) {
+    return conn->connected ? MONGO_OK : MONGO_ERROR;
+}
+
+/* Without a portable poll(), every socket is reported ready and the
+ * caller's blocking reads do the waiting. */
+int mongo_env_poll_sockets( mongo **conns, int *events, int count, int timeout_ms ) {
+    return count;
+}
+
 MONGO_EXPORT int mongo_env_sock_init( void ) {
 
 #if defined(_WIN32)
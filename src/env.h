@@ -27,12 +27,62 @@ MONGO_EXTERN_C_START
   #define INVALID_SOCKET (-1) 
 #endif
 
+/* One buffer of a scatter/gather write. */
+typedef struct {
+    const void *base;
+    size_t len;
+} mongo_iovec;
+
 /* This is a no-op in the generic implementation. */
 int mongo_env_set_socket_op_timeout( mongo *conn, int millis );
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len );
 int mongo_env_write_socket( mongo *conn, const void *buf, size_t len );
+
+/* Read at least one and at most len bytes. Returns the number of bytes
+ * read, or -1 with the error recorded on conn. */
+int mongo_env_read_socket_some( mongo *conn, void *buf, size_t len );
+
+/* Write all of the buffers in iov, in order, with as few system calls
+ * as the platform allows. */
+int mongo_env_writev_socket( mongo *conn, const mongo_iovec *iov, int iovcnt );
 int mongo_env_socket_connect( mongo *conn, const char *host, int port );
 
+struct addrinfo;
+
+/* Look up the addresses of host once, for every connect attempt made to
+ * it; *addrs is left NULL where connecting goes by name instead (unix
+ * sockets, the standard environment). Sets MONGO_CONN_ADDR_FAIL if the
+ * lookup fails. Free the list with mongo_env_free_addrs( ). */
+int mongo_env_resolve( mongo *conn, const char *host, int port, struct addrinfo **addrs );
+void mongo_env_free_addrs( struct addrinfo *addrs );
+
+/* Start connecting to the attempt'th of the addresses resolved for host,
+ * without waiting. The socket is left non-blocking until
+ * mongo_env_socket_connect_finish( ) is called once it polls writable;
+ * that restores blocking mode and the usual socket options. Both return
+ * MONGO_ERROR, with the socket closed, when the connect fails; start sets
+ * MONGO_CONN_ADDR_FAIL once attempt runs past the host's addresses. */
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port,
+                                    const struct addrinfo *addrs, int attempt );
+int mongo_env_socket_connect_finish( mongo *conn );
+
+/* Wait up to timeout_ms for any of the sockets to become ready for the
+ * MONGO_WANT_READ/MONGO_WANT_WRITE bits in events[i], which are replaced
+ * by the bits that are ready. Returns the number of ready sockets, 0 on
+ * timeout, or -1 on error. */
+int mongo_env_poll_sockets( mongo **conns, int *events, int count, int timeout_ms );
+
+/* Switch the socket between blocking and non-blocking mode. */
+int mongo_env_set_socket_nonblocking( mongo *conn, int nonblocking );
+
+/* Non-blocking transfers. Return the number of bytes moved, 0 if the
+ * call would block, or -1 with the error recorded on conn. */
+int mongo_env_try_read_socket( mongo *conn, void *buf, size_t len );
+int mongo_env_try_write_socket( mongo *conn, const void *buf, size_t len );
+
+/* Microseconds since an arbitrary point. Only differences are meaningful. */
+int64_t mongo_env_clock_usec( void );
+
 /* Initialize socket services */
 MONGO_EXPORT int mongo_env_sock_init( void );
 
@@ -77,6 +77,9 @@ MONGO_EXPORT void gridfile_dealloc( gridfile *gf ) {
 
 MONGO_EXPORT void gridfile_get_descriptor(gridfile *gf, bson *out) {
   *out =  *gf->meta;
+  /* The index stays with gf->meta, which frees it. */
+  out->index = NULL;
+  out->indexed = 0;
 }
 
 /* Default chunk pre and post processing logic */
@@ -468,6 +471,8 @@ MONGO_EXPORT int gridfile_init( gridfs *gfs, const bson *meta, gridfile *gfile )
   } else {
     bson_init_empty(gfile->meta);
   }
+  /* The getters below look up the same descriptor fields again and again. */
+  bson_enable_index(gfile->meta);
   gridfile_init_chunkSize( gfile );
   gridfile_init_length( gfile );
   gridfile_init_flags( gfile );
@@ -26,6 +26,7 @@
 #include "mongo.h"
 #include "md5.h"
 #include "env.h"
+#include "spin_lock.h"
 
 #include <string.h>
 #include <assert.h>
@@ -101,6 +102,33 @@ MONGO_EXPORT const char* mongo_get_host(mongo* conn, int i) {
     return 0;
 }
 
+
+/* Averaged isMaster round trip in microseconds, -1 if none was measured */
+MONGO_EXPORT int64_t mongo_get_primary_rtt(mongo* conn) {
+    mongo_host_port* hp;
+    if (!conn->replica_set)
+        return conn->primary && conn->primary->rtt_samples ? conn->primary->rtt_usec : -1;
+    for (hp = conn->replica_set->hosts; hp; hp = hp->next)
+        if (hp->is_primary && hp->rtt_samples)
+            return hp->rtt_usec;
+    return -1;
+}
+
+
+/* Same, for host i of mongo_get_host() */
+MONGO_EXPORT int64_t mongo_get_host_rtt(mongo* conn, int i) {
+    mongo_replica_set* r = conn->replica_set;
+    mongo_host_port* hp;
+    int count = 0;
+    if (!r) return -1;
+    for (hp = r->hosts; hp; hp = hp->next) {
+        if (count == i)
+            return hp->rtt_samples ? hp->rtt_usec : -1;
+        ++count;
+    }
+    return -1;
+}
+
 MONGO_EXPORT mongo_write_concern* mongo_write_concern_alloc( void ) {
     return ( mongo_write_concern* )bson_malloc( sizeof( mongo_write_concern ) );
 }
@@ -284,66 +312,316 @@ static void mongo_set_last_error( mongo *conn, bson_iterator *it, bson *obj ) {
 
 static const int ZERO = 0;
 static const int ONE = 1;
-static mongo_message *mongo_message_create( size_t len , int id , int responseTo , int op ) {
-    mongo_message *mm;
 
-    if( len >= INT32_MAX) {
-        return NULL;
+/* Initial size of the non-blocking send and receive buffers. */
+#define MONGO_ASYNC_BUFFER_SIZE ( 16 * 1024 )
+
+/* Requests that wait for their reply need a blocking connection. */
+static int mongo_check_blocking( mongo *conn ) {
+    if( conn->async ) {
+        __mongo_set_error( conn, MONGO_CONN_NONBLOCKING,
+                           "Connection is in non-blocking mode.", 0 );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+/* Wire message builder.
+ *
+ * Scalar fields (flags, counts, cursor ids) are converted to little endian
+ * into a small inline buffer, while namespaces and BSON documents are
+ * referenced where they already live. mongo_wire_send() then writes the
+ * header and every piece with a single vectored write, so caller documents
+ * are never copied into an intermediate message. */
+
+#define MONGO_WIRE_INLINE_IOV 8
+#define MONGO_WIRE_SCALAR_SIZE 32
+
+typedef struct {
+    mongo_header head;       /* little endian, filled in on send */
+    int id;
+    int responseTo;
+    int op;
+    size_t len;              /* message length including the header */
+    mongo_iovec *iov;
+    int iovcnt;
+    int iovcap;
+    int scalar_len;
+    char scalars[MONGO_WIRE_SCALAR_SIZE];
+    mongo_iovec inline_iov[MONGO_WIRE_INLINE_IOV];
+} mongo_wire;
+
+/* Request ids come from one process-wide counter, so that messages sent
+ * by different threads on a shared connection never share an id. */
+static volatile long mongo_last_request_id = 0;
+
+static void mongo_wire_init( mongo_wire *w, int op ) {
+    w->id = ( int )( crossIncrement( &mongo_last_request_id ) & 0x7fffffff );
+    w->responseTo = 0;
+    w->op = op;
+    w->len = sizeof( mongo_header );
+    w->iov = w->inline_iov;
+    w->iovcap = MONGO_WIRE_INLINE_IOV;
+    w->iovcnt = 1;
+    w->scalar_len = 0;
+    w->iov[0].base = &w->head;
+    w->iov[0].len = sizeof( mongo_header );
+}
+
+static void mongo_wire_destroy( mongo_wire *w ) {
+    if( w->iov != w->inline_iov )
+        bson_free( w->iov );
+    w->iov = NULL;
+}
+
+static void mongo_wire_push( mongo_wire *w, const void *data, size_t len ) {
+    mongo_iovec *last = &w->iov[w->iovcnt - 1];
+
+    w->len += len;
+
+    /* Adjacent scalars share one buffer entry. */
+    if( ( const char * )last->base + last->len == ( const char * )data ) {
+        last->len += len;
+        return;
+    }
+
+    if( w->iovcnt == w->iovcap ) {
+        int cap = w->iovcap * 2;
+        if( w->iov == w->inline_iov ) {
+            w->iov = ( mongo_iovec * )bson_malloc( cap * sizeof( mongo_iovec ) );
+            memcpy( w->iov, w->inline_iov, sizeof( w->inline_iov ) );
+        }
+        else
+            w->iov = ( mongo_iovec * )bson_realloc( w->iov, cap * sizeof( mongo_iovec ) );
+        w->iovcap = cap;
+    }
+
+    w->iov[w->iovcnt].base = data;
+    w->iov[w->iovcnt].len = len;
+    w->iovcnt++;
+}
+
+/* Reference len bytes at data; they must stay valid until the message is sent. */
+static void mongo_wire_append( mongo_wire *w, const void *data, size_t len ) {
+    mongo_wire_push( w, data, len );
+}
+
+static void mongo_wire_append32( mongo_wire *w, const void *data ) {
+    char *start = w->scalars + w->scalar_len;
+    bson_fatal_msg( w->scalar_len + 4 <= MONGO_WIRE_SCALAR_SIZE, "wire scalars overflow" );
+    bson_little_endian32( start, data );
+    w->scalar_len += 4;
+    mongo_wire_push( w, start, 4 );
+}
+
+static void mongo_wire_append64( mongo_wire *w, const void *data ) {
+    char *start = w->scalars + w->scalar_len;
+    bson_fatal_msg( w->scalar_len + 8 <= MONGO_WIRE_SCALAR_SIZE, "wire scalars overflow" );
+    bson_little_endian64( start, data );
+    w->scalar_len += 8;
+    mongo_wire_push( w, start, 8 );
+}
+
+/* Make room for len more bytes at the end of *buf. */
+static void mongo_async_reserve( char **buf, int *size, int used, int len ) {
+    int want = *size ? *size : MONGO_ASYNC_BUFFER_SIZE;
+
+    while( want - used < len )
+        want *= 2;
+    if( want != *size ) {
+        *buf = ( char * )bson_realloc( *buf, want );
+        *size = want;
+    }
+}
+
+/* Copy a finished message to the end of the non-blocking send queue. */
+static int mongo_async_queue( mongo *conn, mongo_wire *w ) {
+    mongo_async *async = conn->async;
+    int i;
+
+    /* Reclaim the part of the queue that has been written. */
+    if( async->out_pos ) {
+        memmove( async->out, async->out + async->out_pos, async->out_len - async->out_pos );
+        async->out_len -= async->out_pos;
+        async->out_pos = 0;
     }
-    mm = ( mongo_message * )bson_malloc( len );
-    if ( !id )
-        id = rand();
 
-    /* native endian (converted on send) */
-    mm->head.len = ( int )len;
-    mm->head.id = id;
-    mm->head.responseTo = responseTo;
-    mm->head.op = op;
+    mongo_async_reserve( &async->out, &async->out_size, async->out_len, ( int )w->len );
+    for( i = 0; i < w->iovcnt; i++ ) {
+        memcpy( async->out + async->out_len, w->iov[i].base, w->iov[i].len );
+        async->out_len += ( int )w->iov[i].len;
+    }
+
+    if( w->op == MONGO_OP_QUERY || w->op == MONGO_OP_GET_MORE )
+        async->pending++;
 
-    return mm;
+    return MONGO_OK;
 }
 
-/* Always calls bson_free(mm) */
-static int mongo_message_send( mongo *conn, mongo_message *mm ) {
-    mongo_header head; /* little endian */
+/* Always calls mongo_wire_destroy(w). On failure the error is also
+ * stored in *err, if given, as conn->err may be shared between threads. */
+static int mongo_wire_send_reporting( mongo *conn, mongo_wire *w, mongo_error_t *err ) {
+    int len;
     int res;
-    bson_little_endian32( &head.len, &mm->head.len );
-    bson_little_endian32( &head.id, &mm->head.id );
-    bson_little_endian32( &head.responseTo, &mm->head.responseTo );
-    bson_little_endian32( &head.op, &mm->head.op );
 
-    res = mongo_env_write_socket( conn, &head, sizeof( head ) );
-    if( res != MONGO_OK ) {
-        bson_free( mm );
-        return res;
+    /* Replies of an exhaust cursor are still arriving on this socket. */
+    if( conn->streaming_cursor ) {
+        mongo_wire_destroy( w );
+        __mongo_set_error( conn, MONGO_CONN_BUSY,
+                           "Connection is streaming an exhaust cursor.", 0 );
+        if( err )
+            *err = MONGO_CONN_BUSY;
+        return MONGO_ERROR;
     }
 
-    res = mongo_env_write_socket( conn, &mm->data, mm->head.len - sizeof( head ) );
-    if( res != MONGO_OK ) {
-        bson_free( mm );
-        return res;
+    if( w->len >= INT32_MAX ) {
+        mongo_wire_destroy( w );
+        conn->err = MONGO_BSON_TOO_LARGE;
+        if( err )
+            *err = MONGO_BSON_TOO_LARGE;
+        return MONGO_ERROR;
+    }
+
+    len = ( int )w->len;
+    bson_little_endian32( &w->head.len, &len );
+    bson_little_endian32( &w->head.id, &w->id );
+    bson_little_endian32( &w->head.responseTo, &w->responseTo );
+    bson_little_endian32( &w->head.op, &w->op );
+
+    if( conn->async )
+        res = mongo_async_queue( conn, w );
+    else
+        res = mongo_env_writev_socket( conn, w->iov, w->iovcnt );
+
+    mongo_wire_destroy( w );
+    if( res != MONGO_OK && err )
+        *err = MONGO_IO_ERROR;
+    return res;
+}
+
+/* Always calls mongo_wire_destroy(w) */
+static int mongo_wire_send( mongo *conn, mongo_wire *w ) {
+    return mongo_wire_send_reporting( conn, w, NULL );
+}
+
+/* Buffered socket reads.
+ *
+ * Replies are read through a per-connection buffer, so that a small
+ * reply (header, fields and documents) usually costs a single recv().
+ * Reads at least as large as the buffer go straight into the caller's
+ * memory. The buffer is dropped whenever the stream position becomes
+ * unknown: on read errors, disconnects and new connections. */
+
+#define MONGO_READ_BUFFER_SIZE ( 16 * 1024 )
+
+static void mongo_read_buffer_reset( mongo *conn ) {
+    conn->read_pos = 0;
+    conn->read_len = 0;
+}
+
+static int mongo_read( mongo *conn, void *buf, size_t len ) {
+    char *out = ( char * )buf;
+    size_t avail = conn->read_len - conn->read_pos;
+
+    if( avail ) {
+        size_t n = avail < len ? avail : len;
+        memcpy( out, conn->read_buf + conn->read_pos, n );
+        conn->read_pos += ( int )n;
+        out += n;
+        len -= n;
+        if( !len )
+            return MONGO_OK;
+    }
+
+    mongo_read_buffer_reset( conn );
+
+    if( len >= MONGO_READ_BUFFER_SIZE ) {
+        if( mongo_env_read_socket( conn, out, len ) != MONGO_OK )
+            return MONGO_ERROR;
+        return MONGO_OK;
+    }
+
+    if( !conn->read_buf )
+        conn->read_buf = ( char * )bson_malloc( MONGO_READ_BUFFER_SIZE );
+
+    while( ( size_t )conn->read_len < len ) {
+        int got = mongo_env_read_socket_some( conn, conn->read_buf + conn->read_len,
+                                              MONGO_READ_BUFFER_SIZE - conn->read_len );
+        if( got < 0 ) {
+            mongo_read_buffer_reset( conn );
+            return MONGO_ERROR;
+        }
+        conn->read_len += got;
     }
 
-    bson_free( mm );
+    memcpy( out, conn->read_buf, len );
+    conn->read_pos = ( int )len;
+
     return MONGO_OK;
 }
 
-static int mongo_read_response( mongo *conn, mongo_reply **reply ) {
+static int mongo_cursor_read_more( mongo_cursor *cursor );
+
+/* Bytes to allocate for a mongo_reply holding a wire reply of len bytes. */
+#define MONGO_REPLY_ALLOC_SIZE( len ) ( ( int )( sizeof( mongo_reply ) - sizeof( char ) + ( len ) - 16 - 20 ) )
+
+static int mongo_reply_len_valid( unsigned int len ) {
+    return len >= sizeof( mongo_header ) + sizeof( mongo_reply_fields ) && len <= 64*1024*1024;
+}
+
+/* Fill in the native endian header and fields of a reply from the wire. */
+static void mongo_reply_set_header( mongo_reply *out, unsigned int len,
+                                    const mongo_header *head, const mongo_reply_fields *fields ) {
+    out->head.len = len;
+    bson_little_endian32( &out->head.id, &head->id );
+    bson_little_endian32( &out->head.responseTo, &head->responseTo );
+    bson_little_endian32( &out->head.op, &head->op );
+
+    bson_little_endian32( &out->fields.flag, &fields->flag );
+    bson_little_endian64( &out->fields.cursorID, &fields->cursorID );
+    bson_little_endian32( &out->fields.start, &fields->start );
+    bson_little_endian32( &out->fields.num, &fields->num );
+}
+
+/* Free the buffer of a failed read so a stale reply is never mistaken for a new one. */
+static int mongo_read_response_failed( mongo_reply **reply, int *size ) {
+    if( *reply )
+        bson_free( *reply );
+    *reply = NULL;
+    *size = 0;
+    return MONGO_ERROR;
+}
+
+/* Read one reply into *reply. A buffer already in *reply is reused if its
+ * *size is large enough, and replaced otherwise. On failure the buffer is
+ * released and *reply set to NULL. */
+static int mongo_read_response_into( mongo *conn, mongo_reply **reply, int *size ) {
     mongo_header head; /* header from network */
     mongo_reply_fields fields; /* header from network */
     mongo_reply *out;  /* native endian */
     unsigned int len;
-    int res;
+    int needed;
 
-    if ( ( res = mongo_env_read_socket( conn, &head, sizeof( head ) ) ) != MONGO_OK ||
-         ( res = mongo_env_read_socket( conn, &fields, sizeof( fields ) ) ) != MONGO_OK ) {
-        return res;
+    if( mongo_check_blocking( conn ) != MONGO_OK )
+        return mongo_read_response_failed( reply, size );
+
+    /* A prefetched batch that is still on the socket comes first. */
+    if( conn->pending_cursor && mongo_cursor_read_more( conn->pending_cursor ) != MONGO_OK )
+        return mongo_read_response_failed( reply, size );
+
+    if ( mongo_read( conn, &head, sizeof( head ) ) != MONGO_OK ||
+         mongo_read( conn, &fields, sizeof( fields ) ) != MONGO_OK ) {
+        return mongo_read_response_failed( reply, size );
     }
 
     bson_little_endian32( &len, &head.len );
 
-    if ( len < sizeof( head )+sizeof( fields ) || len > 64*1024*1024 )
-        return MONGO_READ_SIZE_ERROR;  /* most likely corruption */
+    if ( ! mongo_reply_len_valid( len ) ) {
+        mongo_read_buffer_reset( conn );
+        conn->err = MONGO_READ_SIZE_ERROR;  /* most likely corruption */
+        return mongo_read_response_failed( reply, size );
+    }
 
     /*
      * mongo_reply matches the wire for observed environments (MacOS, Linux, Windows VC), but
@@ -352,61 +630,118 @@ static int mongo_read_response( mongo *conn, mongo_reply **reply ) {
      * assert( sizeof(mongo_reply) - sizeof(char) - 16 - 20 + len >= len );
      * printf( "sizeof(mongo_reply) - sizeof(char) - 16 - 20 = %ld\n", sizeof(mongo_reply) - sizeof(char) - 16 - 20 );
      */
-    out = ( mongo_reply * )bson_malloc( sizeof(mongo_reply) - sizeof(char) + len - 16 - 20 );
+    needed = MONGO_REPLY_ALLOC_SIZE( len );
+    if( *reply && *size >= needed )
+        out = *reply;
+    else {
+        if( *reply )
+            bson_free( *reply );
+        out = ( mongo_reply * )bson_malloc( needed );
+        *reply = out;
+        *size = needed;
+    }
 
-    out->head.len = len;
-    bson_little_endian32( &out->head.id, &head.id );
-    bson_little_endian32( &out->head.responseTo, &head.responseTo );
-    bson_little_endian32( &out->head.op, &head.op );
+    mongo_reply_set_header( out, len, &head, &fields );
 
-    bson_little_endian32( &out->fields.flag, &fields.flag );
-    bson_little_endian64( &out->fields.cursorID, &fields.cursorID );
-    bson_little_endian32( &out->fields.start, &fields.start );
-    bson_little_endian32( &out->fields.num, &fields.num );
+    if( mongo_read( conn, &out->objs, len - 16 - 20 ) != MONGO_OK ) /* was len-sizeof( head )-sizeof( fields ) */
+        return mongo_read_response_failed( reply, size );
 
-    res = mongo_env_read_socket( conn, &out->objs, len - 16 - 20 ); /* was len-sizeof( head )-sizeof( fields ) */
-    if( res != MONGO_OK ) {
-        bson_free( out );
-        return res;
-    }
+    return MONGO_OK;
+}
 
-    *reply = out;
+static int mongo_read_response( mongo *conn, mongo_reply **reply ) {
+    int size = 0;
 
-    return MONGO_OK;
+    *reply = NULL;
+    return mongo_read_response_into( conn, reply, &size );
 }
 
+static void mongo_async_free( mongo *conn ) {
+    if( ! conn->async )
+        return;
 
-static char *mongo_data_append( char *start , const void *data , size_t len ) {
-    memcpy( start , data , len );
-    return start + len;
+    bson_free( conn->async->out );
+    bson_free( conn->async->in );
+    bson_free( conn->async );
+    conn->async = NULL;
 }
 
-static char *mongo_data_append32( char *start , const void *data ) {
-    bson_little_endian32( start , data );
-    return start + 4;
+/* Forget everything in flight on the current socket. */
+static void mongo_reset_stream( mongo *conn ) {
+    mongo_cursor *cursor = conn->pending_cursor;
+
+    mongo_read_buffer_reset( conn );
+    mongo_async_free( conn );
+
+    if( conn->streaming_cursor ) {
+        conn->streaming_cursor->flags &= ~MONGO_CURSOR_STREAMING;
+        conn->streaming_cursor = NULL;
+    }
+
+    /* The prefetched batch can no longer be read. */
+    if( cursor ) {
+        conn->pending_cursor = NULL;
+        cursor->flags &= ~MONGO_CURSOR_MORE_SENT;
+        cursor->flags |= MONGO_CURSOR_MORE_READ;
+        if( cursor->spare )
+            bson_free( cursor->spare );
+        cursor->spare = NULL;
+        cursor->spare_size = 0;
+    }
 }
 
-static char *mongo_data_append64( char *start , const void *data ) {
-    bson_little_endian64( start , data );
-    return start + 8;
+/* Connect the socket, discarding anything left from a previous one. */
+static int mongo_socket_connect( mongo *conn, const char *host, int port ) {
+    mongo_reset_stream( conn );
+    return mongo_env_socket_connect( conn, host, port );
 }
 
 /* Connection API */
 
+/* Record the size limits reported by an isMaster reply. */
+static void mongo_set_limits( mongo *conn, const bson *ismaster_out ) {
+    bson_iterator it;
+    int max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+    int max_message_size = 0;
+
+    if( bson_find( &it, ismaster_out, "maxBsonObjectSize" ) )
+        max_bson_size = bson_iterator_int( &it );
+    if( bson_find( &it, ismaster_out, "maxMessageSizeBytes" ) )
+        max_message_size = bson_iterator_int( &it );
+    conn->max_bson_size = max_bson_size;
+    /* Servers that don't report a message limit get the old behaviour. */
+    conn->max_message_size = max_message_size > max_bson_size ? max_message_size : max_bson_size;
+}
+
+MONGO_EXPORT void mongo_host_port_record_rtt( mongo_host_port *host_port, int64_t rtt_usec ) {
+    if( host_port->rtt_samples++ == 0 )
+        host_port->rtt_usec = rtt_usec;
+    else
+        host_port->rtt_usec += ( rtt_usec - host_port->rtt_usec ) * MONGO_RTT_WEIGHT / 100;
+}
+
+/* isMaster, timed into host_port's round trip average when it succeeds. */
+static int mongo_timed_is_master( mongo *conn, mongo_host_port *host_port, bson *out ) {
+    int64_t start = mongo_env_clock_usec();
+
+    if( mongo_simple_int_command( conn, "admin", "ismaster", 1, out ) != MONGO_OK )
+        return MONGO_ERROR;
+    if( host_port )
+        mongo_host_port_record_rtt( host_port, mongo_env_clock_usec() - start );
+    return MONGO_OK;
+}
+
 static int mongo_check_is_master( mongo *conn ) {
     bson out;
     bson_iterator it;
     bson_bool_t ismaster = 0;
-    int max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
 
-    if ( mongo_simple_int_command( conn, "admin", "ismaster", 1, &out ) != MONGO_OK )
+    if ( mongo_timed_is_master( conn, conn->primary, &out ) != MONGO_OK )
         return MONGO_ERROR;
 
     if( bson_find( &it, &out, "ismaster" ) )
         ismaster = bson_iterator_bool( &it );
-    if( bson_find( &it, &out, "maxBsonObjectSize" ) )
-        max_bson_size = bson_iterator_int( &it );
-    conn->max_bson_size = max_bson_size;
+    mongo_set_limits( conn, &out );
 
     bson_destroy( &out );
 
@@ -432,18 +767,23 @@ static mongo_write_concern WC1 = { 1, 0, 0, 0, 0, &WC1_cmd }; /* w = 1 */
 MONGO_EXPORT void mongo_init( mongo *conn ) {
     memset( conn, 0, sizeof( mongo ) );
     conn->max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+    conn->max_message_size = MONGO_DEFAULT_MAX_BSON_SIZE;
     mongo_set_write_concern( conn, &WC1 );
 }
 
 MONGO_EXPORT int mongo_client( mongo *conn , const char *host, int port ) {
     mongo_init( conn );
+    return mongo_client_connect( conn, host, port );
+}
 
+MONGO_EXPORT int mongo_client_connect( mongo *conn , const char *host, int port ) {
     conn->primary = (mongo_host_port*)bson_malloc( sizeof( mongo_host_port ) );
+    memset( conn->primary, 0, sizeof( mongo_host_port ) );
     snprintf( conn->primary->host, MAXHOSTNAMELEN, "%s", host);
     conn->primary->port = port;
     conn->primary->next = NULL;
 
-    if( mongo_env_socket_connect( conn, host, port ) != MONGO_OK )
+    if( mongo_socket_connect( conn, host, port ) != MONGO_OK )
         return MONGO_ERROR;
 
     return mongo_check_is_master( conn );
@@ -462,8 +802,12 @@ MONGO_EXPORT void mongo_replica_set_init( mongo *conn, const char *name ) {
 
     conn->replica_set = (mongo_replica_set*)bson_malloc( sizeof( mongo_replica_set ) );
     conn->replica_set->primary_connected = 0;
+    conn->replica_set->read_preference = MONGO_READ_PRIMARY;
+    conn->replica_set->latency_window_ms = MONGO_DEFAULT_LATENCY_WINDOW_MS;
+    conn->replica_set->next_read = 0;
     conn->replica_set->seeds = NULL;
     conn->replica_set->hosts = NULL;
+    conn->replica_set->retired = NULL;
     conn->replica_set->name = ( char * )bson_malloc( strlen( name ) + 1 );
     memcpy( conn->replica_set->name, name, strlen( name ) + 1  );
 
@@ -479,6 +823,7 @@ MONGO_EXPORT void mongo_replset_init( mongo *conn, const char *name ) {
 
 static void mongo_replica_set_add_node( mongo_host_port **list, const char *host, int port ) {
     mongo_host_port *host_port = (mongo_host_port*)bson_malloc( sizeof( mongo_host_port ) );
+    memset( host_port, 0, sizeof( mongo_host_port ) );
     host_port->port = port;
     host_port->next = NULL;
     snprintf( host_port->host, MAXHOSTNAMELEN, "%s", host);
@@ -500,12 +845,39 @@ static void mongo_replica_set_free_list( mongo_host_port **list ) {
     while( node != NULL ) {
         prev = node;
         node = node->next;
+        if( prev->member ) {
+            mongo_destroy( prev->member );
+            bson_free( prev->member );
+        }
         bson_free( prev );
     }
 
     *list = NULL;
 }
 
+/* Take the host list down without freeing the read connections cursors may
+ * still hold: each member is closed and parked on the retired list, where
+ * the next discovery picks it up again, until mongo_destroy( ). */
+static void mongo_replica_set_retire_hosts( mongo_replica_set *replica_set ) {
+    mongo_host_port *node = replica_set->hosts;
+    mongo_host_port *next;
+
+    while( node != NULL ) {
+        next = node->next;
+        if( node->member ) {
+            mongo_disconnect( node->member );
+            node->next = replica_set->retired;
+            replica_set->retired = node;
+        }
+        else
+            bson_free( node );
+        node = next;
+    }
+
+    replica_set->hosts = NULL;
+    replica_set->primary_connected = 0;
+}
+
 MONGO_EXPORT void mongo_replica_set_add_seed( mongo *conn, const char *host, int port ) {
     mongo_replica_set_add_node( &conn->replica_set->seeds, host, port );
 }
@@ -540,209 +912,613 @@ void mongo_parse_host( const char *host_string, mongo_host_port *host_port ) {
         host_port->port = MONGO_DEFAULT_PORT;
 }
 
-static void mongo_replica_set_check_seed( mongo *conn ) {
-    bson out[1];
+/* Add the hosts an isMaster reply lists to the connection's host list.
+ * Returns true if the reply had a host list. */
+static int mongo_replica_set_add_hosts( mongo *conn, const bson *ismaster_out ) {
     const char *data;
     bson_iterator it[1];
     bson_iterator it_sub[1];
     const char *host_string;
     mongo_host_port *host_port = NULL;
 
-    if( mongo_simple_int_command( conn, "admin", "ismaster", 1, out ) == MONGO_OK ) {
+    if( !bson_find( it, ismaster_out, "hosts" ) )
+        return 0;
 
-        if( bson_find( it, out, "hosts" ) ) {
-            data = bson_iterator_value( it );
-            bson_iterator_from_buffer( it_sub, data );
+    data = bson_iterator_value( it );
+    bson_iterator_from_buffer( it_sub, data );
 
-            /* Iterate over host list, adding each host to the
-             * connection's host list. */
-            while( bson_iterator_next( it_sub ) ) {
-                host_string = bson_iterator_string( it_sub );
+    /* Iterate over host list, adding each host to the
+     * connection's host list. */
+    while( bson_iterator_next( it_sub ) ) {
+        host_string = bson_iterator_string( it_sub );
 
-                host_port = (mongo_host_port*)bson_malloc( sizeof( mongo_host_port ) );
+        host_port = (mongo_host_port*)bson_malloc( sizeof( mongo_host_port ) );
 
-                if( host_port ) {
-                    mongo_parse_host( host_string, host_port );
-                    mongo_replica_set_add_node( &conn->replica_set->hosts,
-                                                host_port->host, host_port->port );
+        if( host_port ) {
+            mongo_parse_host( host_string, host_port );
+            mongo_replica_set_add_node( &conn->replica_set->hosts,
+                                        host_port->host, host_port->port );
 
-                    bson_free( host_port );
-                    host_port = NULL;
-                }
-            }
+            bson_free( host_port );
+            host_port = NULL;
         }
     }
 
-    bson_destroy(out);
-    mongo_env_close_socket( conn->sock );
-    conn->sock = 0;
-    conn->connected = 0;
+    return 1;
 }
 
-/* Find out whether the current connected node is master, and
- * verify that the node's replica set name matched the provided name
+/* Record the node's role and conn's limits from an isMaster reply, and
+ * verify that the node's replica set name matches the provided name.
  */
-static int mongo_replica_set_check_host( mongo *conn ) {
-
-    bson out[1];
+static int mongo_replica_set_read_is_master( mongo *conn, const char *name, mongo_host_port *node,
+        const bson *ismaster_out ) {
     bson_iterator it[1];
-    bson_bool_t ismaster = 0;
-    const char *set_name;
-    int max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
 
-    if ( mongo_simple_int_command( conn, "admin", "ismaster", 1, out ) == MONGO_OK ) {
-        if( bson_find( it, out, "ismaster" ) )
-            ismaster = bson_iterator_bool( it );
+    if( bson_find( it, ismaster_out, "ismaster" ) )
+        node->is_primary = bson_iterator_bool( it );
+    if( bson_find( it, ismaster_out, "secondary" ) )
+        node->is_secondary = bson_iterator_bool( it );
 
-        if( bson_find( it, out, "maxBsonObjectSize" ) )
-            max_bson_size = bson_iterator_int( it );
-        conn->max_bson_size = max_bson_size;
+    mongo_set_limits( conn, ismaster_out );
 
-        if( bson_find( it, out, "setName" ) ) {
-            set_name = bson_iterator_string( it );
-            if( strcmp( set_name, conn->replica_set->name ) != 0 ) {
-                bson_destroy( out );
-                conn->err = MONGO_CONN_BAD_SET_NAME;
-                return MONGO_ERROR;
-            }
-        }
+    if( bson_find( it, ismaster_out, "setName" ) &&
+            strcmp( bson_iterator_string( it ), name ) != 0 ) {
+        conn->err = MONGO_CONN_BAD_SET_NAME;
+        return MONGO_ERROR;
     }
 
-    bson_destroy( out );
+    return MONGO_OK;
+}
 
-    if( ismaster ) {
-        conn->replica_set->primary_connected = 1;
-    }
-    else {
-        mongo_env_close_socket( conn->sock );
-    }
+/* Find out whether the current connected node is master, and
+ * verify that the node's replica set name matched the provided name.
+ * Records the node's role and isMaster round trip time.
+ */
+static int mongo_replica_set_check_host( mongo *conn, const char *name, mongo_host_port *node ) {
 
-    return MONGO_OK;
+    bson out[1];
+    int res = MONGO_OK;
+
+    node->is_primary = node->is_secondary = 0;
+
+    if ( mongo_timed_is_master( conn, node, out ) == MONGO_OK )
+        res = mongo_replica_set_read_is_master( conn, name, node, out );
+
+    bson_destroy( out );
+    return res;
 }
 
-MONGO_EXPORT int mongo_replica_set_client( mongo *conn ) {
+static mongo_host_port *mongo_host_port_copy( const mongo_host_port *node ) {
+    mongo_host_port *copy = ( mongo_host_port* )bson_malloc( sizeof( mongo_host_port ) );
+    memset( copy, 0, sizeof( mongo_host_port ) );
+    snprintf( copy->host, MAXHOSTNAMELEN, "%s", node->host );
+    copy->port = node->port;
+    return copy;
+}
 
-    int res = 0;
-    mongo_host_port *node;
+/* Move the socket conn has open into to, along with the limits its server reported. */
+static void mongo_take_socket( mongo *to, mongo *conn ) {
+    mongo_reset_stream( to );
+    to->sock = conn->sock;
+    to->connected = 1;
+    to->max_bson_size = conn->max_bson_size;
+    to->max_message_size = conn->max_message_size;
 
+    mongo_reset_stream( conn );
     conn->sock = 0;
     conn->connected = 0;
+}
 
-    /* First iterate over the seed nodes to get the canonical list of hosts
-     * from the replica set. Break out once we have a host list.
-     */
-    node = conn->replica_set->seeds;
-    while( node != NULL ) {
-        res = mongo_env_socket_connect( conn, ( const char * )&node->host, node->port );
-        if( res == MONGO_OK ) {
-            mongo_replica_set_check_seed( conn );
-            if( conn->replica_set->hosts )
-                break;
+/* Keep the socket conn has open to a secondary as that member's read
+ * connection, reusing the node's closed member or the one retired for
+ * the same host if there is one. */
+static void mongo_replica_set_keep_member( mongo_replica_set *replica_set, mongo *conn, mongo_host_port *node ) {
+    mongo_host_port **link = &replica_set->retired;
+    mongo_host_port *retired;
+    mongo *member = node->member;
+
+    while( !member && ( retired = *link ) != NULL ) {
+        if( retired->port == node->port && strcmp( retired->host, node->host ) == 0 ) {
+            member = retired->member;
+            *link = retired->next;
+            bson_free( retired );
+            break;
         }
-        node = node->next;
+        link = &retired->next;
     }
 
-    /* Iterate over the host list, checking for the primary node. */
-    if( !conn->replica_set->hosts ) {
-        conn->err = MONGO_CONN_NO_PRIMARY;
-        return MONGO_ERROR;
+    if( !member ) {
+        member = ( mongo* )bson_malloc( sizeof( mongo ) );
+        mongo_init( member );
+        member->primary = mongo_host_port_copy( node );
     }
-    else {
-        node = conn->replica_set->hosts;
-
-        while( node != NULL ) {
-            res = mongo_env_socket_connect( conn, ( const char * )&node->host, node->port );
-
-            if( res == MONGO_OK ) {
-                if( mongo_replica_set_check_host( conn ) != MONGO_OK )
-                    return MONGO_ERROR;
-
-                /* Primary found, so return. */
-                else if( conn->replica_set->primary_connected ) {
-                    bson_free( conn->primary );
-                    conn->primary = bson_malloc( sizeof( mongo_host_port ) );
-                    snprintf( conn->primary->host, MAXHOSTNAMELEN, "%s", node->host );
-                    conn->primary->port = node->port;
-                    return MONGO_OK;
-                }
-
-                /* No primary, so close the connection. */
-                else {
-                    mongo_env_close_socket( conn->sock );
-                    conn->sock = 0;
-                    conn->connected = 0;
-                }
-            }
+    member->conn_timeout_ms = conn->conn_timeout_ms;
+    member->op_timeout_ms = conn->op_timeout_ms;
+    mongo_take_socket( member, conn );
+    node->member = member;
+}
 
-            node = node->next;
-        }
-    }
+/* Replica set discovery probes hosts in parallel: every connect is
+ * started at once and each socket is sent isMaster as soon as it
+ * connects, so dead or slow hosts cost no more than the slowest one
+ * still needed rather than adding up. */
 
+#define MONGO_PROBE_TIMEOUT_MS 10000
 
-    conn->err = MONGO_CONN_NO_PRIMARY;
-    return MONGO_ERROR;
-}
+/* How long secondaries still have to answer once the primary has, when
+ * every host is wanted. mongo_refresh_rtt( ) picks up the rest. */
+#define MONGO_PROBE_GRACE_MS 100
 
-MONGO_EXPORT int mongo_replset_connect( mongo *conn ) {
-    int ret;
-    bson_errprintf("WARNING: mongo_replset_connect() is deprecated, please use mongo_replica_set_client()\n");
-    ret = mongo_replica_set_client( conn );
-    mongo_set_write_concern( conn, 0 );
-    return ret;
-}
+enum {
+    MONGO_PROBE_CONNECTING,
+    MONGO_PROBE_ASKED,
+    MONGO_PROBE_DONE
+};
 
-MONGO_EXPORT int mongo_set_op_timeout( mongo *conn, int millis ) {
-    conn->op_timeout_ms = millis;
-    if( conn->sock && conn->connected )
-        mongo_env_set_socket_op_timeout( conn, millis );
+/* Stop probing once one of these has answered. */
+enum {
+    MONGO_PROBE_UNTIL_HOSTS,
+    MONGO_PROBE_UNTIL_PRIMARY,
+    MONGO_PROBE_UNTIL_ALL
+};
 
-    return MONGO_OK;
+typedef struct {
+    mongo conn[1];           /**< The probe's own connection. */
+    mongo_host_port *node;   /**< The host being probed. */
+    struct addrinfo *addrs;  /**< The host's addresses, resolved once for every attempt. */
+    int attempt;             /**< Which of the host's addresses is being tried. */
+    int state;               /**< MONGO_PROBE_CONNECTING, _ASKED or _DONE. */
+    int answered;            /**< Order in which isMaster came back, from 1; 0 if it did not. */
+    int64_t sent;            /**< When isMaster was sent, for the round trip time. */
+    bson out[1];             /**< The isMaster reply, once answered. */
+} mongo_probe;
+
+/* Start connecting, moving on through the host's addresses while they refuse. */
+static void mongo_probe_connect( mongo_probe *probe ) {
+    probe->state = MONGO_PROBE_DONE;
+    do {
+        if( mongo_env_socket_connect_start( probe->conn, probe->node->host, probe->node->port,
+                                            probe->addrs, probe->attempt++ ) == MONGO_OK ) {
+            probe->state = MONGO_PROBE_CONNECTING;
+            return;
+        }
+    } while( probe->conn->err == MONGO_CONN_FAIL );
 }
 
-MONGO_EXPORT int mongo_reconnect( mongo *conn ) {
-    int res;
-    mongo_disconnect( conn );
+/* The socket polled writable: finish the connect and send isMaster. */
+static void mongo_probe_ask( mongo_probe *probe ) {
+    bson cmd[1];
 
-    if( conn->replica_set ) {
-        conn->replica_set->primary_connected = 0;
-        mongo_replica_set_free_list( &conn->replica_set->hosts );
-        conn->replica_set->hosts = NULL;
-        res = mongo_replica_set_client( conn );
-        return res;
+    if( mongo_env_socket_connect_finish( probe->conn ) != MONGO_OK ) {
+        mongo_probe_connect( probe );
+        return;
     }
+
+    bson_init( cmd );
+    bson_append_int( cmd, "ismaster", 1 );
+    bson_finish( cmd );
+
+    probe->sent = mongo_env_clock_usec();
+    if( mongo_send_query( probe->conn, "admin.$cmd", cmd, NULL, -1, 0, 0, NULL, NULL ) == MONGO_OK )
+        probe->state = MONGO_PROBE_ASKED;
     else
-        return mongo_env_socket_connect( conn, conn->primary->host, conn->primary->port );
+        probe->state = MONGO_PROBE_DONE;
+
+    bson_destroy( cmd );
 }
 
-MONGO_EXPORT int mongo_check_connection( mongo *conn ) {
-    if( ! conn->connected )
+/* The socket polled readable: read the isMaster reply. With a set name,
+ * the reply is checked against it and the node's role recorded. */
+static int mongo_probe_answer( mongo_probe *probe, const char *set_name ) {
+    mongo_reply *reply;
+    bson out[1];
+    bson_iterator it[1];
+    int res = MONGO_ERROR;
+
+    probe->state = MONGO_PROBE_DONE;
+    if( mongo_read_reply( probe->conn, &reply ) != MONGO_OK )
         return MONGO_ERROR;
 
-    return mongo_simple_int_command( conn, "admin", "ping", 1, NULL );
+    if( reply->fields.num == 1 ) {
+        bson_init_finished_data( out, &reply->objs, 0 );
+        if( bson_find( it, out, "ok" ) && bson_iterator_bool( it ) ) {
+            mongo_host_port_record_rtt( probe->node, mongo_env_clock_usec() - probe->sent );
+            bson_copy( probe->out, out );
+            res = MONGO_OK;
+        }
+    }
+    bson_free( reply );
+
+    if( res == MONGO_OK && set_name )
+        res = mongo_replica_set_read_is_master( probe->conn, set_name, probe->node, probe->out );
+    return res;
 }
 
-MONGO_EXPORT void mongo_disconnect( mongo *conn ) {
-    if( ! conn->connected )
-        return;
+static int mongo_probe_has_hosts( mongo_probe *probe ) {
+    bson_iterator it[1];
 
-    if( conn->replica_set ) {
-        conn->replica_set->primary_connected = 0;
-        mongo_replica_set_free_list( &conn->replica_set->hosts );
-        conn->replica_set->hosts = NULL;
+    return probe->answered && bson_find( it, probe->out, "hosts" ) == BSON_ARRAY;
+}
+
+/* Probe every node on list at once until stop_at is satisfied, every
+ * probe has finished, or the connect timeout (MONGO_PROBE_TIMEOUT_MS if
+ * none is set) runs out. Returns the probes, count of them in *count. */
+static mongo_probe *mongo_probe_list( mongo *conn, mongo_host_port *list, const char *set_name,
+                                      int stop_at, int *count ) {
+    mongo_probe *probes;
+    mongo_probe **waiting;
+    mongo **socks;
+    int *events;
+    mongo_host_port *node;
+    int timeout_ms = conn->conn_timeout_ms > 0 ? conn->conn_timeout_ms : MONGO_PROBE_TIMEOUT_MS;
+    int64_t now, grace, deadline = mongo_env_clock_usec() + ( int64_t )timeout_ms * 1000;
+    int i, n, answered = 0, done = 0;
+
+    for( n = 0, node = list; node != NULL; node = node->next )
+        n++;
+    *count = n;
+
+    probes = ( mongo_probe* )bson_malloc( sizeof( mongo_probe ) * ( n ? n : 1 ) );
+    waiting = ( mongo_probe** )bson_malloc( sizeof( mongo_probe* ) * ( n ? n : 1 ) );
+    socks = ( mongo** )bson_malloc( sizeof( mongo* ) * ( n ? n : 1 ) );
+    events = ( int* )bson_malloc( sizeof( int ) * ( n ? n : 1 ) );
+
+    for( i = 0, node = list; node != NULL; i++, node = node->next ) {
+        mongo_probe *probe = &probes[i];
+
+        mongo_init( probe->conn );
+        probe->conn->conn_timeout_ms = conn->conn_timeout_ms;
+        probe->conn->op_timeout_ms = conn->op_timeout_ms;
+        probe->node = node;
+        probe->attempt = 0;
+        probe->answered = 0;
+        probe->sent = 0;
+        bson_init_zero( probe->out );
+        if( set_name )
+            node->is_primary = node->is_secondary = 0;
+        if( mongo_env_resolve( probe->conn, node->host, node->port, &probe->addrs ) == MONGO_OK )
+            mongo_probe_connect( probe );
+        else
+            probe->state = MONGO_PROBE_DONE;
     }
 
-    mongo_env_close_socket( conn->sock );
+    while( !done ) {
+        for( i = 0, n = 0; i < *count; i++ ) {
+            if( probes[i].state == MONGO_PROBE_DONE )
+                continue;
+            waiting[n] = &probes[i];
+            socks[n] = probes[i].conn;
+            events[n] = probes[i].state == MONGO_PROBE_CONNECTING ? MONGO_WANT_WRITE : MONGO_WANT_READ;
+            n++;
+        }
 
-    conn->sock = 0;
-    conn->connected = 0;
-}
+        now = mongo_env_clock_usec();
+        if( n == 0 || now >= deadline ||
+                mongo_env_poll_sockets( socks, events, n, ( int )( ( deadline - now + 999 ) / 1000 ) ) < 0 )
+            break;
 
-MONGO_EXPORT void mongo_destroy( mongo *conn ) {
-    mongo_disconnect( conn );
+        for( i = 0; i < n; i++ ) {
+            mongo_probe *probe = waiting[i];
+
+            if( events[i] & MONGO_WANT_WRITE )
+                mongo_probe_ask( probe );
+            else if( events[i] & MONGO_WANT_READ ) {
+                if( mongo_probe_answer( probe, set_name ) == MONGO_OK ) {
+                    probe->answered = ++answered;
+                    if( ( stop_at == MONGO_PROBE_UNTIL_HOSTS && mongo_probe_has_hosts( probe ) ) ||
+                            ( stop_at == MONGO_PROBE_UNTIL_PRIMARY && probe->node->is_primary ) )
+                        done = 1;
+                    else if( stop_at == MONGO_PROBE_UNTIL_ALL && probe->node->is_primary ) {
+                        grace = mongo_env_clock_usec() + ( int64_t )MONGO_PROBE_GRACE_MS * 1000;
+                        if( grace < deadline )
+                            deadline = grace;
+                    }
+                }
+                else if( probe->conn->err == MONGO_CONN_BAD_SET_NAME )
+                    done = 1;
+            }
+        }
+    }
 
-    if( conn->replica_set ) {
+    bson_free( waiting );
+    bson_free( socks );
+    bson_free( events );
+    return probes;
+}
+
+static void mongo_probe_list_free( mongo_probe *probes, int count ) {
+    int i;
+
+    for( i = 0; i < count; i++ ) {
+        /* A socket still connecting is not yet known to the probe's connection. */
+        if( probes[i].conn->sock && !probes[i].conn->connected )
+            mongo_env_close_socket( probes[i].conn->sock );
+        mongo_destroy( probes[i].conn );
+        mongo_env_free_addrs( probes[i].addrs );
+        bson_destroy( probes[i].out );
+    }
+    bson_free( probes );
+}
+
+/* The probe that answered first among those that pass. */
+#define MONGO_PROBE_EARLIER( probe, best ) \
+    ( ( probe )->answered && ( !( best ) || ( probe )->answered < ( best )->answered ) )
+
+MONGO_EXPORT int mongo_replica_set_client( mongo *conn ) {
+
+    mongo_replica_set *replica_set = conn->replica_set;
+    mongo_probe *probes, *found = NULL;
+    int count, i, res = MONGO_OK;
+    int route_reads = replica_set->read_preference != MONGO_READ_PRIMARY;
+
+    conn->sock = 0;
+    conn->connected = 0;
+
+    /* First probe the seed nodes to get the canonical list of hosts
+     * from the replica set, taking the first host list to come back.
+     */
+    probes = mongo_probe_list( conn, replica_set->seeds, NULL, MONGO_PROBE_UNTIL_HOSTS, &count );
+    for( i = 0; i < count; i++ ) {
+        if( MONGO_PROBE_EARLIER( &probes[i], found ) && mongo_probe_has_hosts( &probes[i] ) )
+            found = &probes[i];
+    }
+    if( found )
+        mongo_replica_set_add_hosts( conn, found->out );
+    mongo_probe_list_free( probes, count );
+
+    if( !replica_set->hosts ) {
+        conn->err = MONGO_CONN_NO_PRIMARY;
+        return MONGO_ERROR;
+    }
+
+    /* Then probe the host list for the primary, taking the first to
+     * answer. Reads may go to secondaries, in which case every host is
+     * heard from and each secondary keeps its connection.
+     */
+    found = NULL;
+    probes = mongo_probe_list( conn, replica_set->hosts, replica_set->name,
+                               route_reads ? MONGO_PROBE_UNTIL_ALL : MONGO_PROBE_UNTIL_PRIMARY, &count );
+    for( i = 0; i < count; i++ ) {
+        if( probes[i].conn->err == MONGO_CONN_BAD_SET_NAME )
+            res = MONGO_ERROR;
+        else if( probes[i].node->is_primary && MONGO_PROBE_EARLIER( &probes[i], found ) )
+            found = &probes[i];
+    }
+
+    if( res != MONGO_OK )
+        conn->err = MONGO_CONN_BAD_SET_NAME;
+    else if( found ) {
+        for( i = 0; i < count; i++ ) {
+            if( &probes[i] != found && probes[i].node->is_primary )
+                probes[i].node->is_primary = 0;
+            else if( route_reads && probes[i].answered && probes[i].node->is_secondary )
+                mongo_replica_set_keep_member( replica_set, probes[i].conn, probes[i].node );
+        }
+
+        mongo_take_socket( conn, found->conn );
+        replica_set->primary_connected = 1;
+        bson_free( conn->primary );
+        conn->primary = mongo_host_port_copy( found->node );
+    }
+    else {
+        conn->err = MONGO_CONN_NO_PRIMARY;
+        res = MONGO_ERROR;
+    }
+
+    mongo_probe_list_free( probes, count );
+    return res;
+}
+
+MONGO_EXPORT void mongo_replica_set_set_read_preference( mongo *conn, mongo_read_preference read_preference,
+        int latency_window_ms ) {
+    conn->replica_set->read_preference = read_preference;
+    conn->replica_set->latency_window_ms = latency_window_ms > 0 ? latency_window_ms : 0;
+}
+
+/* Pick among the connected secondaries and, if primary is set, the primary:
+ * the nearest member and any within the latency window of it take turns. */
+static mongo *mongo_replica_set_pick( mongo *conn, int secondaries, int primary ) {
+    mongo_replica_set *rs = conn->replica_set;
+    mongo_host_port *node;
+    int64_t nearest = -1, window = ( int64_t )rs->latency_window_ms * 1000;
+    int eligible = 0, turn;
+
+#define MONGO_READ_CANDIDATE( node ) \
+    ( ( secondaries && ( node )->member && ( node )->member->connected ) || \
+      ( primary && ( node )->is_primary && conn->connected ) )
+
+    for( node = rs->hosts; node != NULL; node = node->next )
+        if( MONGO_READ_CANDIDATE( node ) && ( nearest < 0 || node->rtt_usec < nearest ) )
+            nearest = node->rtt_usec;
+    if( nearest < 0 )
+        return NULL;
+
+    for( node = rs->hosts; node != NULL; node = node->next )
+        if( MONGO_READ_CANDIDATE( node ) && node->rtt_usec <= nearest + window )
+            eligible++;
+
+    turn = ( int )( rs->next_read++ % ( unsigned int )eligible );
+    for( node = rs->hosts; node != NULL; node = node->next )
+        if( MONGO_READ_CANDIDATE( node ) && node->rtt_usec <= nearest + window && turn-- == 0 )
+            break;
+
+#undef MONGO_READ_CANDIDATE
+
+    return node->is_primary ? conn : node->member;
+}
+
+MONGO_EXPORT mongo *mongo_replica_set_read_target( mongo *conn ) {
+    mongo *target = conn;
+
+    if( !conn->replica_set )
+        return conn;
+
+    switch( conn->replica_set->read_preference ) {
+    case MONGO_READ_PRIMARY:
+        break;
+    case MONGO_READ_PRIMARY_PREFERRED:
+        if( !conn->connected )
+            target = mongo_replica_set_pick( conn, 1, 0 );
+        break;
+    case MONGO_READ_SECONDARY:
+        target = mongo_replica_set_pick( conn, 1, 0 );
+        break;
+    case MONGO_READ_SECONDARY_PREFERRED:
+        target = mongo_replica_set_pick( conn, 1, 0 );
+        if( !target )
+            target = conn;
+        break;
+    case MONGO_READ_NEAREST:
+        target = mongo_replica_set_pick( conn, 1, 1 );
+        break;
+    }
+
+    if( !target )
+        __mongo_set_error( conn, MONGO_CONN_NO_MEMBER, "No replica set member matches the read preference.", 0 );
+    return target;
+}
+
+MONGO_EXPORT int mongo_replset_connect( mongo *conn ) {
+    int ret;
+    bson_errprintf("WARNING: mongo_replset_connect() is deprecated, please use mongo_replica_set_client()\n");
+    ret = mongo_replica_set_client( conn );
+    mongo_set_write_concern( conn, 0 );
+    return ret;
+}
+
+MONGO_EXPORT int mongo_set_op_timeout( mongo *conn, int millis ) {
+    mongo_host_port *node;
+
+    conn->op_timeout_ms = millis;
+    if( conn->sock && conn->connected )
+        mongo_env_set_socket_op_timeout( conn, millis );
+
+    if( conn->replica_set )
+        for( node = conn->replica_set->hosts; node != NULL; node = node->next )
+            if( node->member )
+                mongo_set_op_timeout( node->member, millis );
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_set_connect_timeout( mongo *conn, int millis ) {
+    conn->conn_timeout_ms = millis;
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_reconnect( mongo *conn ) {
+    int res;
+    mongo_disconnect( conn );
+
+    if( conn->replica_set ) {
+        mongo_replica_set_retire_hosts( conn->replica_set );
+        res = mongo_replica_set_client( conn );
+        return res;
+    }
+    else
+        return mongo_socket_connect( conn, conn->primary->host, conn->primary->port );
+}
+
+/* Probe, all at once, the hosts other than the primary that have no open
+ * read connection, and keep one to each that answers as a secondary. */
+static void mongo_replica_set_join_members( mongo *conn ) {
+    mongo_replica_set *replica_set = conn->replica_set;
+    mongo_host_port *node, *copy, *list = NULL, **tail = &list;
+    mongo_probe *probes;
+    int count, i;
+
+    for( node = replica_set->hosts; node != NULL; node = node->next ) {
+        if( node->is_primary || ( node->member && node->member->connected ) )
+            continue;
+        copy = mongo_host_port_copy( node );
+        *tail = copy;
+        tail = &copy->next;
+    }
+    if( !list )
+        return;
+
+    /* The probes record on the copies; carry what they learn back. */
+    probes = mongo_probe_list( conn, list, replica_set->name, MONGO_PROBE_UNTIL_ALL, &count );
+    for( i = 0; i < count; i++ ) {
+        copy = probes[i].node;
+        for( node = replica_set->hosts; node != NULL; node = node->next )
+            if( node->port == copy->port && strcmp( node->host, copy->host ) == 0 )
+                break;
+        if( !node || !probes[i].answered || !copy->is_secondary )
+            continue;
+        node->is_secondary = 1;
+        mongo_host_port_record_rtt( node, copy->rtt_usec );
+        mongo_replica_set_keep_member( replica_set, probes[i].conn, node );
+    }
+    mongo_probe_list_free( probes, count );
+    mongo_replica_set_free_list( &list );
+}
+
+MONGO_EXPORT int mongo_refresh_rtt( mongo *conn ) {
+    mongo_host_port *node;
+    bson out;
+    int res = MONGO_ERROR;
+
+    if( !conn->replica_set ) {
+        if( conn->connected && mongo_timed_is_master( conn, conn->primary, &out ) == MONGO_OK ) {
+            bson_destroy( &out );
+            res = MONGO_OK;
+        }
+        return res;
+    }
+
+    for( node = conn->replica_set->hosts; node != NULL; node = node->next ) {
+        if( node->is_primary ) {
+            if( conn->connected && mongo_timed_is_master( conn, node, &out ) == MONGO_OK ) {
+                bson_destroy( &out );
+                res = MONGO_OK;
+            }
+        }
+        /* A member that fails or stops being a secondary is closed, not
+         * freed: cursors may still hold it until mongo_destroy( ). */
+        else if( node->member && node->member->connected ) {
+            if( mongo_replica_set_check_host( node->member, conn->replica_set->name, node ) != MONGO_OK ||
+                    !node->is_secondary ) {
+                mongo_disconnect( node->member );
+                node->is_secondary = 0;
+            }
+        }
+    }
+
+    if( conn->replica_set->read_preference != MONGO_READ_PRIMARY )
+        mongo_replica_set_join_members( conn );
+    return res;
+}
+
+MONGO_EXPORT int mongo_check_connection( mongo *conn ) {
+    if( ! conn->connected )
+        return MONGO_ERROR;
+
+    return mongo_simple_int_command( conn, "admin", "ping", 1, NULL );
+}
+
+MONGO_EXPORT void mongo_disconnect( mongo *conn ) {
+    mongo_reset_stream( conn );
+
+    if( ! conn->connected )
+        return;
+
+    if( conn->replica_set )
+        mongo_replica_set_retire_hosts( conn->replica_set );
+
+    mongo_env_close_socket( conn->sock );
+
+    conn->sock = 0;
+    conn->connected = 0;
+}
+
+MONGO_EXPORT void mongo_destroy( mongo *conn ) {
+    mongo_disconnect( conn );
+
+    if( conn->replica_set ) {
         mongo_replica_set_free_list( &conn->replica_set->seeds );
         mongo_replica_set_free_list( &conn->replica_set->hosts );
+        mongo_replica_set_free_list( &conn->replica_set->retired );
         bson_free( conn->replica_set->name );
         bson_free( conn->replica_set );
         conn->replica_set = NULL;
@@ -750,290 +1526,790 @@ MONGO_EXPORT void mongo_destroy( mongo *conn ) {
 
     bson_free( conn->primary );
 
+    if( conn->read_buf ) {
+        bson_free( conn->read_buf );
+        conn->read_buf = NULL;
+    }
+
     mongo_clear_errors( conn );
 }
 
 /* Determine whether this BSON object is valid for the given operation.  */
+static mongo_error_t mongo_bson_check( const mongo *conn, const bson *bson, int write ) {
+    if( ! bson->finished )
+        return MONGO_BSON_NOT_FINISHED;
+
+    if( bson_size( bson ) > conn->max_bson_size )
+        return MONGO_BSON_TOO_LARGE;
+
+    if( bson->err & BSON_NOT_UTF8 )
+        return MONGO_BSON_INVALID;
+
+    if( write ) {
+        if( ( bson->err & BSON_FIELD_HAS_DOT ) ||
+                ( bson->err & BSON_FIELD_INIT_DOLLAR ) )
+            return MONGO_BSON_INVALID;
+    }
+
+    return MONGO_CONN_SUCCESS;
+}
+
 static int mongo_bson_valid( mongo *conn, const bson *bson, int write ) {
-    int size;
+    conn->err = mongo_bson_check( conn, bson, write );
+
+    return conn->err == MONGO_CONN_SUCCESS ? MONGO_OK : MONGO_ERROR;
+}
 
+/* Determine whether this BSON object is valid for the given operation.  */
+static int mongo_cursor_bson_valid( mongo_cursor *cursor, const bson *bson ) {
     if( ! bson->finished ) {
-        conn->err = MONGO_BSON_NOT_FINISHED;
+        cursor->err = MONGO_CURSOR_BSON_ERROR;
+        cursor->conn->err = MONGO_BSON_NOT_FINISHED;
         return MONGO_ERROR;
     }
 
-    size = bson_size( bson );
-    if( size > conn->max_bson_size ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
+    if( bson->err & BSON_NOT_UTF8 ) {
+        cursor->err = MONGO_CURSOR_BSON_ERROR;
+        cursor->conn->err = MONGO_BSON_INVALID;
         return MONGO_ERROR;
     }
 
-    if( bson->err & BSON_NOT_UTF8 ) {
-        conn->err = MONGO_BSON_INVALID;
+    return MONGO_OK;
+}
+
+/* Send the getLastError command for the database of ns without waiting
+ * for its reply. The request id is stored in *request_id. */
+static int mongo_send_last_error_request( mongo *conn, const char *ns,
+                                          mongo_write_concern *write_concern,
+                                          int *request_id ) {
+    static const int MINUS_ONE = -1;
+    mongo_wire w[1];
+    char *cmd_ns;
+    int res;
+
+    if( mongo_check_blocking( conn ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    cmd_ns = mongo_ns_to_cmd_db( ns );
+    mongo_wire_init( w, MONGO_OP_QUERY );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append( w, cmd_ns, strlen( cmd_ns ) + 1 );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append32( w, &MINUS_ONE );
+    mongo_wire_append( w, write_concern->cmd->data, bson_size( write_concern->cmd ) );
+
+    *request_id = w->id;
+    res = mongo_wire_send( conn, w );
+    bson_free( cmd_ns );
+
+    return res;
+}
+
+/* Read the reply to a getLastError request sent by
+ * mongo_send_last_error_request() and record any write error on conn. */
+static int mongo_read_last_error_reply( mongo *conn, int request_id ) {
+    mongo_reply *reply;
+    bson response[1];
+    bson_iterator it[1];
+    int res;
+
+    mongo_clear_errors( conn );
+
+    if( mongo_read_response( conn, &reply ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( reply->head.responseTo != request_id || reply->fields.num < 1 ) {
+        bson_free( reply );
+        __mongo_set_error( conn, MONGO_IO_ERROR,
+                           "Unexpected reply to getLastError.", 0 );
         return MONGO_ERROR;
     }
 
-    if( write ) {
-        if( ( bson->err & BSON_FIELD_HAS_DOT ) ||
-                ( bson->err & BSON_FIELD_INIT_DOLLAR ) ) {
+    res = MONGO_OK;
+    bson_init_finished_data( response, &reply->objs, 0 );
+    if( bson_find( it, response, "$err" ) == BSON_STRING ||
+        bson_find( it, response, "err" ) == BSON_STRING ) {
 
-            conn->err = MONGO_BSON_INVALID;
+        __mongo_set_error( conn, MONGO_WRITE_ERROR,
+                           "See conn->lasterrstr for details.", 0 );
+        mongo_set_last_error( conn, it, response );
+        res = MONGO_ERROR;
+    }
+
+    bson_free( reply );
+    return res;
+}
+
+static int mongo_check_last_error( mongo *conn, const char *ns,
+                                   mongo_write_concern *write_concern ) {
+    int request_id;
+
+    if( mongo_send_last_error_request( conn, ns, write_concern, &request_id ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_read_last_error_reply( conn, request_id );
+}
+
+static int mongo_choose_write_concern( mongo *conn,
+                                       mongo_write_concern *custom_write_concern,
+                                       mongo_write_concern **write_concern ) {
+
+    if( custom_write_concern ) {
+        *write_concern = custom_write_concern;
+    }
+    else if( conn->write_concern ) {
+        *write_concern = conn->write_concern;
+    }
+    if ( *write_concern && (*write_concern)->w < 1 ) {
+        *write_concern = 0; /* do not generate getLastError request */
+    }
+    if( *write_concern && !((*write_concern)->cmd) ) {
+        __mongo_set_error( conn, MONGO_WRITE_CONCERN_INVALID,
+                           "Must call mongo_write_concern_finish() before using *write_concern.", 0 );
+        return MONGO_ERROR;
+    }
+    else if( *write_concern && conn->async ) {
+        __mongo_set_error( conn, MONGO_CONN_NONBLOCKING,
+                           "Acknowledged writes need a blocking connection.", 0 );
+        return MONGO_ERROR;
+    }
+    else
+        return MONGO_OK;
+}
+
+
+/*********************************************************************
+CRUD API
+**********************************************************************/
+
+static int mongo_check_write_concern( mongo *conn, const char *ns,
+                                     mongo_write_concern *write_concern ) {
+    if( write_concern )
+        return mongo_check_last_error( conn, ns, write_concern );
+    else
+        return MONGO_OK;
+}
+
+static int mongo_insert_message( mongo *conn, const char *ns,
+                                 const bson **bsons, int count, int flags ) {
+    mongo_wire w[1];
+    int i;
+
+    mongo_wire_init( w, MONGO_OP_INSERT );
+    if( flags & MONGO_CONTINUE_ON_ERROR )
+        mongo_wire_append32( w, &ONE );
+    else
+        mongo_wire_append32( w, &ZERO );
+    mongo_wire_append( w, ns, strlen( ns ) + 1 );
+
+    for( i=0; i<count; i++ ) {
+        mongo_wire_append( w, bsons[i]->data, bson_size( bsons[i] ) );
+    }
+
+    return mongo_wire_send( conn, w );
+}
+
+static int mongo_update_message( mongo *conn, const char *ns, const bson *cond,
+                                 const bson *op, int flags ) {
+    mongo_wire w[1];
+
+    mongo_wire_init( w, MONGO_OP_UPDATE );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append( w, ns, strlen( ns ) + 1 );
+    mongo_wire_append32( w, &flags );
+    mongo_wire_append( w, cond->data, bson_size( cond ) );
+    mongo_wire_append( w, op->data, bson_size( op ) );
+
+    return mongo_wire_send( conn, w );
+}
+
+static int mongo_remove_message( mongo *conn, const char *ns, const bson *cond ) {
+    mongo_wire w[1];
+
+    mongo_wire_init( w, MONGO_OP_DELETE );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append( w, ns, strlen( ns ) + 1 );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append( w, cond->data, bson_size( cond ) );
+
+    return mongo_wire_send( conn, w );
+}
+
+MONGO_EXPORT int mongo_insert( mongo *conn, const char *ns,
+                               const bson *bson, mongo_write_concern *custom_write_concern ) {
+
+    mongo_write_concern *write_concern = NULL;
+
+    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_bson_valid( conn, bson, 1 ) != MONGO_OK ) {
+        return MONGO_ERROR;
+    }
+
+    if( mongo_choose_write_concern( conn, custom_write_concern,
+                                    &write_concern ) == MONGO_ERROR ) {
+        return MONGO_ERROR;
+    }
+
+    if( mongo_insert_message( conn, ns, &bson, 1, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_check_write_concern( conn, ns, write_concern );
+}
+
+MONGO_EXPORT int mongo_insert_batch( mongo *conn, const char *ns,
+                                     const bson **bsons, int count, mongo_write_concern *custom_write_concern,
+                                     int flags ) {
+
+    return mongo_insert_batch_with_result( conn, ns, bsons, count,
+                                           custom_write_concern, flags, NULL );
+}
+
+MONGO_EXPORT int mongo_insert_batch_with_result( mongo *conn, const char *ns,
+                                                 const bson **bsons, int count,
+                                                 mongo_write_concern *custom_write_concern,
+                                                 int flags, mongo_batch_result *result ) {
+
+    mongo_write_concern *write_concern = NULL;
+    mongo_batch_result local;
+    int pipeline;
+    int *pending = NULL;   /* getLastError ids and first indexes, pipelined mode */
+    int npending = 0;
+    int lasterrcode = 0;
+    char lasterrstr[MONGO_ERR_LEN];
+    size_t overhead = 16 + 4 + strlen( ns ) + 1;
+    size_t limit;
+    int start, i;
+    int res = MONGO_OK;
+
+    if( !result )
+        result = &local;
+    result->messages = 0;
+    result->failed = 0;
+    result->first_failed = -1;
+
+    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    for( i=0; i<count; i++ ) {
+        if( mongo_bson_valid( conn, bsons[i], 1 ) != MONGO_OK )
             return MONGO_ERROR;
+    }
 
+    if( mongo_choose_write_concern( conn, custom_write_concern,
+                                    &write_concern ) == MONGO_ERROR ) {
+        return MONGO_ERROR;
+    }
+
+    /* Documents per message are bounded by the server's message size;
+     * a message always carries at least one document. */
+    limit = (size_t)conn->max_message_size;
+    limit = limit > overhead ? limit - overhead : 0;
+
+    pipeline = write_concern && ( flags & MONGO_CONTINUE_ON_ERROR );
+    if( pipeline )
+        pending = ( int * )bson_malloc( 2 * sizeof( int ) * ( count > 0 ? count : 1 ) );
+
+    start = 0;
+    do {
+        size_t size = 0;
+
+        for( i = start; i < count; i++ ) {
+            size_t doc_size = bson_size( bsons[i] );
+            if( i > start && size + doc_size > limit )
+                break;
+            size += doc_size;
+        }
+
+        res = mongo_insert_message( conn, ns, bsons + start, i - start, flags );
+        if( res != MONGO_OK )
+            break;
+        result->messages++;
+
+        if( pipeline ) {
+            res = mongo_send_last_error_request( conn, ns, write_concern,
+                                                 &pending[2 * npending] );
+            if( res != MONGO_OK )
+                break;
+            pending[2 * npending + 1] = start;
+            npending++;
+        }
+        else if( write_concern ) {
+            res = mongo_check_last_error( conn, ns, write_concern );
+            if( res != MONGO_OK ) {
+                if( conn->err == MONGO_WRITE_ERROR ) {
+                    result->failed = 1;
+                    result->first_failed = start;
+                }
+                break;
+            }
+        }
+
+        start = i;
+    } while( start < count );
+
+    if( pipeline ) {
+        if( res == MONGO_OK ) {
+            for( i = 0; i < npending; i++ ) {
+                if( mongo_read_last_error_reply( conn, pending[2 * i] ) == MONGO_OK )
+                    continue;
+                if( conn->err != MONGO_WRITE_ERROR ) {
+                    res = MONGO_ERROR;
+                    break;
+                }
+                /* Keep the first server error; later ones are only counted. */
+                if( result->failed++ == 0 ) {
+                    result->first_failed = pending[2 * i + 1];
+                    lasterrcode = conn->lasterrcode;
+                    memcpy( lasterrstr, conn->lasterrstr, MONGO_ERR_LEN );
+                }
+            }
+        }
+        if( res == MONGO_OK && result->failed ) {
+            __mongo_set_error( conn, MONGO_WRITE_ERROR,
+                               "See conn->lasterrstr for details.", 0 );
+            conn->lasterrcode = lasterrcode;
+            memcpy( conn->lasterrstr, lasterrstr, MONGO_ERR_LEN );
+            res = MONGO_ERROR;
         }
+        bson_free( pending );
     }
 
-    conn->err = MONGO_CONN_SUCCESS;
+    return res;
+}
 
-    return MONGO_OK;
+MONGO_EXPORT int mongo_update( mongo *conn, const char *ns, const bson *cond,
+                               const bson *op, int flags, mongo_write_concern *custom_write_concern ) {
+
+    mongo_write_concern *write_concern = NULL;
+
+    /* Make sure that the op BSON is valid UTF-8.
+     * TODO: decide whether to check cond as well.
+     * */
+    if( mongo_bson_valid( conn, ( bson * )op, 0 ) != MONGO_OK ) {
+        return MONGO_ERROR;
+    }
+
+    if( mongo_choose_write_concern( conn, custom_write_concern,
+                                    &write_concern ) == MONGO_ERROR ) {
+        return MONGO_ERROR;
+    }
+
+    if( mongo_update_message( conn, ns, cond, op, flags ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_check_write_concern( conn, ns, write_concern );
 }
 
-/* Determine whether this BSON object is valid for the given operation.  */
-static int mongo_cursor_bson_valid( mongo_cursor *cursor, const bson *bson ) {
-    if( ! bson->finished ) {
-        cursor->err = MONGO_CURSOR_BSON_ERROR;
-        cursor->conn->err = MONGO_BSON_NOT_FINISHED;
+MONGO_EXPORT int mongo_remove( mongo *conn, const char *ns, const bson *cond,
+                               mongo_write_concern *custom_write_concern ) {
+
+    mongo_write_concern *write_concern = NULL;
+
+    /* Make sure that the BSON is valid UTF-8.
+     * TODO: decide whether to check cond as well.
+     * */
+    if( mongo_bson_valid( conn, ( bson * )cond, 0 ) != MONGO_OK ) {
         return MONGO_ERROR;
     }
 
-    if( bson->err & BSON_NOT_UTF8 ) {
-        cursor->err = MONGO_CURSOR_BSON_ERROR;
-        cursor->conn->err = MONGO_BSON_INVALID;
+    if( mongo_choose_write_concern( conn, custom_write_concern,
+                                    &write_concern ) == MONGO_ERROR ) {
+        return MONGO_ERROR;
+    }
+
+    if( mongo_remove_message( conn, ns, cond ) != MONGO_OK )
         return MONGO_ERROR;
+
+    return mongo_check_write_concern( conn, ns, write_concern );
+}
+
+/*********************************************************************
+Write sessions
+**********************************************************************/
+
+MONGO_EXPORT void mongo_write_session_init( mongo_write_session *session, mongo *conn,
+                                            mongo_write_concern *custom_write_concern,
+                                            int flush_every ) {
+    memset( session, 0, sizeof( mongo_write_session ) );
+    session->conn = conn;
+    session->write_concern = custom_write_concern;
+    if( flush_every <= 0 || flush_every > MONGO_WRITE_SESSION_MAX_PENDING )
+        flush_every = MONGO_WRITE_SESSION_MAX_PENDING;
+    session->flush_every = flush_every;
+    session->first_failed = -1;
+}
+
+/* Read every outstanding acknowledgement, remembering the first failure. */
+static int mongo_write_session_flush( mongo_write_session *session ) {
+    mongo *conn = session->conn;
+    int i, n = session->pending_count;
+
+    session->pending_count = 0;
+    for( i = 0; i < n; i++ ) {
+        if( mongo_read_last_error_reply( conn, session->pending[2 * i] ) == MONGO_OK )
+            continue;
+        if( conn->err != MONGO_WRITE_ERROR )
+            return MONGO_ERROR;
+        if( session->failed++ == 0 ) {
+            session->first_failed = session->pending[2 * i + 1];
+            session->lasterrcode = conn->lasterrcode;
+            memcpy( session->lasterrstr, conn->lasterrstr, MONGO_ERR_LEN );
+        }
     }
 
     return MONGO_OK;
 }
 
-static int mongo_check_last_error( mongo *conn, const char *ns,
-                                   mongo_write_concern *write_concern ) {
-    bson response[1];
-    bson_iterator it[1];
-    int res = 0;
-    char *cmd_ns = mongo_ns_to_cmd_db( ns );
+/* Called after each write is sent: queue its getLastError request. */
+static int mongo_write_session_sent( mongo_write_session *session, const char *ns,
+                                     mongo_write_concern *write_concern ) {
+    int index = session->writes++;
+    int *slot;
+
+    if( !write_concern )
+        return MONGO_OK;
+
+    if( !session->pending )
+        session->pending = ( int * )bson_malloc( 2 * sizeof( int ) * session->flush_every );
+
+    slot = &session->pending[2 * session->pending_count];
+    if( mongo_send_last_error_request( session->conn, ns, write_concern, slot ) != MONGO_OK )
+        return MONGO_ERROR;
+    slot[1] = index;
+
+    if( ++session->pending_count >= session->flush_every )
+        return mongo_write_session_flush( session );
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_write_session_insert( mongo_write_session *session, const char *ns,
+                                             const bson *bson ) {
+    mongo *conn = session->conn;
+    mongo_write_concern *write_concern = NULL;
+
+    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_bson_valid( conn, bson, 1 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_choose_write_concern( conn, session->write_concern,
+                                    &write_concern ) == MONGO_ERROR )
+        return MONGO_ERROR;
+
+    if( mongo_insert_message( conn, ns, &bson, 1, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_write_session_sent( session, ns, write_concern );
+}
+
+MONGO_EXPORT int mongo_write_session_update( mongo_write_session *session, const char *ns,
+                                             const bson *cond, const bson *op, int flags ) {
+    mongo *conn = session->conn;
+    mongo_write_concern *write_concern = NULL;
+
+    if( mongo_bson_valid( conn, op, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_choose_write_concern( conn, session->write_concern,
+                                    &write_concern ) == MONGO_ERROR )
+        return MONGO_ERROR;
+
+    if( mongo_update_message( conn, ns, cond, op, flags ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_write_session_sent( session, ns, write_concern );
+}
+
+MONGO_EXPORT int mongo_write_session_remove( mongo_write_session *session, const char *ns,
+                                             const bson *cond ) {
+    mongo *conn = session->conn;
+    mongo_write_concern *write_concern = NULL;
+
+    if( mongo_bson_valid( conn, cond, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_choose_write_concern( conn, session->write_concern,
+                                    &write_concern ) == MONGO_ERROR )
+        return MONGO_ERROR;
+
+    if( mongo_remove_message( conn, ns, cond ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_write_session_sent( session, ns, write_concern );
+}
 
-    res = mongo_find_one( conn, cmd_ns, write_concern->cmd, bson_shared_empty( ), response );
-    bson_free( cmd_ns );
+MONGO_EXPORT int mongo_write_session_sync( mongo_write_session *session ) {
+    mongo *conn = session->conn;
 
-    if (res == MONGO_OK &&
-        (bson_find( it, response, "$err" ) == BSON_STRING ||
-         bson_find( it, response, "err" ) == BSON_STRING)) {
+    if( mongo_write_session_flush( session ) != MONGO_OK )
+        return MONGO_ERROR;
 
+    if( session->failed ) {
         __mongo_set_error( conn, MONGO_WRITE_ERROR,
                            "See conn->lasterrstr for details.", 0 );
-        mongo_set_last_error( conn, it, response );
-        res = MONGO_ERROR;
+        conn->lasterrcode = session->lasterrcode;
+        memcpy( conn->lasterrstr, session->lasterrstr, MONGO_ERR_LEN );
+        return MONGO_ERROR;
     }
 
-    bson_destroy( response );
-    return res;
+    return MONGO_OK;
 }
 
-static int mongo_choose_write_concern( mongo *conn,
-                                       mongo_write_concern *custom_write_concern,
-                                       mongo_write_concern **write_concern ) {
+MONGO_EXPORT int mongo_write_session_destroy( mongo_write_session *session ) {
+    int res = mongo_write_session_sync( session );
 
-    if( custom_write_concern ) {
-        *write_concern = custom_write_concern;
-    }
-    else if( conn->write_concern ) {
-        *write_concern = conn->write_concern;
+    if( session->pending ) {
+        bson_free( session->pending );
+        session->pending = NULL;
     }
-    if ( *write_concern && (*write_concern)->w < 1 ) {
-        *write_concern = 0; /* do not generate getLastError request */
-    }
-    if( *write_concern && !((*write_concern)->cmd) ) {
-        __mongo_set_error( conn, MONGO_WRITE_CONCERN_INVALID,
-                           "Must call mongo_write_concern_finish() before using *write_concern.", 0 );
-        return MONGO_ERROR;
-    }
-    else
-        return MONGO_OK;
+
+    return res;
 }
 
 
 /*********************************************************************
-CRUD API
+Wire API
 **********************************************************************/
 
-static int mongo_message_send_and_check_write_concern( mongo *conn, const char *ns, mongo_message *mm, mongo_write_concern *write_concern ) {
-   if( write_concern ) {
-        if( mongo_message_send( conn, mm ) == MONGO_ERROR ) {
-            return MONGO_ERROR;
-        }
+MONGO_EXPORT int mongo_send_query( mongo *conn, const char *ns, const bson *query,
+                                   const bson *fields, int limit, int skip, int options,
+                                   int *request_id, mongo_error_t *err ) {
+    mongo_wire w[1];
+    mongo_error_t invalid = MONGO_CONN_SUCCESS;
 
-        return mongo_check_last_error( conn, ns, write_concern );
-    }
-    else {
-        return mongo_message_send( conn, mm );
+    if( ! query )
+        query = bson_shared_empty( );
+    else
+        invalid = mongo_bson_check( conn, query, 0 );
+
+    if( fields && invalid == MONGO_CONN_SUCCESS )
+        invalid = mongo_bson_check( conn, fields, 0 );
+
+    if( invalid != MONGO_CONN_SUCCESS ) {
+        conn->err = invalid;
+        if( err )
+            *err = invalid;
+        return MONGO_ERROR;
     }
+
+    mongo_wire_init( w, MONGO_OP_QUERY );
+    mongo_wire_append32( w, &options );
+    mongo_wire_append( w, ns, strlen( ns ) + 1 );
+    mongo_wire_append32( w, &skip );
+    mongo_wire_append32( w, &limit );
+    mongo_wire_append( w, query->data, bson_size( query ) );
+    if( fields )
+        mongo_wire_append( w, fields->data, bson_size( fields ) );
+
+    if( request_id )
+        *request_id = w->id;
+    return mongo_wire_send_reporting( conn, w, err );
 }
 
-MONGO_EXPORT int mongo_insert( mongo *conn, const char *ns,
-                               const bson *bson, mongo_write_concern *custom_write_concern ) {
+MONGO_EXPORT int mongo_send_get_more( mongo *conn, const char *ns, int64_t cursor_id,
+                                      int limit, int *request_id, mongo_error_t *err ) {
+    mongo_wire w[1];
 
-    char *data;
-    mongo_message *mm;
-    mongo_write_concern *write_concern = NULL;
+    mongo_wire_init( w, MONGO_OP_GET_MORE );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append( w, ns, strlen( ns ) + 1 );
+    mongo_wire_append32( w, &limit );
+    mongo_wire_append64( w, &cursor_id );
 
-    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
-        return MONGO_ERROR;
+    if( request_id )
+        *request_id = w->id;
+    return mongo_wire_send_reporting( conn, w, err );
+}
 
-    if( mongo_bson_valid( conn, bson, 1 ) != MONGO_OK ) {
-        return MONGO_ERROR;
-    }
+MONGO_EXPORT int mongo_send_kill_cursor( mongo *conn, int64_t cursor_id, mongo_error_t *err ) {
+    mongo_wire w[1];
 
-    if( mongo_choose_write_concern( conn, custom_write_concern,
-                                    &write_concern ) == MONGO_ERROR ) {
-        return MONGO_ERROR;
-    }
+    mongo_wire_init( w, MONGO_OP_KILL_CURSORS );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append32( w, &ONE );
+    mongo_wire_append64( w, &cursor_id );
 
-    mm = mongo_message_create( 16 /* header */
-                               + 4 /* ZERO */
-                               + strlen( ns )
-                               + 1 + bson_size( bson )
-                               , 0, 0, MONGO_OP_INSERT );
-    if( mm == NULL ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
+    return mongo_wire_send_reporting( conn, w, err );
+}
+
+MONGO_EXPORT int mongo_read_reply( mongo *conn, mongo_reply **reply ) {
+    return mongo_read_response( conn, reply );
+}
+
+
+/*********************************************************************
+Non-blocking API
+**********************************************************************/
+
+static int mongo_async_check( mongo *conn ) {
+    if( ! conn->async ) {
+        __mongo_set_error( conn, MONGO_CONN_NONBLOCKING,
+                           "Connection is in blocking mode.", 0 );
         return MONGO_ERROR;
     }
 
-    data = &mm->data;
-    data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
-    mongo_data_append( data, bson->data, bson_size( bson ) );
-
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+    return MONGO_OK;
 }
 
-MONGO_EXPORT int mongo_insert_batch( mongo *conn, const char *ns,
-                                     const bson **bsons, int count, mongo_write_concern *custom_write_concern,
-                                     int flags ) {
-
-    mongo_message *mm;
-    mongo_write_concern *write_concern = NULL;
-    int i;
-    char *data;
-    size_t overhead =  16 + 4 + strlen( ns ) + 1;
-    size_t size = overhead;
+MONGO_EXPORT int mongo_set_nonblocking( mongo *conn, int nonblocking ) {
+    mongo_async *async = conn->async;
 
-    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
+    if( ! conn->connected ) {
+        conn->err = MONGO_IO_ERROR;
         return MONGO_ERROR;
+    }
 
-    for( i=0; i<count; i++ ) {
-        size += bson_size( bsons[i] );
-        if( mongo_bson_valid( conn, bsons[i], 1 ) != MONGO_OK )
+    if( ! nonblocking ) {
+        if( ! async )
+            return MONGO_OK;
+        if( async->out_pos < async->out_len || async->pending || async->in_len ) {
+            __mongo_set_error( conn, MONGO_CONN_NONBLOCKING,
+                               "Non-blocking requests are still outstanding.", 0 );
+            return MONGO_ERROR;
+        }
+        if( mongo_env_set_socket_nonblocking( conn, 0 ) != MONGO_OK )
             return MONGO_ERROR;
+        mongo_async_free( conn );
+        return MONGO_OK;
     }
 
-    if( ( size - overhead ) > (size_t)conn->max_bson_size ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
+    if( async )
+        return MONGO_OK;
+
+    if( conn->streaming_cursor ) {
+        __mongo_set_error( conn, MONGO_CONN_BUSY,
+                           "Connection is streaming an exhaust cursor.", 0 );
         return MONGO_ERROR;
     }
 
-    if( mongo_choose_write_concern( conn, custom_write_concern,
-                                    &write_concern ) == MONGO_ERROR ) {
+    /* Settle a prefetched batch while reads may still block. */
+    if( conn->pending_cursor && mongo_cursor_read_more( conn->pending_cursor ) != MONGO_OK )
         return MONGO_ERROR;
-    }
 
-    mm = mongo_message_create( size , 0 , 0 , MONGO_OP_INSERT );
-    if( mm == NULL ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
+    if( mongo_env_set_socket_nonblocking( conn, 1 ) != MONGO_OK )
         return MONGO_ERROR;
-    }
 
-    data = &mm->data;
-    if( flags & MONGO_CONTINUE_ON_ERROR )
-        data = mongo_data_append32( data, &ONE );
-    else
-        data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
+    async = ( mongo_async * )bson_malloc( sizeof( mongo_async ) );
+    memset( async, 0, sizeof( mongo_async ) );
+    conn->async = async;
 
-    for( i=0; i<count; i++ ) {
-        data = mongo_data_append( data, bsons[i]->data, bson_size( bsons[i] ) );
+    /* Bytes already read ahead belong to the next reply. */
+    if( conn->read_pos < conn->read_len ) {
+        async->in_len = conn->read_len - conn->read_pos;
+        mongo_async_reserve( &async->in, &async->in_size, 0, async->in_len );
+        memcpy( async->in, conn->read_buf + conn->read_pos, async->in_len );
     }
+    mongo_read_buffer_reset( conn );
 
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+    return MONGO_OK;
 }
 
-MONGO_EXPORT int mongo_update( mongo *conn, const char *ns, const bson *cond,
-                               const bson *op, int flags, mongo_write_concern *custom_write_concern ) {
+MONGO_EXPORT int mongo_async_want( mongo *conn ) {
+    mongo_async *async = conn->async;
+    int want = 0;
 
-    char *data;
-    mongo_message *mm;
-    mongo_write_concern *write_concern = NULL;
+    if( ! async )
+        return 0;
+    if( async->pending )
+        want |= MONGO_WANT_READ;
+    if( async->out_pos < async->out_len )
+        want |= MONGO_WANT_WRITE;
 
-    /* Make sure that the op BSON is valid UTF-8.
-     * TODO: decide whether to check cond as well.
-     * */
-    if( mongo_bson_valid( conn, ( bson * )op, 0 ) != MONGO_OK ) {
-        return MONGO_ERROR;
-    }
+    return want;
+}
 
-    if( mongo_choose_write_concern( conn, custom_write_concern,
-                                    &write_concern ) == MONGO_ERROR ) {
+MONGO_EXPORT int mongo_async_query( mongo *conn, const char *ns, const bson *query,
+                                    const bson *fields, int limit, int skip, int options,
+                                    int *request_id ) {
+    if( mongo_async_check( conn ) != MONGO_OK )
         return MONGO_ERROR;
-    }
 
-    mm = mongo_message_create( 16 /* header */
-                               + 4  /* ZERO */
-                               + strlen( ns ) + 1
-                               + 4  /* flags */
-                               + bson_size( cond )
-                               + bson_size( op )
-                               , 0 , 0 , MONGO_OP_UPDATE );
-    if( mm == NULL ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
-        return MONGO_ERROR;
-    }
+    return mongo_send_query( conn, ns, query, fields, limit, skip, options, request_id, NULL );
+}
 
-    data = &mm->data;
-    data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
-    data = mongo_data_append32( data, &flags );
-    data = mongo_data_append( data, cond->data, bson_size( cond ) );
-    mongo_data_append( data, op->data, bson_size( op ) );
+MONGO_EXPORT int mongo_async_get_more( mongo *conn, const char *ns, int64_t cursor_id,
+                                       int limit, int *request_id ) {
+    if( mongo_async_check( conn ) != MONGO_OK )
+        return MONGO_ERROR;
 
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+    return mongo_send_get_more( conn, ns, cursor_id, limit, request_id, NULL );
 }
 
-MONGO_EXPORT int mongo_remove( mongo *conn, const char *ns, const bson *cond,
-                               mongo_write_concern *custom_write_concern ) {
-
-    char *data;
-    mongo_message *mm;
-    mongo_write_concern *write_concern = NULL;
+MONGO_EXPORT int mongo_async_flush( mongo *conn ) {
+    mongo_async *async = conn->async;
 
-    /* Make sure that the BSON is valid UTF-8.
-     * TODO: decide whether to check cond as well.
-     * */
-    if( mongo_bson_valid( conn, ( bson * )cond, 0 ) != MONGO_OK ) {
+    if( mongo_async_check( conn ) != MONGO_OK )
         return MONGO_ERROR;
-    }
 
-    if( mongo_choose_write_concern( conn, custom_write_concern,
-                                    &write_concern ) == MONGO_ERROR ) {
-        return MONGO_ERROR;
+    while( async->out_pos < async->out_len ) {
+        int sent = mongo_env_try_write_socket( conn, async->out + async->out_pos,
+                                               async->out_len - async->out_pos );
+        if( sent < 0 )
+            return MONGO_ERROR;
+        if( sent == 0 )
+            return MONGO_OK;
+        async->out_pos += sent;
     }
 
-    mm = mongo_message_create( 16  /* header */
-                               + 4  /* ZERO */
-                               + strlen( ns ) + 1
-                               + 4  /* ZERO */
-                               + bson_size( cond )
-                               , 0 , 0 , MONGO_OP_DELETE );
-    if( mm == NULL ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
+    async->out_pos = 0;
+    async->out_len = 0;
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_async_read_reply( mongo *conn, mongo_reply **reply ) {
+    mongo_async *async = conn->async;
+
+    *reply = NULL;
+    if( mongo_async_check( conn ) != MONGO_OK )
         return MONGO_ERROR;
-    }
 
-    data = &mm->data;
-    data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
-    data = mongo_data_append32( data, &ZERO );
-    mongo_data_append( data, cond->data, bson_size( cond ) );
+    for( ;; ) {
+        unsigned int len = 0;
+        int got;
+
+        if( async->in_len >= ( int )sizeof( mongo_header ) + ( int )sizeof( mongo_reply_fields ) ) {
+            bson_little_endian32( &len, async->in );
+            if( ! mongo_reply_len_valid( len ) ) {
+                conn->err = MONGO_READ_SIZE_ERROR;
+                return MONGO_ERROR;
+            }
+
+            if( ( unsigned int )async->in_len >= len ) {
+                mongo_header head;
+                mongo_reply_fields fields;
+                mongo_reply *out = ( mongo_reply * )bson_malloc( MONGO_REPLY_ALLOC_SIZE( len ) );
+
+                memcpy( &head, async->in, sizeof( head ) );
+                memcpy( &fields, async->in + sizeof( head ), sizeof( fields ) );
+                mongo_reply_set_header( out, len, &head, &fields );
+                memcpy( &out->objs, async->in + 16 + 20, len - 16 - 20 );
+
+                async->in_len -= len;
+                memmove( async->in, async->in + len, async->in_len );
+                if( async->pending )
+                    async->pending--;
+
+                *reply = out;
+                return MONGO_OK;
+            }
+        }
+
+        /* Leave room for the rest of the current reply. */
+        mongo_async_reserve( &async->in, &async->in_size, async->in_len,
+                             len ? ( int )len - async->in_len : 1 );
 
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+        got = mongo_env_try_read_socket( conn, async->in + async->in_len,
+                                         async->in_size - async->in_len );
+        if( got < 0 )
+            return MONGO_ERROR;
+        if( got == 0 )
+            return MONGO_OK;
+        async->in_len += got;
+    }
 }
 
 
@@ -1159,16 +2435,78 @@ MONGO_EXPORT void mongo_write_concern_set_mode( mongo_write_concern *write_conce
     write_concern->mode = mode;
 }
 
+/* numberToReturn for the next query or getMore: the batch size, cut
+ * down to what is left of a positive limit. */
+static int mongo_cursor_batch_limit( mongo_cursor *cursor ) {
+    int limit = cursor->batch_size > 0 ? cursor->batch_size : 0;
+
+    if( cursor->limit < 0 )
+        return cursor->limit;
+    if( cursor->limit > 0 && ( ! limit || cursor->limit - cursor->seen < limit ) )
+        limit = cursor->limit - cursor->seen;
+
+    return limit;
+}
+
+/* Note the arrival of a batch whose request went out at sent. */
+static void mongo_cursor_batch_arrived( mongo_cursor *cursor, int64_t sent ) {
+    cursor->batch_start = mongo_env_clock_usec();
+    cursor->batch_wait = cursor->batch_start - sent;
+}
+
+/* Double the batch size, up to max_batch_size, when the current batch
+ * was used up faster than it took to arrive. */
+static void mongo_cursor_grow_batch( mongo_cursor *cursor ) {
+    int size = cursor->batch_size;
+
+    if( cursor->max_batch_size <= 0 ||
+        mongo_env_clock_usec() - cursor->batch_start >= cursor->batch_wait )
+        return;
+
+    if( size < cursor->reply->fields.num )
+        size = cursor->reply->fields.num;
+    if( size > 0 )
+        cursor->batch_size = size > cursor->max_batch_size / 2 ? cursor->max_batch_size : size * 2;
+}
+
+/* Send queries to a member allowed by the read preference. Commands stay on the primary. */
+static int mongo_cursor_route( mongo_cursor *cursor ) {
+    mongo *target;
+    size_t len = strlen( cursor->ns );
+
+    if( !cursor->conn->replica_set || cursor->conn->replica_set->read_preference == MONGO_READ_PRIMARY )
+        return MONGO_OK;
+    if( len >= 5 && strcmp( cursor->ns + len - 5, ".$cmd" ) == 0 )
+        return MONGO_OK;
+
+    target = mongo_replica_set_read_target( cursor->conn );
+    if( !target )
+        return MONGO_ERROR;
+    if( target != cursor->conn ) {
+        mongo_clear_errors( target );
+        cursor->conn = target;
+    }
+    cursor->options |= MONGO_SLAVE_OK;
+    return MONGO_OK;
+}
+
 static int mongo_cursor_op_query( mongo_cursor *cursor ) {
     int res;
-    char *data;
-    mongo_message *mm;
+    int limit;
+    int64_t sent;
+    mongo_wire w[1];
     bson temp;
     bson_iterator it;
 
     /* Clear any errors. */
     mongo_clear_errors( cursor->conn );
 
+    if( mongo_cursor_route( cursor ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_check_blocking( cursor->conn ) != MONGO_OK )
+        return MONGO_ERROR;
+
     /* Set up default values for query and fields, if necessary. */
     if( ! cursor->query )
         cursor->query = bson_shared_empty( );
@@ -1180,37 +2518,31 @@ static int mongo_cursor_op_query( mongo_cursor *cursor ) {
     else if( mongo_cursor_bson_valid( cursor, cursor->fields ) != MONGO_OK )
         return MONGO_ERROR;
 
-    mm = mongo_message_create( 16 + /* header */
-                               4 + /*  options */
-                               strlen( cursor->ns ) + 1 + /* ns */
-                               4 + 4 + /* skip,return */
-                               bson_size( cursor->query ) +
-                               bson_size( cursor->fields ) ,
-                               0 , 0 , MONGO_OP_QUERY );
-    if( mm == NULL ) {
-        return MONGO_ERROR;
-    }
-
-    data = &mm->data;
-    data = mongo_data_append32( data , &cursor->options );
-    data = mongo_data_append( data , cursor->ns , strlen( cursor->ns ) + 1 );
-    data = mongo_data_append32( data , &cursor->skip );
-    data = mongo_data_append32( data , &cursor->limit );
-    data = mongo_data_append( data , cursor->query->data , bson_size( cursor->query ) );
+    /* The server closes the cursor after the first batch when asked for 1. */
+    limit = mongo_cursor_batch_limit( cursor );
+    if( limit == 1 && cursor->limit != 1 )
+        limit = 2;
+
+    mongo_wire_init( w, MONGO_OP_QUERY );
+    mongo_wire_append32( w, &cursor->options );
+    mongo_wire_append( w, cursor->ns, strlen( cursor->ns ) + 1 );
+    mongo_wire_append32( w, &cursor->skip );
+    mongo_wire_append32( w, &limit );
+    mongo_wire_append( w, cursor->query->data, bson_size( cursor->query ) );
     if ( cursor->fields )
-        data = mongo_data_append( data , cursor->fields->data , bson_size( cursor->fields ) );
-
-    bson_fatal_msg( ( data == ( ( char * )mm ) + mm->head.len ), "query building fail!" );
+        mongo_wire_append( w, cursor->fields->data, bson_size( cursor->fields ) );
 
-    res = mongo_message_send( cursor->conn , mm );
+    sent = mongo_env_clock_usec();
+    res = mongo_wire_send( cursor->conn, w );
     if( res != MONGO_OK ) {
         return MONGO_ERROR;
     }
 
-    res = mongo_read_response( cursor->conn, ( mongo_reply ** )&( cursor->reply ) );
+    res = mongo_read_response_into( cursor->conn, &cursor->reply, &cursor->reply_size );
     if( res != MONGO_OK ) {
         return MONGO_ERROR;
     }
+    mongo_cursor_batch_arrived( cursor, sent );
 
     if( cursor->reply->fields.num == 1 ) {
         bson_init_finished_data( &temp, &cursor->reply->objs, 0 );
@@ -1223,9 +2555,158 @@ static int mongo_cursor_op_query( mongo_cursor *cursor ) {
 
     cursor->seen += cursor->reply->fields.num;
     cursor->flags |= MONGO_CURSOR_QUERY_SENT;
+
+    /* The server now pushes every remaining batch without being asked. */
+    if( ( cursor->options & MONGO_EXHAUST ) && cursor->reply->fields.cursorID ) {
+        cursor->flags |= MONGO_CURSOR_STREAMING;
+        cursor->conn->streaming_cursor = cursor;
+    }
+
+    return MONGO_OK;
+}
+
+static int mongo_cursor_send_get_more( mongo_cursor *cursor, int *request_id ) {
+    int limit;
+    mongo_wire w[1];
+
+    if( mongo_check_blocking( cursor->conn ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    mongo_cursor_grow_batch( cursor );
+    limit = mongo_cursor_batch_limit( cursor );
+
+    mongo_wire_init( w, MONGO_OP_GET_MORE );
+    mongo_wire_append32( w, &ZERO );
+    mongo_wire_append( w, cursor->ns, strlen( cursor->ns ) + 1 );
+    mongo_wire_append32( w, &limit );
+    mongo_wire_append64( w, &cursor->reply->fields.cursorID );
+
+    if( request_id )
+        *request_id = w->id;
+    return mongo_wire_send( cursor->conn, w );
+}
+
+/* Drop the spare buffer after a failed prefetch read, so that the batch
+ * it held before is never swapped back in as the next one. */
+static int mongo_cursor_read_more_failed( mongo_cursor *cursor ) {
+    if( cursor->spare )
+        bson_free( cursor->spare );
+    cursor->spare = NULL;
+    cursor->spare_size = 0;
+    cursor->err = MONGO_CURSOR_INVALID;
+    return MONGO_ERROR;
+}
+
+/* Read the reply to a prefetch getMore into the spare buffer. A failed
+ * read leaves MONGO_CURSOR_MORE_READ set with no spare buffer. */
+static int mongo_cursor_read_more( mongo_cursor *cursor ) {
+    mongo *conn = cursor->conn;
+
+    conn->pending_cursor = NULL;
+    cursor->flags &= ~MONGO_CURSOR_MORE_SENT;
+    cursor->flags |= MONGO_CURSOR_MORE_READ;
+
+    if( mongo_read_response_into( conn, &cursor->spare, &cursor->spare_size ) != MONGO_OK )
+        return mongo_cursor_read_more_failed( cursor );
+
+    if( cursor->spare->head.responseTo != cursor->more_id ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, "Unexpected reply to getMore.", 0 );
+        return mongo_cursor_read_more_failed( cursor );
+    }
+
+    return MONGO_OK;
+}
+
+/* Make the prefetched batch current, keeping the old one as the spare. */
+static int mongo_cursor_take_more( mongo_cursor *cursor ) {
+    mongo_reply *reply;
+    int size;
+    int64_t wanted = mongo_env_clock_usec();
+
+    if( ( cursor->flags & MONGO_CURSOR_MORE_SENT ) &&
+        mongo_cursor_read_more( cursor ) != MONGO_OK ) {
+        cursor->flags &= ~MONGO_CURSOR_MORE_READ;
+        return MONGO_ERROR;
+    }
+
+    cursor->flags &= ~MONGO_CURSOR_MORE_READ;
+    if( ! cursor->spare ) {
+        cursor->err = MONGO_CURSOR_INVALID;
+        return MONGO_ERROR;
+    }
+
+    reply = cursor->reply;
+    size = cursor->reply_size;
+    cursor->reply = cursor->spare;
+    cursor->reply_size = cursor->spare_size;
+    cursor->spare = reply;
+    cursor->spare_size = size;
+
+    cursor->current.data = NULL;
+    cursor->seen += cursor->reply->fields.num;
+    mongo_cursor_batch_arrived( cursor, wanted );
+
+    return MONGO_OK;
+}
+
+/* Read the next batch pushed by the server for an exhaust cursor. Each
+ * reply answers the one before it, as if it were a getMore. */
+static int mongo_cursor_read_streamed( mongo_cursor *cursor ) {
+    mongo *conn = cursor->conn;
+    int previous_id = cursor->reply->head.id;
+
+    /* The stream was cut short by a disconnect. */
+    if( !( cursor->flags & MONGO_CURSOR_STREAMING ) ) {
+        cursor->err = MONGO_CURSOR_INVALID;
+        return MONGO_ERROR;
+    }
+
+    if( mongo_read_response_into( conn, &cursor->reply, &cursor->reply_size ) != MONGO_OK ) {
+        mongo_disconnect( conn );
+        return MONGO_ERROR;
+    }
+
+    if( cursor->reply->head.responseTo != previous_id ) {
+        mongo_disconnect( conn );
+        __mongo_set_error( conn, MONGO_IO_ERROR, "Unexpected reply in exhaust stream.", 0 );
+        cursor->err = MONGO_CURSOR_INVALID;
+        return MONGO_ERROR;
+    }
+
+    if( ! cursor->reply->fields.cursorID ) {
+        cursor->flags &= ~MONGO_CURSOR_STREAMING;
+        conn->streaming_cursor = NULL;
+    }
+
+    cursor->current.data = NULL;
+    cursor->seen += cursor->reply->fields.num;
+
     return MONGO_OK;
 }
 
+/* Send the next getMore early once half of the current batch is used. */
+static void mongo_cursor_prefetch( mongo_cursor *cursor, const char *position ) {
+    mongo_reply *reply = cursor->reply;
+
+    if( !( cursor->flags & MONGO_CURSOR_PREFETCH ) ||
+        ( cursor->flags & ( MONGO_CURSOR_MORE_SENT | MONGO_CURSOR_MORE_READ ) ) ||
+        ( cursor->options & ( MONGO_TAILABLE | MONGO_EXHAUST ) ) ||
+        cursor->conn->pending_cursor ||
+        ! cursor->conn->connected ||
+        ! reply->fields.cursorID ||
+        ( cursor->limit > 0 && cursor->seen >= cursor->limit ) )
+        return;
+
+    if( position - &reply->objs < ( int )( reply->head.len - 16 - 20 ) / 2 )
+        return;
+
+    if( mongo_cursor_send_get_more( cursor, &cursor->more_id ) != MONGO_OK )
+        return;
+
+    cursor->flags |= MONGO_CURSOR_MORE_SENT;
+    cursor->conn->pending_cursor = cursor;
+}
+
 static int mongo_cursor_get_more( mongo_cursor *cursor ) {
     int res;
 
@@ -1241,37 +2722,25 @@ static int mongo_cursor_get_more( mongo_cursor *cursor ) {
         cursor->err = MONGO_CURSOR_EXHAUSTED;
         return MONGO_ERROR;
     }
-    else {
-        char *data;
-        size_t sl = strlen( cursor->ns )+1;
-        int limit = 0;
-        mongo_message *mm;
-
-        if( cursor->limit > 0 )
-            limit = cursor->limit - cursor->seen;
-
-        mm = mongo_message_create( 16 /*header*/
-                                   +4 /*ZERO*/
-                                   +sl
-                                   +4 /*numToReturn*/
-                                   +8 /*cursorID*/
-                                   , 0, 0, MONGO_OP_GET_MORE );
-        if( mm == NULL ) {
+    else if( cursor->options & MONGO_EXHAUST ) {
+        return mongo_cursor_read_streamed( cursor );
+    }
+    else if( cursor->flags & ( MONGO_CURSOR_MORE_SENT | MONGO_CURSOR_MORE_READ ) ) {
+        if( mongo_cursor_take_more( cursor ) != MONGO_OK ) {
+            cursor->err = MONGO_CURSOR_INVALID;
             return MONGO_ERROR;
         }
+        return MONGO_OK;
+    }
+    /* The cursor went with the socket it was opened on. */
+    else if( ! cursor->conn->connected ) {
+        cursor->err = MONGO_CURSOR_INVALID;
+        return MONGO_ERROR;
+    }
+    else {
+        int64_t sent = mongo_env_clock_usec();
 
-        data = &mm->data;
-        data = mongo_data_append32( data, &ZERO );
-        data = mongo_data_append( data, cursor->ns, sl );
-        data = mongo_data_append32( data, &limit );
-        mongo_data_append64( data, &cursor->reply->fields.cursorID );
-
-        if( cursor->reply )
-        {
-          bson_free( cursor->reply );
-          cursor->reply = NULL;
-        }
-        res = mongo_message_send( cursor->conn, mm );
+        res = mongo_cursor_send_get_more( cursor, NULL );
         if( res != MONGO_OK ) {
             /* Commented destruction of cursor if it fails on attempt to retrieve more. User of the cursor "on the other side"
                is keeping track of it and must free it when done */
@@ -1279,12 +2748,14 @@ static int mongo_cursor_get_more( mongo_cursor *cursor ) {
             return MONGO_ERROR;
         }
 
-        res = mongo_read_response( cursor->conn, &( cursor->reply ) );
+        /* The old reply's buffer receives the next batch. */
+        res = mongo_read_response_into( cursor->conn, &cursor->reply, &cursor->reply_size );
         if( res != MONGO_OK )
             return MONGO_ERROR;
 
         cursor->current.data = NULL;
         cursor->seen += cursor->reply->fields.num;
+        mongo_cursor_batch_arrived( cursor, sent );
 
         return MONGO_OK;
     }
@@ -1355,6 +2826,21 @@ MONGO_EXPORT void mongo_cursor_set_limit( mongo_cursor *cursor, int limit ) {
     cursor->limit = limit;
 }
 
+MONGO_EXPORT void mongo_cursor_set_batch_size( mongo_cursor *cursor, int batch_size ) {
+    cursor->batch_size = batch_size;
+}
+
+MONGO_EXPORT void mongo_cursor_set_max_batch_size( mongo_cursor *cursor, int max_batch_size ) {
+    cursor->max_batch_size = max_batch_size;
+}
+
+MONGO_EXPORT void mongo_cursor_set_prefetch( mongo_cursor *cursor, int prefetch ) {
+    if( prefetch )
+        cursor->flags |= MONGO_CURSOR_PREFETCH;
+    else
+        cursor->flags &= ~MONGO_CURSOR_PREFETCH;
+}
+
 MONGO_EXPORT void mongo_cursor_set_options( mongo_cursor *cursor, int options ) {
     cursor->options = options;
 }
@@ -1367,6 +2853,12 @@ MONGO_EXPORT const bson *mongo_cursor_bson( mongo_cursor *cursor ) {
     return (const bson *)&(cursor->current);
 }
 
+/* Point current at data, freeing any index built on the previous document. */
+static void mongo_cursor_set_current( mongo_cursor *cursor, char *data ) {
+    bson_destroy( &cursor->current );
+    bson_init_finished_data( &cursor->current, data, 0 );
+}
+
 MONGO_EXPORT int mongo_cursor_next( mongo_cursor *cursor ) {
     char *next_object;
     char *message_end;
@@ -1403,7 +2895,8 @@ MONGO_EXPORT int mongo_cursor_next( mongo_cursor *cursor ) {
 
     /* first */
     if ( cursor->current.data == NULL ) {
-        bson_init_finished_data( &cursor->current, &cursor->reply->objs, 0 );
+        mongo_cursor_set_current( cursor, &cursor->reply->objs );
+        mongo_cursor_prefetch( cursor, cursor->current.data );
         return MONGO_OK;
     }
 
@@ -1424,41 +2917,40 @@ MONGO_EXPORT int mongo_cursor_next( mongo_cursor *cursor ) {
                 return MONGO_ERROR;
         }
 
-        bson_init_finished_data( &cursor->current, &cursor->reply->objs, 0 );
+        mongo_cursor_set_current( cursor, &cursor->reply->objs );
     }
     else {
-        bson_init_finished_data( &cursor->current, next_object, 0 );
+        mongo_cursor_set_current( cursor, next_object );
     }
 
+    mongo_cursor_prefetch( cursor, cursor->current.data );
     return MONGO_OK;
 }
 
 MONGO_EXPORT int mongo_cursor_destroy( mongo_cursor *cursor ) {
     int result = MONGO_OK;
-    char *data;
 
     if ( !cursor ) return result;
 
-    /* Kill cursor if live. */
-    if ( cursor->reply && cursor->reply->fields.cursorID ) {
-        mongo *conn = cursor->conn;
-        mongo_message *mm = mongo_message_create( 16 /*header*/
-                            +4 /*ZERO*/
-                            +4 /*numCursors*/
-                            +8 /*cursorID*/
-                            , 0, 0, MONGO_OP_KILL_CURSORS );
-        if( mm == NULL ) {
-            return MONGO_ERROR;
-        }
-        data = &mm->data;
-        data = mongo_data_append32( data, &ZERO );
-        data = mongo_data_append32( data, &ONE );
-        mongo_data_append64( data, &cursor->reply->fields.cursorID );
+    /* Free an index the caller built on the current document. */
+    bson_destroy( &cursor->current );
+
+    /* Take a prefetched batch off the connection; it may close the cursor. */
+    if ( cursor->flags & ( MONGO_CURSOR_MORE_SENT | MONGO_CURSOR_MORE_READ ) )
+        mongo_cursor_take_more( cursor );
+
+    /* An exhaust stream can only be stopped by closing the socket. */
+    if ( cursor->flags & MONGO_CURSOR_STREAMING ) {
+        mongo_disconnect( cursor->conn );
+    }
 
-        result = mongo_message_send( conn, mm );
+    /* Kill cursor if live and its connection is still open. */
+    else if ( cursor->reply && cursor->reply->fields.cursorID && cursor->conn->connected ) {
+        result = mongo_send_kill_cursor( cursor->conn, cursor->reply->fields.cursorID, NULL );
     }
 
     if( cursor->reply ) bson_free( cursor->reply );
+    if( cursor->spare ) bson_free( cursor->spare );
     bson_free( ( void * )cursor->ns );
 
     if( cursor->flags & MONGO_CURSOR_MUST_FREE )
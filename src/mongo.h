@@ -67,7 +67,10 @@ typedef enum mongo_error_t {
     MONGO_BSON_INVALID,      /**< BSON not valid for the specified op. */
     MONGO_BSON_NOT_FINISHED, /**< BSON object has not been finished. */
     MONGO_BSON_TOO_LARGE,    /**< BSON object exceeds max BSON size. */
-    MONGO_WRITE_CONCERN_INVALID /**< Supplied write concern object is invalid. */
+    MONGO_WRITE_CONCERN_INVALID, /**< Supplied write concern object is invalid. */
+    MONGO_CONN_BUSY,         /**< The connection is streaming an exhaust cursor. */
+    MONGO_CONN_NONBLOCKING,  /**< The operation does not match the connection's blocking mode. */
+    MONGO_CONN_NO_MEMBER     /**< No replica set member is available for the read preference. */
 } mongo_error_t;
 
 typedef enum mongo_cursor_error_t {
@@ -82,7 +85,16 @@ typedef enum mongo_cursor_error_t {
 
 enum mongo_cursor_flags {
     MONGO_CURSOR_MUST_FREE = 1,      /**< mongo_cursor_destroy should free cursor. */
-    MONGO_CURSOR_QUERY_SENT = ( 1<<1 ) /**< Initial query has been sent. */
+    MONGO_CURSOR_QUERY_SENT = ( 1<<1 ), /**< Initial query has been sent. */
+    MONGO_CURSOR_PREFETCH = ( 1<<2 ),  /**< Request each batch before the previous one is used up. */
+    MONGO_CURSOR_MORE_SENT = ( 1<<3 ), /**< A prefetch getMore is waiting to be read. */
+    MONGO_CURSOR_MORE_READ = ( 1<<4 ), /**< A prefetched batch is waiting in the spare buffer. */
+    MONGO_CURSOR_STREAMING = ( 1<<5 )  /**< The server is still streaming exhaust batches. */
+};
+
+enum mongo_async_want {
+    MONGO_WANT_READ = ( 1<<0 ),  /**< Replies are outstanding; wait until the socket is readable. */
+    MONGO_WANT_WRITE = ( 1<<1 )  /**< Messages are queued; wait until the socket is writable. */
 };
 
 enum mongo_index_opts {
@@ -111,6 +123,14 @@ enum mongo_cursor_opts {
     MONGO_PARTIAL = ( 1<<7 )          /**< Allow reads even if a shard is down. */
 };
 
+typedef enum mongo_read_preference {
+    MONGO_READ_PRIMARY = 0,           /**< Read from the primary only. */
+    MONGO_READ_PRIMARY_PREFERRED,     /**< Read from the primary, or a secondary when there is none. */
+    MONGO_READ_SECONDARY,             /**< Read from secondaries only. */
+    MONGO_READ_SECONDARY_PREFERRED,   /**< Read from a secondary, or the primary when there is none. */
+    MONGO_READ_NEAREST                /**< Read from any member. */
+} mongo_read_preference;
+
 enum mongo_operations {
     MONGO_OP_MSG = 1000,
     MONGO_OP_UPDATE = 2001,
@@ -152,6 +172,11 @@ typedef struct mongo_host_port {
     char host[MAXHOSTNAMELEN];
     int port;
     struct mongo_host_port *next;
+    int64_t rtt_usec;          /**< isMaster round trip time, averaged with mongo_host_port_record_rtt(). */
+    int rtt_samples;           /**< Round trips averaged into rtt_usec. */
+    bson_bool_t is_primary;    /**< Replica set host reported itself primary. */
+    bson_bool_t is_secondary;  /**< Replica set host reported itself secondary. */
+    struct mongo *member;      /**< Read connection to a secondary, freed only by mongo_destroy( ) as cursors may hold it. */
 } mongo_host_port;
 
 typedef struct mongo_write_concern {
@@ -164,13 +189,42 @@ typedef struct mongo_write_concern {
     bson *cmd; /**< The BSON object representing the getlasterror command. */
 } mongo_write_concern;
 
+#define MONGO_DEFAULT_LATENCY_WINDOW_MS 15
+
 typedef struct {
     mongo_host_port *seeds;        /**< List of seeds provided by the user. */
     mongo_host_port *hosts;        /**< List of host/ports given by the replica set */
+    mongo_host_port *retired;      /**< Hosts dropped from the list, kept for their closed member connections. */
     char *name;                    /**< Name of the replica set. */
     bson_bool_t primary_connected; /**< Primary node connection status. */
+    mongo_read_preference read_preference; /**< Where queries are sent. */
+    int latency_window_ms;         /**< Members this much slower than the nearest one are not read from. */
+    unsigned int next_read;        /**< Spreads reads over the members in the latency window. */
 } mongo_replica_set;
 
+/**
+ * Outcome of a batch insert that may span several wire messages.
+ */
+typedef struct {
+    int messages;     /**< Number of OP_INSERT messages sent. */
+    int failed;       /**< Number of messages acknowledged with an error. */
+    int first_failed; /**< Index of the first document of the first failed message, or -1. */
+} mongo_batch_result;
+
+/**
+ * Buffers of a connection in non-blocking mode.
+ */
+typedef struct {
+    char *out;    /**< Messages queued for sending. */
+    int out_pos;  /**< Bytes of out already written. */
+    int out_len;  /**< Bytes queued in out. */
+    int out_size; /**< Allocated size of out. */
+    char *in;     /**< Bytes received but not yet returned as replies. */
+    int in_len;   /**< Bytes held in in. */
+    int in_size;  /**< Allocated size of in. */
+    int pending;  /**< Queries and getMores still waiting for their reply. */
+} mongo_async;
+
 typedef struct mongo {
     mongo_host_port *primary;  /**< Primary connection info. */
     mongo_replica_set *replica_set;    /**< replica_set object if connected to a replica set. */
@@ -179,8 +233,15 @@ typedef struct mongo {
     int conn_timeout_ms;       /**< Connection timeout in milliseconds. */
     int op_timeout_ms;         /**< Read and write timeout in milliseconds. */
     int max_bson_size;         /**< Largest BSON object allowed on this connection. */
+    int max_message_size;      /**< Largest wire message allowed on this connection. */
     bson_bool_t connected;     /**< Connection status. */
     mongo_write_concern *write_concern; /**< The default write concern. */
+    char *read_buf;            /**< Bytes read from the socket ahead of use. */
+    int read_pos;              /**< Offset of the first unconsumed byte in read_buf. */
+    int read_len;              /**< Number of valid bytes in read_buf. */
+    struct mongo_cursor *pending_cursor; /**< Cursor whose prefetched reply is still unread. */
+    struct mongo_cursor *streaming_cursor; /**< Exhaust cursor that owns the socket. */
+    mongo_async *async;        /**< Non-blocking buffers, or NULL in blocking mode. */
 
     mongo_error_t err;          /**< Most recent driver error code. */
     int errcode;                /**< Most recent errno or WSAGetLastError(). */
@@ -189,8 +250,12 @@ typedef struct mongo {
     char lasterrstr[MONGO_ERR_LEN]; /**< getlasterror string from the server. */
 } mongo;
 
-typedef struct {
+typedef struct mongo_cursor {
     mongo_reply *reply;  /**< reply is owned by cursor */
+    int reply_size;      /**< Allocated size of reply. */
+    mongo_reply *spare;  /**< Buffer kept for the next reply; owned by cursor */
+    int spare_size;      /**< Allocated size of spare. */
+    int more_id;         /**< Request id of the outstanding prefetch getMore. */
     mongo *conn;       /**< connection is *not* owned by cursor */
     const char *ns;    /**< owned by cursor */
     int flags;         /**< Flags used internally by this drivers. */
@@ -202,8 +267,33 @@ typedef struct {
     int options;       /**< Bitfield containing cursor options. */
     int limit;         /**< Bitfield containing cursor options. */
     int skip;          /**< Bitfield containing cursor options. */
+    int batch_size;     /**< Documents to ask for per batch; 0 lets the server choose. */
+    int max_batch_size; /**< Ceiling for adaptive batch growth; 0 disables it. */
+    int64_t batch_start; /**< When the current batch arrived, in microseconds. */
+    int64_t batch_wait;  /**< How long the current batch took to arrive. */
 } mongo_cursor;
 
+/* Upper bound on unread acknowledgements in a write session. Replies
+ * that pile up unread could otherwise fill the socket buffers. */
+#define MONGO_WRITE_SESSION_MAX_PENDING 512
+
+/**
+ * A write session sends writes back to back and reads their
+ * getLastError replies in bulk, instead of once per write.
+ */
+typedef struct {
+    mongo *conn;          /**< connection is *not* owned by the session */
+    mongo_write_concern *write_concern; /**< custom write concern, or NULL for the connection's. */
+    int flush_every;      /**< Read acknowledgements after this many writes. */
+    int *pending;         /**< Outstanding getLastError request ids and write indexes. */
+    int pending_count;    /**< Number of outstanding acknowledgements. */
+    int writes;           /**< Number of writes sent so far. */
+    int failed;           /**< Number of writes acknowledged with an error. */
+    int first_failed;     /**< Index of the first failed write, or -1. */
+    int lasterrcode;      /**< getlasterror code of the first failed write. */
+    char lasterrstr[MONGO_ERR_LEN]; /**< getlasterror string of the first failed write. */
+} mongo_write_session;
+
 /*********************************************************************
 Connection API
 **********************************************************************/
@@ -236,6 +326,20 @@ MONGO_EXPORT void mongo_init( mongo *conn );
  */
 MONGO_EXPORT int mongo_client( mongo *conn , const char *host, int port );
 
+/**
+ * Connect a mongo object already set up by mongo_init() to a single
+ * MongoDB server. Unlike mongo_client(), keeps settings made on the object
+ * beforehand, such as the connect timeout.
+ *
+ * @param conn a mongo object, freshly initialized.
+ * @param host a numerical network address or a network hostname.
+ * @param port the port to connect to.
+ *
+ * @return MONGO_OK or MONGO_ERROR on failure. On failure, a constant of type
+ *   mongo_error_t will be set on the conn->err field.
+ */
+MONGO_EXPORT int mongo_client_connect( mongo *conn , const char *host, int port );
+
 /**
  * DEPRECATED - use mongo_client.
  * Connect to a single MongoDB server.
@@ -324,6 +428,37 @@ MONGO_EXPORT int mongo_validate_ns( mongo *conn, const char *ns );
  */
 MONGO_EXPORT int mongo_replica_set_client( mongo *conn );
 
+/**
+ * Choose where queries on a replica set connection are sent. Unless the
+ * preference is MONGO_READ_PRIMARY, mongo_replica_set_client() keeps a
+ * connection open to every secondary as well as the primary. Each query
+ * then goes to one of the eligible members whose isMaster round trip was
+ * within latency_window_ms of the fastest eligible member, in turn, and is
+ * sent with MONGO_SLAVE_OK. Commands and writes always go to the primary.
+ *
+ * A cursor keeps the member it started on; errors from it are set on
+ * cursor->conn. Call before mongo_replica_set_client().
+ *
+ * @param conn a mongo object set up with mongo_replica_set_init().
+ * @param read_preference the members reads may go to.
+ * @param latency_window_ms how much slower than the nearest member another
+ *     one may be and still take reads.
+ */
+MONGO_EXPORT void mongo_replica_set_set_read_preference( mongo *conn, mongo_read_preference read_preference,
+        int latency_window_ms );
+
+/**
+ * The connection the next query on conn should use under its read
+ * preference: conn itself for a single server or MONGO_READ_PRIMARY, a
+ * secondary's connection otherwise.
+ *
+ * @param conn a mongo object.
+ *
+ * @return the connection, or NULL with conn->err set to MONGO_CONN_NO_MEMBER
+ *     if no member is eligible.
+ */
+MONGO_EXPORT mongo *mongo_replica_set_read_target( mongo *conn );
+
 /**
  * DEPRECATED - use mongo_replica_set_client.
  * Connect to a replica set.
@@ -350,6 +485,17 @@ MONGO_EXPORT int mongo_replset_connect( mongo *conn );
  */
 MONGO_EXPORT int mongo_set_op_timeout( mongo *conn, int millis );
 
+/** Set a timeout for establishing TCP connections. Takes effect on the
+ *  next connect, so call it after mongo_init() or mongo_replica_set_init()
+ *  and before connecting. Ignored by the standard env.
+ *
+ *  @param conn a mongo object.
+ *  @param millis timeout time in milliseconds, 0 for the system default.
+ *
+ *  @return MONGO_OK.
+ */
+MONGO_EXPORT int mongo_set_connect_timeout( mongo *conn, int millis );
+
 /**
  * Ensure that this connection is healthy by performing
  * a round-trip to the server.
@@ -360,6 +506,35 @@ MONGO_EXPORT int mongo_set_op_timeout( mongo *conn, int millis );
  */
 MONGO_EXPORT int mongo_check_connection( mongo *conn );
 
+/* Weight of a new round trip in the moving average, in percent. */
+#define MONGO_RTT_WEIGHT 20
+
+/**
+ * Fold a round trip time into a host's exponentially weighted moving
+ * average. The first sample is taken as is.
+ *
+ * @param host_port the host.
+ * @param rtt_usec the round trip, in microseconds.
+ */
+MONGO_EXPORT void mongo_host_port_record_rtt( mongo_host_port *host_port, int64_t rtt_usec );
+
+/**
+ * Run isMaster on every connection of this object to refresh the hosts'
+ * round trip times: the server, or the primary and each secondary read
+ * connection of a replica set. Secondaries that fail, or are no longer
+ * secondaries, lose their read connection. When reads may go to
+ * secondaries, the other hosts without one, such as those that were slow
+ * to answer on connect, are probed in parallel and join if they answer as
+ * secondaries.
+ * Connecting records a first round trip per host, and this is meant to be
+ * called periodically afterwards.
+ *
+ * @param conn a mongo connection.
+ *
+ * @return MONGO_OK if the server or primary answered; otherwise, MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_refresh_rtt( mongo *conn );
+
 /**
  * Try reconnecting to the server using the existing connection settings.
  *
@@ -472,6 +647,32 @@ MONGO_EXPORT int mongo_insert_batch( mongo *conn, const char *ns,
                                      const bson **data, int num, mongo_write_concern *custom_write_concern,
                                      int flags );
 
+/**
+ * Insert a batch of BSON documents, reporting how the batch was sent.
+ *
+ * Batches larger than the server's message size limit are split into
+ * several OP_INSERT messages. Without MONGO_CONTINUE_ON_ERROR, each message
+ * is acknowledged before the next is sent, so the batch stops at the first
+ * failure. With MONGO_CONTINUE_ON_ERROR, all messages and their
+ * getLastError requests are pipelined and the replies are read at the end.
+ * conn->lasterrstr holds the first server error.
+ *
+ * @param conn a mongo object.
+ * @param ns the namespace.
+ * @param data the bson data.
+ * @param num the number of documents in data.
+ * @param custom_write_concern a write concern object that will
+ *     override any write concern set on the conn object.
+ * @param flags 0 or MONGO_CONTINUE_ON_ERROR.
+ * @param result if not NULL, filled in with per-message results.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_insert_batch_with_result( mongo *conn, const char *ns,
+                                                 const bson **data, int num,
+                                                 mongo_write_concern *custom_write_concern,
+                                                 int flags, mongo_batch_result *result );
+
 /**
  * Update a document in a MongoDB server.
  *
@@ -507,6 +708,234 @@ MONGO_EXPORT int mongo_update( mongo *conn, const char *ns, const bson *cond,
 MONGO_EXPORT int mongo_remove( mongo *conn, const char *ns, const bson *cond,
                                mongo_write_concern *custom_write_concern );
 
+/*********************************************************************
+Write session API
+**********************************************************************/
+
+/**
+ * Start a write session on a connection.
+ *
+ * Writes made through the session are sent immediately, each followed
+ * by a getLastError request, but the replies are only read every
+ * flush_every writes or when the session is synced. As with
+ * MONGO_CONTINUE_ON_ERROR, a failed write does not stop the writes
+ * queued after it. The connection must not be used for anything else
+ * until the session has been synced.
+ *
+ * @param session the session to initialize.
+ * @param conn a mongo object.
+ * @param custom_write_concern a write concern object that will
+ *     override any write concern set on the conn object.
+ * @param flush_every how many writes to send before reading their
+ *     acknowledgements. 0 means MONGO_WRITE_SESSION_MAX_PENDING, which
+ *     is also the cap: replies are read at least that often even if
+ *     the session is never synced.
+ */
+MONGO_EXPORT void mongo_write_session_init( mongo_write_session *session, mongo *conn,
+                                            mongo_write_concern *custom_write_concern,
+                                            int flush_every );
+
+/**
+ * Insert a document as part of a write session.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the document could not be sent.
+ *     Write errors reported by the server surface on sync.
+ */
+MONGO_EXPORT int mongo_write_session_insert( mongo_write_session *session, const char *ns,
+                                             const bson *data );
+
+/**
+ * Update documents as part of a write session.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the update could not be sent.
+ */
+MONGO_EXPORT int mongo_write_session_update( mongo_write_session *session, const char *ns,
+                                             const bson *cond, const bson *op, int flags );
+
+/**
+ * Remove documents as part of a write session.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the remove could not be sent.
+ */
+MONGO_EXPORT int mongo_write_session_remove( mongo_write_session *session, const char *ns,
+                                             const bson *cond );
+
+/**
+ * Read every outstanding acknowledgement.
+ *
+ * @return MONGO_OK if no write in the session has failed so far.
+ *     Otherwise MONGO_ERROR, with the first server error stored in the
+ *     conn object and session->first_failed set to the index of that write.
+ */
+MONGO_EXPORT int mongo_write_session_sync( mongo_write_session *session );
+
+/**
+ * Sync a write session and release its resources.
+ *
+ * @return the result of mongo_write_session_sync().
+ */
+MONGO_EXPORT int mongo_write_session_destroy( mongo_write_session *session );
+
+
+/*********************************************************************
+Wire API
+**********************************************************************/
+
+/**
+ * Send an OP_QUERY without waiting for its reply.
+ *
+ * These functions give direct access to the wire protocol, for callers
+ * that match replies to requests themselves. Request ids are unique
+ * within the process, so messages sent from several threads never
+ * share one.
+ *
+ * @param conn a mongo object.
+ * @param ns the namespace.
+ * @param query the query; may be NULL for all documents.
+ * @param fields fields to return; may be NULL for all fields.
+ * @param limit numberToReturn, as for mongo_find().
+ * @param skip number of documents to skip.
+ * @param options a bitfield of mongo_cursor_opts.
+ * @param request_id set to the id that the reply's head.responseTo will carry.
+ * @param err if not NULL, set to the error on failure. Unlike conn->err it
+ *     cannot be overwritten by another thread reading from conn.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_send_query( mongo *conn, const char *ns, const bson *query,
+                                   const bson *fields, int limit, int skip, int options,
+                                   int *request_id, mongo_error_t *err );
+
+/**
+ * Send an OP_GET_MORE without waiting for its reply.
+ *
+ * @param conn a mongo object.
+ * @param ns the namespace of the original query.
+ * @param cursor_id the cursorID from the previous reply.
+ * @param limit numberToReturn; 0 lets the server choose.
+ * @param request_id set to the id that the reply's head.responseTo will carry.
+ * @param err if not NULL, set to the error on failure.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_send_get_more( mongo *conn, const char *ns, int64_t cursor_id,
+                                      int limit, int *request_id, mongo_error_t *err );
+
+/**
+ * Tell the server to close a cursor. There is no reply.
+ *
+ * @param conn a mongo object.
+ * @param cursor_id the cursorID to close.
+ * @param err if not NULL, set to the error on failure.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_send_kill_cursor( mongo *conn, int64_t cursor_id, mongo_error_t *err );
+
+/**
+ * Read the next reply from the socket, whichever request it answers.
+ *
+ * @param conn a mongo object in blocking mode.
+ * @param reply set to a reply the caller must release with bson_free().
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_read_reply( mongo *conn, mongo_reply **reply );
+
+/*********************************************************************
+Non-blocking API
+**********************************************************************/
+
+/**
+ * Switch a connected mongo object between blocking and non-blocking mode.
+ *
+ * In non-blocking mode, every message is queued on the connection
+ * instead of being written at once. This includes the messages sent by
+ * the CRUD functions and by mongo_cursor_destroy(). Nothing on the
+ * connection waits for a reply. Requests are made with
+ * mongo_async_query() and mongo_async_get_more(). Queued bytes are
+ * written by mongo_async_flush(), and replies are collected with
+ * mongo_async_read_reply(). Use mongo_get_socket() and
+ * mongo_async_want() to drive all of this from an event loop. Functions
+ * that wait for a reply, such as commands, cursors and acknowledged
+ * writes, fail with MONGO_CONN_NONBLOCKING. A reconnect puts the
+ * connection back in blocking mode.
+ *
+ * @param conn a connected mongo object.
+ * @param nonblocking non-zero for non-blocking mode.
+ *
+ * @return MONGO_OK or MONGO_ERROR. Leaving non-blocking mode fails with
+ *     MONGO_CONN_NONBLOCKING while messages or replies are outstanding.
+ */
+MONGO_EXPORT int mongo_set_nonblocking( mongo *conn, int nonblocking );
+
+/**
+ * Report what a non-blocking connection is waiting for.
+ *
+ * @param conn a mongo object.
+ *
+ * @return a combination of MONGO_WANT_READ and MONGO_WANT_WRITE, or 0
+ *     when nothing is queued or outstanding.
+ */
+MONGO_EXPORT int mongo_async_want( mongo *conn );
+
+/**
+ * Queue an OP_QUERY on a non-blocking connection.
+ *
+ * @param conn a mongo object in non-blocking mode.
+ * @param ns the namespace.
+ * @param query the query; may be NULL for all documents.
+ * @param fields fields to return; may be NULL for all fields.
+ * @param limit numberToReturn, as for mongo_find().
+ * @param skip number of documents to skip.
+ * @param options a bitfield of mongo_cursor_opts.
+ * @param request_id set to the id that the reply's head.responseTo will carry.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_async_query( mongo *conn, const char *ns, const bson *query,
+                                    const bson *fields, int limit, int skip, int options,
+                                    int *request_id );
+
+/**
+ * Queue an OP_GET_MORE on a non-blocking connection.
+ *
+ * @param conn a mongo object in non-blocking mode.
+ * @param ns the namespace of the original query.
+ * @param cursor_id the cursorID from the previous reply.
+ * @param limit numberToReturn; 0 lets the server choose.
+ * @param request_id set to the id that the reply's head.responseTo will carry.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_async_get_more( mongo *conn, const char *ns, int64_t cursor_id,
+                                       int limit, int *request_id );
+
+/**
+ * Write as much of the queued messages as the socket accepts.
+ *
+ * @param conn a mongo object in non-blocking mode.
+ *
+ * @return MONGO_OK, even if some bytes remain queued (see
+ *     mongo_async_want()), or MONGO_ERROR if the socket failed.
+ */
+MONGO_EXPORT int mongo_async_flush( mongo *conn );
+
+/**
+ * Read whatever the socket has and return the next complete reply.
+ *
+ * Replies arrive in the order their requests were queued. Match them to
+ * requests through head.responseTo.
+ *
+ * @param conn a mongo object in non-blocking mode.
+ * @param reply set to a reply the caller must release with bson_free(),
+ *     or to NULL if no complete reply has arrived yet.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the socket failed or a reply was
+ *     malformed.
+ */
+MONGO_EXPORT int mongo_async_read_reply( mongo *conn, mongo_reply **reply );
+
 
 /*********************************************************************
 Write Concern API
@@ -603,6 +1032,32 @@ MONGO_EXPORT void mongo_cursor_set_skip( mongo_cursor *cursor, int skip );
  */
 MONGO_EXPORT void mongo_cursor_set_limit( mongo_cursor *cursor, int limit );
 
+/**
+ * Set the number of documents to ask for in each batch.
+ *
+ * Small batches return the first documents quickly. Large batches make
+ * bulk scans take fewer round trips. The server still caps each reply by
+ * size. A batch size of 1 is sent as 2 on the initial query, because the
+ * server treats 1 there as a limit.
+ *
+ * @param cursor
+ * @param batch_size documents per batch; 0 lets the server choose.
+ */
+MONGO_EXPORT void mongo_cursor_set_batch_size( mongo_cursor *cursor, int batch_size );
+
+/**
+ * Let the batch size grow while the caller keeps up with the server.
+ *
+ * Whenever the caller gets through a batch faster than that batch took
+ * to arrive, the next getMore asks for twice as many documents, up to
+ * max_batch_size. Growth starts from the batch size, or from the size
+ * of the server's first batch if none was set.
+ *
+ * @param cursor
+ * @param max_batch_size largest batch to ask for; 0 disables growth.
+ */
+MONGO_EXPORT void mongo_cursor_set_max_batch_size( mongo_cursor *cursor, int max_batch_size );
+
 /**
  * Set any of the available query options (e.g., MONGO_TAILABLE).
  *
@@ -612,6 +1067,20 @@ MONGO_EXPORT void mongo_cursor_set_limit( mongo_cursor *cursor, int limit );
  */
 MONGO_EXPORT void mongo_cursor_set_options( mongo_cursor *cursor, int options );
 
+/**
+ * Enable or disable read-ahead on a cursor.
+ *
+ * With read-ahead on, the getMore for the next batch is sent once half of
+ * the current batch has been returned. The next batch travels while the
+ * current one is still being used, and is read into a second buffer when
+ * the current batch runs out. Other operations on the same connection can
+ * still be used. They first read the outstanding batch off the socket.
+ *
+ * @param cursor
+ * @param prefetch non-zero to enable read-ahead.
+ */
+MONGO_EXPORT void mongo_cursor_set_prefetch( mongo_cursor *cursor, int prefetch );
+
 /**
  * Return the current BSON object data as a const char*. This is useful
  * for creating bson iterators with bson_iterator_init.
@@ -903,6 +1372,8 @@ MONGO_EXPORT const char* mongo_get_primary(mongo* conn);
 MONGO_EXPORT SOCKET mongo_get_socket(mongo* conn) ;
 MONGO_EXPORT int mongo_get_host_count(mongo* conn);
 MONGO_EXPORT const char* mongo_get_host(mongo* conn, int i);
+MONGO_EXPORT int64_t mongo_get_primary_rtt(mongo* conn);
+MONGO_EXPORT int64_t mongo_get_host_rtt(mongo* conn, int i);
 MONGO_EXPORT mongo_write_concern* mongo_write_concern_alloc( void );
 MONGO_EXPORT void mongo_write_concern_dealloc(mongo_write_concern* write_concern);
 MONGO_EXPORT mongo_cursor* mongo_cursor_alloc( void );
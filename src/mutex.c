@@ -0,0 +1,141 @@
+#include "mutex.h"
+#include "spin_lock.h"
+
+#ifndef _MSC_VER
+  #include <errno.h>
+  #include <sys/time.h>
+#endif
+
+/* Attempts to take a contended lock before sleeping. Pool and mux critical
+ * sections are a few stores long, so the owner usually lets go well within
+ * this and the waiter avoids a trip through the kernel. */
+#define MONGO_MUTEX_SPINS 100
+
+void mongo_mutex_init( mongo_mutex *_this ) {
+#ifdef _MSC_VER
+    InitializeCriticalSectionAndSpinCount( _this, MONGO_MUTEX_SPINS * 40 );
+#else
+    pthread_mutex_init( _this, NULL );
+#endif
+}
+
+void mongo_mutex_destroy( mongo_mutex *_this ) {
+#ifdef _MSC_VER
+    DeleteCriticalSection( _this );
+#else
+    pthread_mutex_destroy( _this );
+#endif
+}
+
+void mongo_mutex_lock( mongo_mutex *_this ) {
+#ifdef _MSC_VER
+    EnterCriticalSection( _this );
+#else
+    int spins;
+
+    for( spins = 0; spins < MONGO_MUTEX_SPINS; spins++ ) {
+        if( pthread_mutex_trylock( _this ) == 0 )
+            return;
+        crossPause();
+    }
+    pthread_mutex_lock( _this );
+#endif
+}
+
+void mongo_mutex_unlock( mongo_mutex *_this ) {
+#ifdef _MSC_VER
+    LeaveCriticalSection( _this );
+#else
+    pthread_mutex_unlock( _this );
+#endif
+}
+
+void mongo_cond_init( mongo_cond *_this ) {
+#ifdef _MSC_VER
+    InitializeConditionVariable( _this );
+#else
+    pthread_cond_init( _this, NULL );
+#endif
+}
+
+void mongo_cond_destroy( mongo_cond *_this ) {
+#ifndef _MSC_VER
+    pthread_cond_destroy( _this );
+#endif
+}
+
+void mongo_cond_wait( mongo_cond *_this, mongo_mutex *mutex ) {
+#ifdef _MSC_VER
+    SleepConditionVariableCS( _this, mutex, INFINITE );
+#else
+    pthread_cond_wait( _this, mutex );
+#endif
+}
+
+int mongo_cond_timedwait( mongo_cond *_this, mongo_mutex *mutex, int millis ) {
+#ifdef _MSC_VER
+    return !SleepConditionVariableCS( _this, mutex, ( DWORD )millis );
+#else
+    struct timeval now;
+    struct timespec deadline;
+
+    gettimeofday( &now, NULL );
+    deadline.tv_sec = now.tv_sec + millis / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + ( long )( millis % 1000 ) * 1000000;
+    if( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    return pthread_cond_timedwait( _this, mutex, &deadline ) == ETIMEDOUT;
+#endif
+}
+
+void mongo_cond_signal( mongo_cond *_this ) {
+#ifdef _MSC_VER
+    WakeConditionVariable( _this );
+#else
+    pthread_cond_signal( _this );
+#endif
+}
+
+void mongo_cond_broadcast( mongo_cond *_this ) {
+#ifdef _MSC_VER
+    WakeAllConditionVariable( _this );
+#else
+    pthread_cond_broadcast( _this );
+#endif
+}
+
+int mongo_tls_key_create( mongo_tls_key *_this, mongo_tls_destructor destructor ) {
+#ifdef _MSC_VER
+    *_this = FlsAlloc( destructor );
+    return *_this == FLS_OUT_OF_INDEXES;
+#else
+    return pthread_key_create( _this, destructor );
+#endif
+}
+
+void mongo_tls_key_delete( mongo_tls_key _this ) {
+#ifdef _MSC_VER
+    FlsFree( _this );
+#else
+    pthread_key_delete( _this );
+#endif
+}
+
+void *mongo_tls_get( mongo_tls_key _this ) {
+#ifdef _MSC_VER
+    return FlsGetValue( _this );
+#else
+    return pthread_getspecific( _this );
+#endif
+}
+
+void mongo_tls_set( mongo_tls_key _this, void *value ) {
+#ifdef _MSC_VER
+    FlsSetValue( _this, value );
+#else
+    pthread_setspecific( _this, value );
+#endif
+}
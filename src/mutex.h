@@ -0,0 +1,63 @@
+#ifndef MONGO_MUTEX_H_
+#define MONGO_MUTEX_H_
+
+#ifdef _MSC_VER
+  #include <windows.h>
+#else
+  #include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Blocking locks and condition variables, for code that waits on other
+ * threads for longer than a spin_lock should be held. mongo_mutex_lock spins
+ * briefly before it blocks. */
+
+#ifdef _MSC_VER
+typedef CRITICAL_SECTION mongo_mutex;
+typedef CONDITION_VARIABLE mongo_cond;
+#else
+typedef pthread_mutex_t mongo_mutex;
+typedef pthread_cond_t mongo_cond;
+#endif
+
+void mongo_mutex_init( mongo_mutex *_this );
+void mongo_mutex_destroy( mongo_mutex *_this );
+void mongo_mutex_lock( mongo_mutex *_this );
+void mongo_mutex_unlock( mongo_mutex *_this );
+
+void mongo_cond_init( mongo_cond *_this );
+void mongo_cond_destroy( mongo_cond *_this );
+void mongo_cond_wait( mongo_cond *_this, mongo_mutex *mutex );
+/* Returns 0 when woken, non-zero once millis have passed. */
+int mongo_cond_timedwait( mongo_cond *_this, mongo_mutex *mutex, int millis );
+void mongo_cond_signal( mongo_cond *_this );
+void mongo_cond_broadcast( mongo_cond *_this );
+
+/* Thread-local values. The destructor runs on thread exit for threads that
+ * hold a non-NULL value, and under Windows also for every such thread when
+ * the key is deleted. */
+
+#ifdef _MSC_VER
+typedef DWORD mongo_tls_key;
+#define MONGO_TLS_CALLBACK WINAPI
+#else
+typedef pthread_key_t mongo_tls_key;
+#define MONGO_TLS_CALLBACK
+#endif
+
+typedef void ( MONGO_TLS_CALLBACK *mongo_tls_destructor )( void *value );
+
+/* Returns 0 on success. */
+int mongo_tls_key_create( mongo_tls_key *_this, mongo_tls_destructor destructor );
+void mongo_tls_key_delete( mongo_tls_key _this );
+void *mongo_tls_get( mongo_tls_key _this );
+void mongo_tls_set( mongo_tls_key _this, void *value );
+
+#ifdef __cplusplus
+} // extern "c"
+#endif
+
+#endif
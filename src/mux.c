@@ -0,0 +1,250 @@
+/* mux.c */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "mux.h"
+
+#include <string.h>
+
+MONGO_EXPORT int mongo_mux_init( mongo_mux *mux, mongo *conn ) {
+    if( ! conn->connected || conn->async ) {
+        conn->err = conn->async ? MONGO_CONN_NONBLOCKING : MONGO_IO_ERROR;
+        return MONGO_ERROR;
+    }
+
+    memset( mux, 0, sizeof( mongo_mux ) );
+    mux->conn = conn;
+    mux->err = MONGO_CONN_SUCCESS;
+    mongo_mutex_init( &mux->send_lock );
+    mongo_mutex_init( &mux->lock );
+    mongo_cond_init( &mux->routed );
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT void mongo_mux_destroy( mongo_mux *mux ) {
+    mongo_mux_waiter *w = mux->unclaimed;
+
+    while( w ) {
+        mongo_mux_waiter *next = w->next;
+        bson_free( w->reply );
+        bson_free( w );
+        w = next;
+    }
+    mux->unclaimed = NULL;
+
+    mongo_cond_destroy( &mux->routed );
+    mongo_mutex_destroy( &mux->lock );
+    mongo_mutex_destroy( &mux->send_lock );
+}
+
+/* Mark the connection as broken and wake every waiter. Called with
+ * mux->lock held. */
+static void mongo_mux_fail( mongo_mux *mux, mongo_error_t err ) {
+    mongo_mux_waiter *w;
+
+    if( ! mux->failed ) {
+        mux->failed = 1;
+        mux->err = err;
+    }
+
+    for( w = mux->waiters; w; w = w->next )
+        w->done = 1;
+}
+
+/* Hand a reply to the waiter it answers, or park it until that waiter
+ * registers. Called with mux->lock held. */
+static void mongo_mux_route( mongo_mux *mux, mongo_reply *reply ) {
+    mongo_mux_waiter *w;
+
+    for( w = mux->waiters; w; w = w->next ) {
+        if( w->request_id == reply->head.responseTo && ! w->done ) {
+            w->reply = reply;
+            w->done = 1;
+            return;
+        }
+    }
+
+    w = ( mongo_mux_waiter * )bson_malloc( sizeof( mongo_mux_waiter ) );
+    w->request_id = reply->head.responseTo;
+    w->reply = reply;
+    w->done = 1;
+    w->next = mux->unclaimed;
+    mux->unclaimed = w;
+}
+
+/* Record the outcome of a send made under send_lock. err comes from the
+ * send itself: conn->err may already hold the reader's error instead. */
+static int mongo_mux_sent( mongo_mux *mux, int res, mongo_error_t err ) {
+    if( res != MONGO_OK && err == MONGO_IO_ERROR ) {
+        mongo_mutex_lock( &mux->lock );
+        mongo_mux_fail( mux, MONGO_IO_ERROR );
+        mongo_cond_broadcast( &mux->routed );
+        mongo_mutex_unlock( &mux->lock );
+    }
+
+    return res;
+}
+
+/* Wait for the reply to request_id, reading the socket on behalf of
+ * every waiter whenever no other thread is. */
+static int mongo_mux_wait( mongo_mux *mux, int request_id, mongo_reply **reply ) {
+    mongo_mux_waiter self;
+    mongo_mux_waiter **p;
+
+    self.request_id = request_id;
+    self.reply = NULL;
+    self.done = 0;
+
+    mongo_mutex_lock( &mux->lock );
+
+    /* Another thread may already have read the reply. */
+    for( p = &mux->unclaimed; *p; p = &( *p )->next ) {
+        if( ( *p )->request_id == request_id ) {
+            mongo_mux_waiter *found = *p;
+            *p = found->next;
+            self.reply = found->reply;
+            self.done = 1;
+            bson_free( found );
+            break;
+        }
+    }
+    if( mux->failed )
+        self.done = 1;
+
+    self.next = mux->waiters;
+    mux->waiters = &self;
+
+    while( ! self.done ) {
+        mongo_reply *in;
+        int res;
+
+        if( mux->reading ) {
+            mongo_cond_wait( &mux->routed, &mux->lock );
+            continue;
+        }
+
+        mux->reading = 1;
+        mongo_mutex_unlock( &mux->lock );
+        res = mongo_read_reply( mux->conn, &in );
+        mongo_mutex_lock( &mux->lock );
+        mux->reading = 0;
+
+        /* Any failed read leaves the stream unusable. conn->err is not
+         * consulted, as a sender may be writing it concurrently. */
+        if( res == MONGO_OK )
+            mongo_mux_route( mux, in );
+        else
+            mongo_mux_fail( mux, MONGO_IO_ERROR );
+
+        /* Wake the owner of the reply, and a thread to read the next one. */
+        mongo_cond_broadcast( &mux->routed );
+    }
+
+    for( p = &mux->waiters; *p != &self; p = &( *p )->next )
+        ;
+    *p = self.next;
+
+    mongo_mutex_unlock( &mux->lock );
+
+    *reply = self.reply;
+    return self.reply ? MONGO_OK : MONGO_ERROR;
+}
+
+MONGO_EXPORT int mongo_mux_query( mongo_mux *mux, const char *ns, const bson *query,
+                                  const bson *fields, int limit, int skip, int options,
+                                  mongo_reply **reply ) {
+    int request_id;
+    int res;
+    mongo_error_t err = MONGO_CONN_SUCCESS;
+
+    *reply = NULL;
+    if( options & MONGO_EXHAUST )
+        return MONGO_ERROR;
+
+    mongo_mutex_lock( &mux->send_lock );
+    res = mongo_send_query( mux->conn, ns, query, fields, limit, skip, options, &request_id, &err );
+    mongo_mutex_unlock( &mux->send_lock );
+
+    if( mongo_mux_sent( mux, res, err ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_mux_wait( mux, request_id, reply );
+}
+
+MONGO_EXPORT int mongo_mux_get_more( mongo_mux *mux, const char *ns, int64_t cursor_id,
+                                     int limit, mongo_reply **reply ) {
+    int request_id;
+    int res;
+    mongo_error_t err = MONGO_CONN_SUCCESS;
+
+    *reply = NULL;
+
+    mongo_mutex_lock( &mux->send_lock );
+    res = mongo_send_get_more( mux->conn, ns, cursor_id, limit, &request_id, &err );
+    mongo_mutex_unlock( &mux->send_lock );
+
+    if( mongo_mux_sent( mux, res, err ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_mux_wait( mux, request_id, reply );
+}
+
+MONGO_EXPORT int mongo_mux_kill_cursor( mongo_mux *mux, int64_t cursor_id ) {
+    int res;
+    mongo_error_t err = MONGO_CONN_SUCCESS;
+
+    mongo_mutex_lock( &mux->send_lock );
+    res = mongo_send_kill_cursor( mux->conn, cursor_id, &err );
+    mongo_mutex_unlock( &mux->send_lock );
+
+    return mongo_mux_sent( mux, res, err );
+}
+
+MONGO_EXPORT int mongo_mux_command( mongo_mux *mux, const char *db, const bson *command,
+                                    bson *out ) {
+    mongo_reply *reply;
+    size_t sl = strlen( db );
+    char *ns = ( char * )bson_malloc( sl + 5 + 1 ); /* ".$cmd" + nul */
+    int res;
+
+    strcpy( ns, db );
+    strcpy( ns + sl, ".$cmd" );
+
+    res = mongo_mux_query( mux, ns, command, NULL, -1, 0, 0, &reply );
+    bson_free( ns );
+
+    if( res == MONGO_OK ) {
+        bson response[1];
+        bson_iterator it[1];
+
+        if( reply->fields.num != 1 )
+            res = MONGO_ERROR;
+        else {
+            bson_init_finished_data( response, &reply->objs, 0 );
+            if( ! bson_find( it, response, "ok" ) || ! bson_iterator_bool( it ) )
+                res = MONGO_ERROR;
+            else if( out )
+                bson_copy( out, response );
+        }
+        bson_free( reply );
+    }
+
+    if( out && res != MONGO_OK )
+        bson_init_zero( out );
+
+    return res;
+}
@@ -0,0 +1,125 @@
+#ifndef MONGO_MUX_H
+#define MONGO_MUX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mongo.h"
+#include "mutex.h"
+
+typedef struct mongo_mux_waiter {
+    int request_id;                   /**< Id of the request waiting for its reply. */
+    mongo_reply *reply;               /**< The reply, once it has been routed here. */
+    int done;                         /**< Non-zero once the reply arrived or the connection failed. */
+    struct mongo_mux_waiter *next;    /**< Next waiter in the list. */
+} mongo_mux_waiter;
+
+typedef struct mongo_mux {
+    mongo *conn;                      /**< connection is *not* owned by the mux */
+    mongo_mutex send_lock;            /**< Serializes writes to the socket. */
+    mongo_mutex lock;                 /**< Protects every field below. */
+    mongo_cond routed;                /**< Broadcast when replies are routed or the reader steps down. */
+    int reading;                      /**< Non-zero while one waiter reads the socket for all. */
+    int failed;                       /**< Non-zero once the connection has failed. */
+    mongo_error_t err;                /**< Error that failed the connection. */
+    mongo_mux_waiter *waiters;        /**< Requests waiting for their reply. */
+    mongo_mux_waiter *unclaimed;      /**< Replies that arrived before their waiter registered. */
+} mongo_mux;
+
+/**
+ * Share one connection between several threads.
+ *
+ * Each thread sends its request and then waits for the reply that
+ * answers it. There is no reader thread. Whichever waiter finds the
+ * socket free reads the next reply, and hands it to its owner by
+ * responseTo. Requests from all threads are therefore in flight on the
+ * server at the same time.
+ *
+ * Once the mux is set up, the connection must only be used through it.
+ * If the socket fails, every outstanding and later call fails with
+ * mux->err. The connection has to be reconnected and a new mux
+ * initialized.
+ *
+ * @param mux the mux to initialize.
+ * @param conn a connected mongo object in blocking mode.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the connection is not usable.
+ */
+MONGO_EXPORT int mongo_mux_init( mongo_mux *mux, mongo *conn );
+
+/**
+ * Release the mux. No thread may still be using it. The connection is
+ * left open.
+ *
+ * @param mux
+ */
+MONGO_EXPORT void mongo_mux_destroy( mongo_mux *mux );
+
+/**
+ * Run a query and wait for its first batch.
+ *
+ * @param mux
+ * @param ns the namespace.
+ * @param query the query; may be NULL for all documents.
+ * @param fields fields to return; may be NULL for all fields.
+ * @param limit numberToReturn, as for mongo_find().
+ * @param skip number of documents to skip.
+ * @param options a bitfield of mongo_cursor_opts. MONGO_EXHAUST is not supported.
+ * @param reply set to the reply, to be released with bson_free().
+ *
+ * Thread-Safe
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_mux_query( mongo_mux *mux, const char *ns, const bson *query,
+                                  const bson *fields, int limit, int skip, int options,
+                                  mongo_reply **reply );
+
+/**
+ * Fetch the next batch of a cursor and wait for it.
+ *
+ * @param mux
+ * @param ns the namespace of the original query.
+ * @param cursor_id the cursorID from the previous reply.
+ * @param limit numberToReturn; 0 lets the server choose.
+ * @param reply set to the reply, to be released with bson_free().
+ *
+ * Thread-Safe
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_mux_get_more( mongo_mux *mux, const char *ns, int64_t cursor_id,
+                                     int limit, mongo_reply **reply );
+
+/**
+ * Close a cursor that will not be read to the end.
+ *
+ * Thread-Safe
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_mux_kill_cursor( mongo_mux *mux, int64_t cursor_id );
+
+/**
+ * Run a command, as mongo_run_command() does.
+ *
+ * @param mux
+ * @param db the database to run the command in.
+ * @param command the command.
+ * @param out set to the command's reply if not NULL; the caller must
+ *     call bson_destroy() on it.
+ *
+ * Thread-Safe
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the request failed or the command
+ *     did not return ok. In the second case mux->err is not changed.
+ */
+MONGO_EXPORT int mongo_mux_command( mongo_mux *mux, const char *db, const bson *command,
+                                    bson *out );
+
+#ifdef __cplusplus
+} // extern "c"
+#endif
+
+#endif
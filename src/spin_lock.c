@@ -18,6 +18,80 @@ long crossSwap( spin_lock *_this, long originalValue, long exchgValue ) {
 #endif
 }
 
+long crossIncrement( volatile long *value ) {
+#ifdef _MSC_VER
+  return InterlockedIncrement( value );
+#else
+  return __sync_add_and_fetch( value, 1 );
+#endif
+}
+
+/* returns the new value. crossAdd64( value, 0 ) reads a counter without
+   tearing on 32 bit platforms */
+int64_t crossAdd64( volatile int64_t *value, int64_t delta ) {
+#ifdef _MSC_VER
+  return InterlockedExchangeAdd64( value, delta ) + delta;
+#else
+  return __sync_add_and_fetch( value, delta );
+#endif
+}
+
+/* pointer publication: everything written before crossStoreRelease is
+   visible to a thread that sees the pointer through crossLoadAcquire */
+void *crossLoadAcquire( void * volatile *ptr ) {
+#if defined( _MSC_VER )
+  return *ptr; /* volatile reads have acquire semantics under MSVC */
+#elif defined( __ATOMIC_ACQUIRE )
+  return __atomic_load_n( ptr, __ATOMIC_ACQUIRE );
+#else
+  void *value = *ptr;
+  __sync_synchronize();
+  return value;
+#endif
+}
+
+void crossStoreRelease( void * volatile *ptr, void *value ) {
+#if defined( _MSC_VER )
+  InterlockedExchangePointer( ptr, value );
+#elif defined( __ATOMIC_RELEASE )
+  __atomic_store_n( ptr, value, __ATOMIC_RELEASE );
+#else
+  __sync_synchronize();
+  *ptr = value;
+#endif
+}
+
+long crossLoadAcquireLong( volatile long *ptr ) {
+#if defined( _MSC_VER )
+  return *ptr;
+#elif defined( __ATOMIC_ACQUIRE )
+  return __atomic_load_n( ptr, __ATOMIC_ACQUIRE );
+#else
+  long value = *ptr;
+  __sync_synchronize();
+  return value;
+#endif
+}
+
+void crossStoreReleaseLong( volatile long *ptr, long value ) {
+#if defined( _MSC_VER )
+  InterlockedExchange( ptr, value );
+#elif defined( __ATOMIC_RELEASE )
+  __atomic_store_n( ptr, value, __ATOMIC_RELEASE );
+#else
+  __sync_synchronize();
+  *ptr = value;
+#endif
+}
+
+void crossPause( void ) {
+#ifdef _MSC_VER
+  YieldProcessor();
+#elif defined( __i386__ ) || defined( __x86_64__ )
+  __asm__ __volatile__( "pause" );
+#endif
+}
+
 void crossYield( void ) {
 #ifdef _MSC_VER
   SwitchToThread();
@@ -27,12 +101,21 @@ void crossYield( void ) {
 }
 
 static void spin( int *spinCount ) {
+  crossPause();
   if( (*spinCount)++ > SPINS_BETWEEN_THREADSWITCH ) {
     crossYield();
     *spinCount = 0;
   }
 }
 
+static long spinLock_peek( spin_lock *_this ) {
+#if !defined( _MSC_VER ) && defined( __ATOMIC_RELAXED )
+  return __atomic_load_n( _this, __ATOMIC_RELAXED );
+#else
+  return *_this;
+#endif
+}
+
 void spinLock_init( spin_lock *_this ){
   (*_this) = SPINLOCK_UNLOCKED; /* Start unlocked */
 }
@@ -45,8 +128,10 @@ void spinLock_destroy( spin_lock *_this ){
 void spinLock_lock( spin_lock *_this ) {
   int spins = 0;
   while( !spinLock_tryLock( _this ) ) {
-    spin( &spins );  
-  };
+    /* wait with plain loads so spinning threads don't keep stealing the cache line */
+    while( spinLock_peek( _this ) != SPINLOCK_UNLOCKED )
+      spin( &spins );
+  }
 }
 
 int spinLock_tryLock( spin_lock *_this )
@@ -55,5 +140,10 @@ int spinLock_tryLock( spin_lock *_this )
 }
 
 void spinLock_unlock( spin_lock *_this ) {
-  *_this = SPINLOCK_UNLOCKED;
+  /* needs release semantics, a plain store lets earlier writes leak past the unlock */
+#ifdef _MSC_VER
+  InterlockedExchange( _this, SPINLOCK_UNLOCKED );
+#else
+  __sync_lock_release( _this );
+#endif
 }
\ No newline at end of file
@@ -1,14 +1,23 @@
 #ifndef SPIN_LOCK_H_
 #define SPIN_LOCK_H_
 
+#include "bson.h" /* int64_t */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef volatile long spin_lock;
 
+void crossPause( void );
 void crossYield( void );
 long crossSwap( spin_lock *_this, long originalValue, long exchgValue );
+long crossIncrement( volatile long *value );
+int64_t crossAdd64( volatile int64_t *value, int64_t delta );
+void *crossLoadAcquire( void * volatile *ptr );
+void crossStoreRelease( void * volatile *ptr, void *value );
+long crossLoadAcquireLong( volatile long *ptr );
+void crossStoreReleaseLong( volatile long *ptr, long value );
 
 void spinLock_init( spin_lock *_this );
 void spinLock_destroy( spin_lock *_this );
@@ -1,5 +1,6 @@
 #include "test.h"
 #include "bson.h"
+#include "allocator.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -330,6 +331,251 @@ int test_bson_deep_nesting( void ) {
     return 0;
 }
 
+int test_bson_find_index( void ) {
+    bson b[1];
+    bson_iterator it[1], walked[1];
+    char key[8];
+    int i;
+
+    bson_init( b );
+    for ( i = 0; i < 100; i++ ) {
+        bson_sprintf( key, "k%d", i );
+        bson_append_int( b, key, i );
+    }
+    bson_append_int( b, "k7", -1 ); /* repeated key: the first one is found */
+    ASSERT( bson_enable_index( b ) == BSON_ERROR );
+    bson_finish( b );
+    ASSERT( bson_enable_index( b ) == BSON_OK );
+    ASSERT( b->index != NULL );
+
+    for ( i = 0; i < 100; i++ ) {
+        bson_sprintf( key, "k%d", i );
+        ASSERT( bson_find( it, b, key ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == i );
+    }
+
+    /* a miss and continued iteration end up where a walk would */
+    ASSERT( bson_find( it, b, "missing" ) == BSON_EOO );
+    bson_iterator_init( walked, b );
+    while ( bson_iterator_next( walked ) );
+    ASSERT( it->cur == walked->cur );
+    ASSERT( bson_find( it, b, "k98" ) == BSON_INT );
+    ASSERT( bson_iterator_next( it ) == BSON_INT && strcmp( bson_iterator_key( it ), "k99" ) == 0 );
+
+    /* enabling again replaces the hash rather than leaking it */
+    ASSERT( bson_enable_index( b ) == BSON_OK );
+    ASSERT( bson_find( it, b, "k42" ) == BSON_INT && bson_iterator_int( it ) == 42 );
+
+    bson_destroy( b );
+    ASSERT( b->index == NULL && !b->indexed );
+
+    return 0;
+}
+
+int test_bson_find_many( void ) {
+    bson b[1];
+    bson_iterator its[6];
+    const char *paths[6] = { "b.c", "a", "arr.1.x", "missing", "a.b", "b.d.e" };
+
+    bson_init( b );
+    bson_append_int( b, "a", 1 );
+    bson_append_start_object( b, "b" );
+    bson_append_string( b, "c", "see" );
+    bson_append_start_object( b, "d" );
+    bson_append_int( b, "e", 5 );
+    bson_append_finish_object( b );
+    bson_append_finish_object( b );
+    bson_append_start_array( b, "arr" );
+    bson_append_int( b, "0", 0 );
+    bson_append_start_object( b, "1" );
+    bson_append_double( b, "x", 1.5 );
+    bson_append_finish_object( b );
+    bson_append_finish_array( b );
+    bson_finish( b );
+
+    ASSERT( bson_find_many( its, b, paths, 6 ) == 4 );
+    ASSERT( bson_iterator_type( &its[0] ) == BSON_STRING );
+    ASSERT( strcmp( bson_iterator_string( &its[0] ), "see" ) == 0 );
+    ASSERT( bson_iterator_int( &its[1] ) == 1 );
+    ASSERT( bson_iterator_double( &its[2] ) == 1.5 );
+    ASSERT( bson_iterator_type( &its[3] ) == BSON_EOO );
+    ASSERT( bson_iterator_type( &its[4] ) == BSON_EOO ); /* "a" is not an object */
+    ASSERT( bson_iterator_int( &its[5] ) == 5 );
+
+    bson_destroy( b );
+
+    return 0;
+}
+
+int test_bson_find_path( void ) {
+    bson b[1];
+    bson_iterator it[1];
+    bson_path path[1];
+    int i;
+
+    bson_init( b );
+    bson_append_int( b, "a", 1 );
+    bson_append_start_object( b, "b" );
+    bson_append_start_object( b, "c" );
+    bson_append_string( b, "d", "deep" );
+    bson_append_finish_object( b );
+    bson_append_finish_object( b );
+    bson_append_start_array( b, "items" );
+    for ( i = 0; i < 4; i++ ) {
+        char key[4];
+        bson_numstr( key, i );
+        bson_append_start_object( b, key );
+        bson_append_int( b, "price", i * 10 );
+        bson_append_finish_object( b );
+    }
+    bson_append_finish_array( b );
+    bson_finish( b );
+
+    ASSERT( bson_find_path( it, b, "a" ) == BSON_INT );
+    ASSERT( bson_find_path( it, b, "b.c.d" ) == BSON_STRING );
+    ASSERT( strcmp( bson_iterator_string( it ), "deep" ) == 0 );
+    ASSERT( bson_find_path( it, b, "b.c" ) == BSON_OBJECT );
+    ASSERT( bson_find_path( it, b, "items.3.price" ) == BSON_INT );
+    ASSERT( bson_iterator_int( it ) == 30 );
+    ASSERT( bson_find_path( it, b, "items.4.price" ) == BSON_EOO );
+    ASSERT( bson_find_path( it, b, "b.x" ) == BSON_EOO );
+    ASSERT( bson_find_path( it, b, "a.b" ) == BSON_EOO );
+    ASSERT( bson_find_path( it, b, "b.c.dd" ) == BSON_EOO );
+
+    ASSERT( bson_path_compile( path, "b..d" ) == BSON_ERROR );
+    ASSERT( bson_path_compile( path, "items.2.price" ) == BSON_OK );
+    ASSERT( path->depth == 3 );
+    ASSERT( bson_find_compiled_path( it, b, path ) == BSON_INT );
+    ASSERT( bson_iterator_int( it ) == 20 );
+
+    /* the first name goes through the index when there is one */
+    bson_enable_index( b );
+    ASSERT( bson_find_compiled_path( it, b, path ) == BSON_INT );
+    ASSERT( bson_iterator_int( it ) == 20 );
+    ASSERT( bson_find_path( it, b, "b.c.d" ) == BSON_STRING );
+    ASSERT( bson_find_path( it, b, "bb.c" ) == BSON_EOO );
+    bson_path_destroy( path );
+
+    bson_destroy( b );
+
+    return 0;
+}
+
+static void build_allocated( bson *b, bson_allocator *allocator, int i, int fields ) {
+    int j;
+    bson_init_with_allocator( b, 16, allocator );
+    bson_append_int( b, "i", i );
+    for ( j = 0; j < fields; j++ ) {
+        bson_append_start_object( b, "sub" );
+        bson_append_string( b, "s", "a string long enough to make the buffer grow" );
+        bson_append_int( b, "j", j );
+    }
+    for ( j = 0; j < fields; j++ )
+        bson_append_finish_object( b );
+    bson_finish( b );
+}
+
+int test_bson_allocators( void ) {
+    bson_arena arena[1];
+    bson_slab slab[1];
+    bson b[64];
+    bson_iterator it[1];
+    char *p, *q;
+    int i;
+
+    bson_arena_init( arena, 4096 );
+    for ( i = 0; i < 64; i++ )
+        build_allocated( &b[i], &arena->allocator, i, i % 40 );
+    for ( i = 0; i < 64; i++ ) {
+        ASSERT( bson_find( it, &b[i], "i" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == i );
+        ASSERT( bson_size( &b[i] ) > 12 * ( i % 40 ) );
+        bson_destroy( &b[i] );
+    }
+
+    /* the newest allocation grows in place */
+    p = ( char * )bson_arena_alloc( arena, 32 );
+    q = ( char * )arena->allocator.realloc_func( arena, p, 32, 512 );
+    ASSERT( p == q );
+
+    bson_arena_reset( arena );
+    build_allocated( &b[0], &arena->allocator, 7, 3 );
+    ASSERT( bson_find( it, &b[0], "i" ) == BSON_INT );
+    ASSERT( bson_iterator_int( it ) == 7 );
+    bson_destroy( &b[0] );
+    bson_arena_destroy( arena );
+
+    bson_slab_init( slab );
+    for ( i = 0; i < 64; i++ )
+        build_allocated( &b[i], &slab->allocator, i, i % 40 );
+    for ( i = 0; i < 64; i++ ) {
+        ASSERT( bson_find( it, &b[i], "i" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == i );
+        bson_destroy( &b[i] );
+    }
+
+    /* freed chunks are handed out again */
+    p = ( char * )bson_slab_alloc( slab, 100 );
+    bson_slab_free( slab, p, 100 );
+    q = ( char * )bson_slab_alloc( slab, 128 );
+    ASSERT( p == q );
+    bson_slab_free( slab, q, 128 );
+
+    p = ( char * )bson_slab_alloc( slab, 10000 );
+    ASSERT( p != NULL );
+    bson_slab_free( slab, p, 10000 );
+    bson_slab_destroy( slab );
+
+    return 0;
+}
+
+static void build_hinted( bson *b, bson_size_hint *hint, int fields ) {
+    int j;
+    bson_init_with_hint( b, hint );
+    for ( j = 0; j < fields; j++ )
+        bson_append_string( b, "s", "a string long enough to make the buffer grow" );
+    bson_finish( b );
+}
+
+int test_bson_size_hint( void ) {
+    bson_size_hint hint = { 0, 0 };
+    bson b[1];
+    int size;
+
+    bson_init_size( b, 0 );
+    ASSERT( b->data == NULL );
+    bson_append_int( b, "a", 1 );
+    bson_finish( b );
+    ASSERT( bson_size( b ) == 12 );
+    bson_destroy( b );
+
+    build_hinted( b, &hint, 100 );
+    size = bson_size( b );
+    ASSERT( hint.count == 1 );
+    ASSERT( hint.size == size );
+    bson_destroy( b );
+
+    /* the next one of the same shape is presized and never grows */
+    bson_init_with_hint( b, &hint );
+    ASSERT( b->dataSize == size );
+    bson_destroy( b );
+    build_hinted( b, &hint, 100 );
+    ASSERT( b->dataSize == size );
+    bson_destroy( b );
+
+    /* a small one only pulls the estimate down part of the way */
+    build_hinted( b, &hint, 1 );
+    bson_destroy( b );
+    ASSERT( hint.size < size );
+    ASSERT( hint.size > size / 2 );
+
+    build_hinted( b, &hint, 200 );
+    ASSERT( hint.size == bson_size( b ) );
+    bson_destroy( b );
+
+    return 0;
+}
+
 int test_bson_oid_generated_time( void ) {
     time_t cur_time;
     bson_oid_t oid;
@@ -351,6 +597,11 @@ int main() {
   test_bson_iterator();
   test_bson_size();
   test_bson_deep_nesting();
+  test_bson_find_index();
+  test_bson_find_many();
+  test_bson_find_path();
+  test_bson_allocators();
+  test_bson_size_hint();
   test_bson_oid_generated_time();
 
   return 0;
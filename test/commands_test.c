@@ -16,9 +16,23 @@ int main() {
     const char *db = "test";
     const char *col = "c.capped";
 
+    mongo_host_port host[1];
+
     INIT_SOCKETS_FOR_WINDOWS;
+
+    memset( host, 0, sizeof( host ) );
+    mongo_host_port_record_rtt( host, 1000 );
+    ASSERT( host->rtt_usec == 1000 );
+    mongo_host_port_record_rtt( host, 2000 );
+    ASSERT( host->rtt_usec == 1200 && host->rtt_samples == 2 );
+
     CONN_CLIENT_TEST;
 
+    /* connecting measured the round trip, refreshing averages it in */
+    ASSERT( mongo_get_primary_rtt( conn ) >= 0 );
+    ASSERT( mongo_refresh_rtt( conn ) == MONGO_OK );
+    ASSERT( conn->primary->rtt_samples == 2 );
+
     mongo_cmd_drop_collection( conn, db, col, NULL );
 
     ASSERT( mongo_create_capped_collection( conn, db, col,
@@ -64,6 +64,116 @@ int test_multiple_getmore( mongo *conn ) {
     return 0;
 }
 
+int test_prefetch( mongo *conn ) {
+    mongo_cursor cursor[1];
+    int count;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 10000 );
+
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_prefetch( cursor, 1 );
+
+    /* Other operations on the connection must not disturb read-ahead. */
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        count++;
+        if( count % 1000 == 0 )
+            ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 10000 );
+    }
+
+    ASSERT( count == 10000 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    mongo_cursor_destroy( cursor );
+
+    /* Destroying a cursor with a batch in flight leaves the connection usable. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_prefetch( cursor, 1 );
+    for( count = 0; count < 200; count++ )
+        ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    mongo_cursor_destroy( cursor );
+    ASSERT( conn->pending_cursor == NULL );
+    ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 10000 );
+
+    remove_sample_data( conn );
+    return 0;
+}
+
+int test_exhaust( mongo *conn ) {
+    mongo_cursor cursor[1];
+    int count;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 10000 );
+
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_options( cursor, MONGO_EXHAUST );
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK )
+        count++;
+
+    ASSERT( count == 10000 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    mongo_cursor_destroy( cursor );
+    ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 10000 );
+
+    /* The connection is busy while the server streams, and abandoning
+       the stream early closes the socket. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_options( cursor, MONGO_EXHAUST );
+    for( count = 0; count < 200; count++ )
+        ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "cursors", NULL ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_CONN_BUSY );
+    mongo_cursor_destroy( cursor );
+    ASSERT( !mongo_is_connected( conn ) );
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+
+    remove_sample_data( conn );
+    return 0;
+}
+
+int test_batch_size( mongo *conn ) {
+    mongo_cursor cursor[1];
+    int count;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 10000 );
+
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_batch_size( cursor, 10 );
+    mongo_cursor_set_limit( cursor, 25 );
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        if( count == 0 )
+            ASSERT( cursor->reply->fields.num == 10 );
+        if( count == 20 )
+            ASSERT( cursor->reply->fields.num == 5 );
+        count++;
+    }
+    ASSERT( count == 25 );
+    mongo_cursor_destroy( cursor );
+
+    /* Growth never asks for more than the ceiling. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_batch_size( cursor, 10 );
+    mongo_cursor_set_max_batch_size( cursor, 400 );
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( cursor->reply->fields.num <= 400 );
+        count++;
+    }
+    ASSERT( count == 10000 );
+    ASSERT( cursor->batch_size >= 10 && cursor->batch_size <= 400 );
+    mongo_cursor_destroy( cursor );
+
+    remove_sample_data( conn );
+    return 0;
+}
+
 int test_tailable( mongo *conn ) {
     mongo_cursor *cursor;
     bson b;
@@ -189,6 +299,9 @@ int main() {
     CONN_CLIENT_TEST;
 
     test_multiple_getmore( conn );
+    test_prefetch( conn );
+    test_exhaust( conn );
+    test_batch_size( conn );
     test_tailable( conn );
     test_builder_api( conn );
     test_bad_query( conn );
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
 
 /* Test read timeout by causing the
  * server to sleep for 10s on a query.
@@ -98,6 +99,75 @@ int test_error_messages( void ) {
     return 0;
 }
 
+/* Drive many queries through one non-blocking connection with poll(). */
+int test_nonblocking( void ) {
+    mongo conn[1];
+    mongo_reply *reply;
+    bson b[1];
+    int ids[32];
+    int i, done = 0;
+    const char *ns = "test.foo";
+
+    CONN_CLIENT_TEST;
+
+    mongo_cmd_drop_collection( conn, "test", "foo", NULL );
+    for( i = 0; i < 10; i++ ) {
+        bson_init( b );
+        bson_append_int( b, "foo", i );
+        bson_finish( b );
+        mongo_insert( conn, ns, b, NULL );
+        bson_destroy( b );
+    }
+
+    ASSERT( mongo_set_nonblocking( conn, 1 ) == MONGO_OK );
+    ASSERT( mongo_async_want( conn ) == 0 );
+
+    /* Requests that would wait for a reply are refused. */
+    ASSERT( mongo_count( conn, "test", "foo", NULL ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_CONN_NONBLOCKING );
+
+    for( i = 0; i < 32; i++ ) {
+        bson_init( b );
+        bson_append_int( b, "foo", i % 10 );
+        bson_finish( b );
+        ASSERT( mongo_async_query( conn, ns, b, NULL, 1, 0, 0, &ids[i] ) == MONGO_OK );
+        bson_destroy( b );
+    }
+    ASSERT( mongo_async_want( conn ) == ( MONGO_WANT_READ | MONGO_WANT_WRITE ) );
+
+    while( done < 32 ) {
+        struct pollfd pfd;
+        int want = mongo_async_want( conn );
+
+        pfd.fd = mongo_get_socket( conn );
+        pfd.events = ( want & MONGO_WANT_READ ? POLLIN : 0 ) |
+                     ( want & MONGO_WANT_WRITE ? POLLOUT : 0 );
+        ASSERT( poll( &pfd, 1, 5000 ) == 1 );
+
+        if( pfd.revents & POLLOUT )
+            ASSERT( mongo_async_flush( conn ) == MONGO_OK );
+        if( pfd.revents & POLLIN ) {
+            ASSERT( mongo_async_read_reply( conn, &reply ) == MONGO_OK );
+            while( reply ) {
+                ASSERT( reply->head.responseTo == ids[done] );
+                ASSERT( reply->fields.num == 1 );
+                bson_free( reply );
+                done++;
+                ASSERT( mongo_async_read_reply( conn, &reply ) == MONGO_OK );
+            }
+        }
+    }
+
+    ASSERT( mongo_async_want( conn ) == 0 );
+    ASSERT( mongo_set_nonblocking( conn, 0 ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "foo", NULL ) == 10 );
+
+    mongo_cmd_drop_collection( conn, "test", "foo", NULL );
+    mongo_destroy( conn );
+
+    return 0;
+}
+
 int main() {
     char version[10];
 
@@ -106,6 +176,7 @@ int main() {
     }
     test_getaddrinfo();
     test_error_messages();
+    test_nonblocking();
 
     return 0;
 }
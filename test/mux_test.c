@@ -0,0 +1,83 @@
+/* mux_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "mux.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define THREADS 8
+#define ROUNDS 50
+
+static const char *ns = "test.mux";
+
+static void *run_queries( void *arg ) {
+    mongo_mux *mux = ( mongo_mux * )arg;
+    mongo_reply *reply;
+    bson cmd[1], out[1];
+    bson_iterator it[1];
+    int i, total;
+
+    bson_init( cmd );
+    bson_append_string( cmd, "count", "mux" );
+    bson_finish( cmd );
+
+    for( i = 0; i < ROUNDS; i++ ) {
+        ASSERT( mongo_mux_command( mux, "test", cmd, out ) == MONGO_OK );
+        ASSERT( bson_find( it, out, "n" ) );
+        ASSERT( bson_iterator_int( it ) == 500 );
+        bson_destroy( out );
+
+        /* Read the whole collection in small batches. */
+        ASSERT( mongo_mux_query( mux, ns, NULL, NULL, 100, 0, 0, &reply ) == MONGO_OK );
+        total = reply->fields.num;
+        while( reply->fields.cursorID ) {
+            int64_t cursor_id = reply->fields.cursorID;
+            bson_free( reply );
+            ASSERT( mongo_mux_get_more( mux, ns, cursor_id, 100, &reply ) == MONGO_OK );
+            total += reply->fields.num;
+        }
+        bson_free( reply );
+        ASSERT( total == 500 );
+    }
+
+    bson_destroy( cmd );
+    return NULL;
+}
+
+int main() {
+    mongo conn[1];
+    mongo_mux mux[1];
+    pthread_t threads[THREADS];
+    bson b[1];
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+    CONN_CLIENT_TEST;
+
+    mongo_cmd_drop_collection( conn, "test", "mux", NULL );
+    for( i = 0; i < 500; i++ ) {
+        bson_init( b );
+        bson_append_int( b, "i", i );
+        bson_finish( b );
+        mongo_insert( conn, ns, b, NULL );
+        bson_destroy( b );
+    }
+    ASSERT( mongo_count( conn, "test", "mux", NULL ) == 500 );
+
+    ASSERT( mongo_mux_init( mux, conn ) == MONGO_OK );
+    for( i = 0; i < THREADS; i++ )
+        pthread_create( &threads[i], NULL, run_queries, mux );
+    for( i = 0; i < THREADS; i++ )
+        pthread_join( threads[i], NULL );
+    ASSERT( ! mux->failed );
+    mongo_mux_destroy( mux );
+
+    /* The connection is usable again on its own. */
+    mongo_cmd_drop_collection( conn, "test", "mux", NULL );
+    mongo_destroy( conn );
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+/* pool_benchmark_test.c */
+
+/* Throughput of the pool's critical section as the number of threads grows,
+ * taken with a plain blocking mutex (the lock the pool used before
+ * mongo_mutex_lock spun) and with mongo_mutex_lock. Each operation pops a
+ * node from a free list and pushes it back, as acquire and release do. */
+
+#include "test.h"
+#include "mutex.h"
+#include "env.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MAX_THREADS 16
+#define OPS_PER_THREAD 100000
+
+typedef struct node {
+    struct node *next;
+} node;
+
+typedef struct {
+    mongo_mutex lock;
+    node *head;
+    int idle;
+} free_list;
+
+static free_list list;
+
+static void blocking_lock( mongo_mutex *lock ) {
+#ifdef _MSC_VER
+    EnterCriticalSection( lock );
+#else
+    pthread_mutex_lock( lock );
+#endif
+}
+
+static void run_ops( void ( *lock )( mongo_mutex * ) ) {
+    int i;
+
+    for( i = 0; i < OPS_PER_THREAD; i++ ) {
+        node *n;
+
+        lock( &list.lock );
+        n = list.head;
+        list.head = n->next;
+        list.idle--;
+        mongo_mutex_unlock( &list.lock );
+
+        lock( &list.lock );
+        n->next = list.head;
+        list.head = n;
+        list.idle++;
+        mongo_mutex_unlock( &list.lock );
+    }
+}
+
+#ifdef _MSC_VER
+static DWORD WINAPI blocking_worker( LPVOID arg ) {
+    run_ops( blocking_lock );
+    return 0;
+}
+
+static DWORD WINAPI adaptive_worker( LPVOID arg ) {
+    run_ops( mongo_mutex_lock );
+    return 0;
+}
+#else
+static void *blocking_worker( void *arg ) {
+    run_ops( blocking_lock );
+    return NULL;
+}
+
+static void *adaptive_worker( void *arg ) {
+    run_ops( mongo_mutex_lock );
+    return NULL;
+}
+#endif
+
+static double run( int adaptive, int threads ) {
+#ifdef _MSC_VER
+    HANDLE ids[MAX_THREADS];
+#else
+    pthread_t ids[MAX_THREADS];
+#endif
+    int64_t start;
+    int i;
+
+    /* A critical section without a spin count blocks at once, as before. */
+#ifdef _MSC_VER
+    if( adaptive )
+        mongo_mutex_init( &list.lock );
+    else
+        InitializeCriticalSection( &list.lock );
+#else
+    mongo_mutex_init( &list.lock );
+#endif
+
+    start = mongo_env_clock_usec();
+    for( i = 0; i < threads; i++ ) {
+#ifdef _MSC_VER
+        ids[i] = CreateThread( NULL, 0, adaptive ? adaptive_worker : blocking_worker, NULL, 0, NULL );
+#else
+        pthread_create( &ids[i], NULL, adaptive ? adaptive_worker : blocking_worker, NULL );
+#endif
+    }
+    for( i = 0; i < threads; i++ ) {
+#ifdef _MSC_VER
+        WaitForSingleObject( ids[i], INFINITE );
+        CloseHandle( ids[i] );
+#else
+        pthread_join( ids[i], NULL );
+#endif
+    }
+    start = mongo_env_clock_usec() - start;
+
+    mongo_mutex_destroy( &list.lock );
+
+    return ( double )threads * OPS_PER_THREAD / ( start > 0 ? start : 1 );
+}
+
+int main() {
+    node nodes[MAX_THREADS];
+    node *n;
+    int threads, i;
+
+    for( i = 0; i < MAX_THREADS; i++ ) {
+        nodes[i].next = list.head;
+        list.head = &nodes[i];
+    }
+    list.idle = MAX_THREADS;
+
+    printf( "%-8s %18s %18s\n", "threads", "blocking ops/us", "adaptive ops/us" );
+    for( threads = 1; threads <= MAX_THREADS; threads *= 2 ) {
+        double blocking = run( 0, threads );
+        double adaptive = run( 1, threads );
+        printf( "%-8d %18.2f %18.2f\n", threads, blocking, adaptive );
+    }
+
+    /* Both locks must have kept the list intact. */
+    ASSERT( list.idle == MAX_THREADS );
+    for( i = 0, n = list.head; n; n = n->next )
+        i++;
+    ASSERT( i == MAX_THREADS );
+
+    return 0;
+}
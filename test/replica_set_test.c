@@ -71,6 +71,49 @@ int test_connect( const char *set_name ) {
     return res;
 }
 
+/* Seeds are probed together, so a dead one neither blocks nor fails the connect. */
+int test_connect_unreachable_seed( const char *set_name ) {
+
+    mongo conn[1];
+    mongo_host_port *node;
+    int res, answered = 0;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    mongo_replica_set_init( conn, set_name );
+    mongo_set_connect_timeout( conn, 2000 );
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT + 100 );
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+
+    res = mongo_replica_set_client( conn );
+
+    if( res != MONGO_OK ) {
+        res = conn->err;
+        mongo_destroy( conn );
+        return res;
+    }
+
+    ASSERT( conn->connected );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+    for( node = conn->replica_set->hosts; node != NULL; node = node->next )
+        if( node->rtt_samples )
+            answered++;
+    ASSERT( answered > 0 );
+
+    mongo_destroy( conn );
+
+    /* with no live seed at all there is no primary */
+    mongo_replica_set_init( conn, set_name );
+    mongo_set_connect_timeout( conn, 500 );
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT + 100 );
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT + 101 );
+    ASSERT( mongo_replica_set_client( conn ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_CONN_NO_PRIMARY );
+    mongo_destroy( conn );
+
+    return MONGO_OK;
+}
+
 int test_reconnect( const char *set_name ) {
 
     mongo conn[1];
@@ -170,11 +213,74 @@ int test_insert_limits( const char *set_name ) {
     return 0;
 }
 
+int test_read_preference( const char *set_name ) {
+    mongo conn[1];
+    mongo *target, *first;
+    mongo_host_port *node;
+    mongo_cursor *cursor;
+    int res, secondaries = 0;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    mongo_replica_set_init( conn, set_name );
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+    mongo_replica_set_set_read_preference( conn, MONGO_READ_SECONDARY, 1000 );
+    res = mongo_replica_set_client( conn );
+
+    if( res != MONGO_OK ) {
+        res = conn->err;
+        return res;
+    }
+
+    for( node = conn->replica_set->hosts; node != NULL; node = node->next ) {
+        ASSERT( !( node->is_primary && node->member ) );
+        if( node->member )
+            secondaries++;
+    }
+    ASSERT( secondaries > 0 );
+
+    /* secondaries within the window take turns */
+    first = mongo_replica_set_read_target( conn );
+    ASSERT( first != NULL && first != conn );
+    for( res = 0; res < secondaries; res++ ) {
+        target = mongo_replica_set_read_target( conn );
+        ASSERT( target != NULL && target != conn );
+    }
+    if( secondaries > 1 )
+        ASSERT( mongo_replica_set_read_target( conn ) != first );
+
+    /* queries go to a secondary with slaveOk, commands to the primary */
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor != NULL );
+    ASSERT( cursor->conn != conn && ( cursor->options & MONGO_SLAVE_OK ) );
+    mongo_cursor_destroy( cursor );
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    /* every member has a round trip, kept fresh by refreshing */
+    ASSERT( mongo_refresh_rtt( conn ) == MONGO_OK );
+    ASSERT( mongo_get_primary_rtt( conn ) >= 0 );
+    for( node = conn->replica_set->hosts, res = 0; node != NULL; node = node->next, res++ )
+        if( node->member )
+            ASSERT( node->rtt_samples == 2 && mongo_get_host_rtt( conn, res ) == node->rtt_usec );
+
+    /* nearest may pick the primary too */
+    conn->replica_set->read_preference = MONGO_READ_NEAREST;
+    for( res = 0; res <= secondaries; res++ )
+        if( mongo_replica_set_read_target( conn ) == conn )
+            break;
+    ASSERT( res <= secondaries );
+
+    mongo_destroy( conn );
+    return MONGO_OK;
+}
+
 int main() {
     ASSERT( test_connect_deprecated( REPLICA_SET_NAME ) == MONGO_OK );
     ASSERT( test_connect( REPLICA_SET_NAME ) == MONGO_OK );
     ASSERT( test_connect( "test-foobar" ) == MONGO_CONN_BAD_SET_NAME );
+    ASSERT( test_connect_unreachable_seed( REPLICA_SET_NAME ) == MONGO_OK );
     ASSERT( test_insert_limits( REPLICA_SET_NAME ) == MONGO_OK );
+    ASSERT( test_read_preference( REPLICA_SET_NAME ) == MONGO_OK );
 
     /*
     ASSERT( test_reconnect( "test-rs" ) == 0 );
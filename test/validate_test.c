@@ -16,6 +16,67 @@ static void make_small_invalid( bson *out, int i ) {
     bson_finish( out );
 }
 
+/* Each placed at every offset from 12 to 33, so that it straddles the 16
+ * and 32 byte blocks of the wide checks, both ending the string and
+ * followed by ".b". Surrogates pass, as they always have. */
+static const struct {
+    const char *sequence;
+    int valid;
+} utf8_cases[] = {
+    { "", 1 },
+    { "\xc3\xa9", 1 },
+    { "\xe4\xb8\xad", 1 },
+    { "\xf0\x9f\x98\x80", 1 },
+    { "\xf4\x8f\xbf\xbf", 1 },
+    { "\xed\xa0\x80", 1 },
+    { "\x80", 0 },
+    { "\xc0\xaf", 0 },
+    { "\xe0\x80\xaf", 0 },
+    { "\xf0\x8f\xbf\xbf", 0 },
+    { "\xf4\x90\x80\x80", 0 },
+    { "\xe2\x82", 0 },
+    { "\xf0\x9f\x98", 0 },
+    { "\xc3\xa9\xa9", 0 },
+    { "\xff", 0 }
+};
+
+static void test_utf8_checks( void ) {
+    char s[64];
+    bson b;
+    size_t length;
+    int impl, i, offset, end, expected_err;
+
+    bson_init( &b );
+    for ( impl = BSON_UTF8_CHECK_SCALAR; impl <= BSON_UTF8_CHECK_AVX2; impl++ ) {
+        if ( bson_utf8_check_force( ( bson_utf8_check_impl )impl ) != BSON_OK )
+            continue;
+
+        for ( i = 0; i < ( int )( sizeof( utf8_cases ) / sizeof( utf8_cases[0] ) ); i++ ) {
+            for ( offset = 12; offset <= 33; offset++ ) {
+                for ( end = 0; end < 2; end++ ) {
+                    length = strlen( utf8_cases[i].sequence );
+                    memset( s, 'a', offset );
+                    memcpy( s + offset, utf8_cases[i].sequence, length );
+                    length += offset;
+                    if ( !end ) {
+                        s[length++] = '.';
+                        s[length++] = 'b';
+                    }
+
+                    /* The dot after a bad sequence is never reached. */
+                    expected_err = !utf8_cases[i].valid ? BSON_NOT_UTF8 : end ? 0 : BSON_FIELD_HAS_DOT;
+                    b.err = 0;
+                    ASSERT( bson_check_field_name( &b, s, length ) ==
+                            ( utf8_cases[i].valid ? BSON_OK : BSON_ERROR ) );
+                    ASSERT( b.err == expected_err );
+                }
+            }
+        }
+    }
+    ASSERT( bson_utf8_check_force( BSON_UTF8_CHECK_BEST ) == BSON_OK );
+    bson_destroy( &b );
+}
+
 int main() {
     mongo conn[1];
     bson b;
@@ -32,6 +93,8 @@ int main() {
     not_utf8[1] = 0xC0;
     not_utf8[2] = '\0';
 
+    test_utf8_checks();
+
     INIT_SOCKETS_FOR_WINDOWS;
     CONN_CLIENT_TEST;
 
@@ -112,6 +175,28 @@ int main() {
     ASSERT( result == BSON_ERROR );
     ASSERT( b.err & BSON_NOT_UTF8 );
 
+    /* Strings long enough for the wide ASCII checks, with the interesting byte past them. */
+    b.err = 0;
+    result = bson_append_string( &b , "foo" ,
+                                 "0123456789abcdef0123456789abcdef0123456789\xc3\xa9" "0123456789abcdef0123456789abcdef" );
+    ASSERT( result == BSON_OK );
+    ASSERT( b.err == 0 );
+
+    result = bson_append_string( &b , "0123456789abcdef0123456789abcdef0123456789.abc" , "bar" );
+    ASSERT( result == BSON_OK );
+    ASSERT( b.err == BSON_FIELD_HAS_DOT );
+
+    b.err = 0;
+    result = bson_append_string( &b , "foo" , "0123456789abcdef0123456789abcdef0123456789\xc0\xc0" );
+    ASSERT( result == BSON_ERROR );
+    ASSERT( b.err & BSON_NOT_UTF8 );
+
+    b.err = 0;
+    result = bson_append_string( &b , "foo" , "0123456789abcdef0123456789abcdef0123456789\xe2\x82" );
+    ASSERT( result == BSON_ERROR );
+    ASSERT( b.err & BSON_NOT_UTF8 );
+    b.err = 0;
+
     for ( j=0; j < BATCH_SIZE; j++ )
         bp[j] = &bs[j];
 
@@ -118,6 +118,123 @@ void test_batch_insert_with_continue( mongo *conn ) {
     }
 }
 
+/* Shrink the message limit so that a small batch is split into several
+ * wire messages, then check both ordered and continue-on-error reporting. */
+void test_batch_insert_split( mongo *conn ) {
+    mongo_write_concern wc[1];
+    mongo_batch_result result[1];
+    bson *objs[100];
+    int saved_max_message_size = conn->max_message_size;
+    int i;
+
+    mongo_cmd_drop_collection( conn, TEST_DB, TEST_COL, NULL );
+    mongo_create_simple_index( conn, TEST_NS, "n", MONGO_INDEX_UNIQUE, NULL );
+
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 1 );
+    mongo_write_concern_finish( wc );
+
+    for( i=0; i<100; i++ ) {
+        objs[i] = bson_alloc();
+        bson_init( objs[i] );
+        bson_append_int( objs[i], "n", i );
+        bson_finish( objs[i] );
+    }
+
+    conn->max_message_size = 10 * bson_size( objs[0] );
+
+    ASSERT( mongo_insert_batch_with_result( conn, TEST_NS, (const bson **)objs, 50,
+        wc, 0, result ) == MONGO_OK );
+    ASSERT( result->messages > 1 );
+    ASSERT( result->failed == 0 );
+    ASSERT( result->first_failed == -1 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 50 );
+
+    /* Documents 0 - 49 are duplicates; ordered mode stops at the first message. */
+    ASSERT( mongo_insert_batch_with_result( conn, TEST_NS, (const bson **)objs, 100,
+        wc, 0, result ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( result->messages == 1 );
+    ASSERT( result->failed == 1 );
+    ASSERT( result->first_failed == 0 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 50 );
+
+    /* With continue on error every message is sent and each failure counted. */
+    ASSERT( mongo_insert_batch_with_result( conn, TEST_NS, (const bson **)objs, 100,
+        wc, MONGO_CONTINUE_ON_ERROR, result ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( result->messages > 1 );
+    ASSERT( result->failed > 0 && result->failed < result->messages );
+    ASSERT( result->first_failed == 0 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 100 );
+
+    conn->max_message_size = saved_max_message_size;
+
+    for( i=0; i<100; i++ ) {
+        bson_destroy( objs[i] );
+        bson_dealloc( objs[i] );
+    }
+    mongo_write_concern_destroy( wc );
+}
+
+void test_write_session( mongo *conn ) {
+    mongo_write_concern wc[1];
+    mongo_write_session session[1];
+    bson b[1];
+    int i;
+
+    mongo_cmd_drop_collection( conn, TEST_DB, TEST_COL, NULL );
+    mongo_create_simple_index( conn, TEST_NS, "n", MONGO_INDEX_UNIQUE, NULL );
+
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 1 );
+    mongo_write_concern_finish( wc );
+
+    /* Writes 10 and 20 repeat earlier values of n. */
+    mongo_write_session_init( session, conn, wc, 8 );
+    for( i=0; i<30; i++ ) {
+        bson_init( b );
+        bson_append_int( b, "n", i % 10 == 0 && i > 0 ? 0 : i );
+        bson_finish( b );
+        ASSERT( mongo_write_session_insert( session, TEST_NS, b ) == MONGO_OK );
+        bson_destroy( b );
+    }
+    ASSERT( mongo_write_session_sync( session ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( session->writes == 30 );
+    ASSERT( session->failed == 2 );
+    ASSERT( session->first_failed == 10 );
+    mongo_write_session_destroy( session );
+
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 28 );
+
+    /* 0 reads the replies every MONGO_WRITE_SESSION_MAX_PENDING writes. */
+    mongo_write_session_init( session, conn, wc, 0 );
+    ASSERT( session->flush_every == MONGO_WRITE_SESSION_MAX_PENDING );
+    for( i=0; i<MONGO_WRITE_SESSION_MAX_PENDING; i++ ) {
+        bson_init( b );
+        bson_append_int( b, "n", 100 + i );
+        bson_finish( b );
+        ASSERT( mongo_write_session_insert( session, TEST_NS, b ) == MONGO_OK );
+        bson_destroy( b );
+    }
+    ASSERT( session->pending_count == 0 );
+    ASSERT( mongo_write_session_remove( session, TEST_NS, bson_shared_empty( ) ) == MONGO_OK );
+    ASSERT( session->pending_count == 1 );
+    ASSERT( mongo_write_session_destroy( session ) == MONGO_OK );
+
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 0 );
+
+    mongo_write_concern_destroy( wc );
+}
+
 /* We can test write concern for update
  * and remove by doing operations on a capped collection. */
 void test_update_and_remove( mongo *conn ) {
@@ -362,6 +479,8 @@ int main() {
         test_write_concern_input( conn );
         test_update_and_remove( conn );
         test_batch_insert_with_continue( conn );
+        test_batch_insert_split( conn );
+        test_write_session( conn );
     }
 
     mongo_destroy( conn );